@@ -0,0 +1,326 @@
+#include "inotifytools/inotify.h"
+#include "inotifytools/inotifytools.h"
+#include "inotifytools_p.h"
+#include "queue.h"
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <thread>
+
+// Microbenchmarks for library internals.  Not run by `make check'; build
+// with `make bench' and run as e.g. `./bench record_stats 10000000'.
+
+#define NUM_WATCHES 1024
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char const* name, long iterations, double secs) {
+	printf("%-32s %10ld runs %10.2f ns/run\n", name, iterations,
+	       secs * 1e9 / iterations);
+}
+
+// Masks as seen from a recursive watch: mostly single events, some with
+// IN_ISDIR and a few combined bits.
+static uint32_t const masks[] = {
+    IN_MODIFY,
+    IN_OPEN,
+    IN_CLOSE_WRITE,
+    IN_ACCESS,
+    IN_CREATE | IN_ISDIR,
+    IN_CLOSE_NOWRITE,
+    IN_ATTRIB,
+    IN_MOVED_FROM,
+    IN_MOVED_TO,
+    IN_DELETE,
+    IN_OPEN | IN_ISDIR,
+    IN_CLOSE_NOWRITE | IN_ISDIR,
+    IN_DELETE_SELF | IN_IGNORED,
+    IN_MOVE_SELF,
+    IN_ACCESS | IN_MODIFY,
+    IN_UNMOUNT,
+};
+#define NUM_MASKS (sizeof(masks) / sizeof(*masks))
+
+static void create_watches(watch** watches) {
+	char name[32];
+	for (int i = 0; i < NUM_WATCHES; ++i) {
+		snprintf(name, sizeof(name), "/bench/%d", i);
+		// The watch descriptors are fake; nothing is added to inotify.
+		watches[i] = create_watch(i + 1, 0, name, 1);
+		if (!watches[i]) {
+			fprintf(stderr, "create_watch failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	inotifytools_initialize_stats();
+}
+
+static void bench_record_stats(long iterations) {
+	static watch* watches[NUM_WATCHES];
+	create_watches(watches);
+
+	struct inotify_event event;
+	memset(&event, 0, sizeof(event));
+
+	// With the watch already looked up, as in the event pipeline.
+	double start = now();
+	for (long i = 0; i < iterations; ++i) {
+		event.wd = i % NUM_WATCHES + 1;
+		event.mask = masks[i % NUM_MASKS];
+		record_stats(&event, watches[i % NUM_WATCHES]);
+	}
+	report("record_stats", iterations, now() - start);
+
+	// Including the lookup by watch descriptor.
+	start = now();
+	for (long i = 0; i < iterations; ++i) {
+		event.wd = i % NUM_WATCHES + 1;
+		event.mask = masks[i % NUM_MASKS];
+		record_stats(&event, 0);
+	}
+	report("record_stats (lookup by wd)", iterations, now() - start);
+
+	if (inotifytools_get_stat_total64(0) != 2 * iterations) {
+		fprintf(stderr,
+			"record_stats: expected %ld events, got %" PRId64 "\n",
+			2 * iterations, inotifytools_get_stat_total64(0));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void bench_sort(long iterations) {
+	static watch* watches[NUM_WATCHES];
+	create_watches(watches);
+
+	struct inotify_event event;
+	memset(&event, 0, sizeof(event));
+	srand(1);
+	for (long i = 0; i < 100 * NUM_WATCHES; ++i) {
+		// Skewed, so some watches are much busier than others
+		int j = rand() % NUM_WATCHES;
+		j = j * j / NUM_WATCHES;
+		event.wd = j + 1;
+		event.mask = masks[i % NUM_MASKS];
+		record_stats(&event, watches[j]);
+	}
+
+	double start = now();
+	for (long i = 0; i < iterations; ++i) {
+		struct rbtree* tree = inotifytools_wd_sorted_by_event(-1);
+		rbdestroy(tree);
+	}
+	report("sort (rbtree)", iterations, now() - start);
+
+	int count;
+	start = now();
+	for (long i = 0; i < iterations; ++i)
+		inotifytools_watches_sorted_by_event(-1, 0, &count);
+	report("sort (array)", iterations, now() - start);
+
+	start = now();
+	for (long i = 0; i < iterations; ++i)
+		inotifytools_watches_sorted_by_event(-1, 10, &count);
+	report("sort (array, top 10)", iterations, now() - start);
+}
+
+static void bench_top(long iterations) {
+	static watch* watches[NUM_WATCHES];
+	create_watches(watches);
+	if (!inotifytools_track_top_watches(20, 0)) {
+		fprintf(stderr, "inotifytools_track_top_watches failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Skewed, so some watches are much busier than others
+	static int busy[4096];
+	srand(1);
+	for (int i = 0; i < 4096; ++i) {
+		int j = rand() % NUM_WATCHES;
+		busy[i] = j * j / NUM_WATCHES;
+	}
+
+	struct inotify_event event;
+	memset(&event, 0, sizeof(event));
+	double start = now();
+	for (long i = 0; i < iterations; ++i) {
+		int j = busy[i % 4096];
+		event.wd = j + 1;
+		event.mask = masks[i % NUM_MASKS];
+		record_stats(&event, watches[j]);
+	}
+	report("record_stats (top 20)", iterations, now() - start);
+
+	int count;
+	start = now();
+	for (long i = 0; i < 1000; ++i)
+		inotifytools_top_watches(&count);
+	report("top_watches", 1000, now() - start);
+}
+
+static void bench_files(long iterations) {
+	static watch* watches[NUM_WATCHES];
+	create_watches(watches);
+	if (!inotifytools_track_top_files(1000, 0)) {
+		fprintf(stderr, "inotifytools_track_top_files failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Events with names, skewed over 64 times as many files as counters
+	static struct {
+		alignas(struct inotify_event) char buf[sizeof(
+		    struct inotify_event) + 16];
+	} events[4096];
+	srand(1);
+	for (int i = 0; i < 4096; ++i) {
+		struct inotify_event* event =
+		    (struct inotify_event*)events[i].buf;
+		int j = rand() % (64 * 1000);
+		j = (long)j * j / (64 * 1000);
+		event->wd = j % NUM_WATCHES + 1;
+		event->mask = masks[i % NUM_MASKS];
+		event->len = 16;
+		snprintf(event->name, 16, "f%d", j);
+	}
+
+	double start = now();
+	for (long i = 0; i < iterations; ++i) {
+		struct inotify_event* event =
+		    (struct inotify_event*)events[i % 4096].buf;
+		record_stats(event, watches[event->wd - 1]);
+	}
+	report("record_stats (top files)", iterations, now() - start);
+
+	int count;
+	start = now();
+	for (long i = 0; i < 1000; ++i)
+		inotifytools_top_files(&count);
+	report("top_files", 1000, now() - start);
+}
+
+static void bench_queue(long iterations) {
+	struct inotify_event event;
+	memset(&event, 0, sizeof(event));
+	for (int consumers = 1; consumers <= 4; consumers *= 2) {
+		struct inotifytools_queue* queue =
+		    inotifytools_queue_new(4096, consumers);
+		if (!queue) {
+			fprintf(stderr, "inotifytools_queue_new failed\n");
+			exit(EXIT_FAILURE);
+		}
+		std::thread threads[4];
+		double start = now();
+		for (int c = 0; c < consumers; ++c) {
+			threads[c] = std::thread([queue, c] {
+				while (!inotifytools_queue_finished(queue)) {
+					if (!inotifytools_queue_pop(queue, c))
+						std::this_thread::yield();
+				}
+			});
+		}
+		for (long i = 0; i < iterations; ++i) {
+			event.wd = i % NUM_WATCHES + 1;
+			event.mask = masks[i % NUM_MASKS];
+			while (!inotifytools_queue_push(queue, &event, NULL))
+				std::this_thread::yield();
+		}
+		inotifytools_queue_close(queue);
+		for (int c = 0; c < consumers; ++c)
+			threads[c].join();
+		char name[32];
+		snprintf(name, sizeof(name), "queue (%d consumer%s)",
+			 consumers, consumers > 1 ? "s" : "");
+		report(name, iterations, now() - start);
+		if (inotifytools_queue_get_stat(queue, -1, 0) != iterations) {
+			fprintf(stderr,
+				"queue: expected %ld events, got %" PRId64
+				"\n",
+				iterations,
+				inotifytools_queue_get_stat(queue, -1, 0));
+			exit(EXIT_FAILURE);
+		}
+		inotifytools_queue_free(queue);
+	}
+}
+
+static void bench_printf(long iterations) {
+	static watch* watches[NUM_WATCHES];
+	create_watches(watches);
+
+	struct {
+		alignas(struct inotify_event) char buf[sizeof(
+		    struct inotify_event) + 16];
+	} buf;
+	struct inotify_event* event = (struct inotify_event*)buf.buf;
+	event->wd = 1;
+	event->mask = IN_CLOSE_WRITE;
+	event->cookie = 0;
+	event->len = 16;
+	strcpy(event->name, "file");
+
+	static struct nstring out;
+	inotifytools_set_printf_timefmt("%F %T");
+	double start = now();
+	for (long i = 0; i < iterations; ++i)
+		inotifytools_snprintf(&out, MAX_STRLEN, event, "%T %w%f %e");
+	report("snprintf (%T %w%f %e)", iterations, now() - start);
+
+	start = now();
+	for (long i = 0; i < iterations; ++i)
+		inotifytools_snprintf(&out, MAX_STRLEN, event, "%N %w%f %e");
+	report("snprintf (%N %w%f %e)", iterations, now() - start);
+}
+
+static struct {
+	char const* name;
+	void (*run)(long iterations);
+	long iterations;
+} const benchmarks[] = {
+    {"record_stats", bench_record_stats, 10000000},
+    {"sort", bench_sort, 1000},
+    {"top", bench_top, 10000000},
+    {"files", bench_files, 10000000},
+    {"queue", bench_queue, 10000000},
+    {"printf", bench_printf, 1000000},
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(*benchmarks))
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <benchmark> [iterations]\n",
+			argv[0]);
+		fprintf(stderr, "Benchmarks:");
+		for (unsigned i = 0; i < NUM_BENCHMARKS; ++i)
+			fprintf(stderr, " %s", benchmarks[i].name);
+		fprintf(stderr, "\n");
+		return EXIT_FAILURE;
+	}
+	unsigned b = 0;
+	while (b < NUM_BENCHMARKS && strcmp(argv[1], benchmarks[b].name))
+		++b;
+	if (b == NUM_BENCHMARKS) {
+		fprintf(stderr, "Unknown benchmark `%s'\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	long iterations = argc > 2 ? atol(argv[2]) : benchmarks[b].iterations;
+	if (iterations <= 0) {
+		fprintf(stderr, "Invalid iteration count `%s'\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	if (!inotifytools_initialize()) {
+		fprintf(stderr, "Couldn't initialize inotify: %s\n",
+			strerror(inotifytools_error()));
+		return EXIT_FAILURE;
+	}
+
+	benchmarks[b].run(iterations);
+	return EXIT_SUCCESS;
+}
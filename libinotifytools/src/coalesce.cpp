@@ -0,0 +1,266 @@
+#include "coalesce.h"
+#include "inotifytools_p.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Events which are passed through at once rather than merged.  Moves have
+// to stay paired, and the rest change which watches exist or what they are
+// called, which the caller needs to know about in order.  New directories
+// are passed through too, so that a recursive caller can watch them before
+// the files created in them are missed.
+#define PASS_THROUGH                                                   \
+	(IN_MOVED_FROM | IN_MOVED_TO | IN_Q_OVERFLOW | IN_IGNORED |    \
+	 IN_UNMOUNT | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Largest event returned: the header and a name of up to NAME_MAX bytes
+#define COALESCED_EVENT_SIZE (sizeof(struct inotify_event) + NAME_MAX + 1)
+
+/**
+ * @internal
+ * The events seen on one name in one watch since the first of them, waiting
+ * to be returned as one event when the window is over.
+ */
+struct pending_event {
+	struct pending_event* prev;
+	struct pending_event* next;
+	struct timespec due;
+	int wd;
+	uint32_t mask;
+	pid_t pid;
+	// When the first of the events was read
+	struct event_time time;
+	char name[NAME_MAX + 1];
+};
+
+static long window_ms = 0;
+// Pending events by (wd, name), and in order of arrival, which is also the
+// order they are due in since every window is the same length
+static struct rbtree* tree_pending = 0;
+static struct pending_event* first_pending = 0;
+static struct pending_event* last_pending = 0;
+
+// An event passed through, held back until the pending events on the same
+// watch have been returned so that it doesn't overtake them
+static struct {
+	alignas(struct inotify_event) char buf[COALESCED_EVENT_SIZE];
+} held, merged;
+static int holding = 0;
+static pid_t held_pid = 0;
+static struct event_time held_time;
+
+static int pending_compare(const char* d1,
+			   const char* d2,
+			   const void* config) {
+	if (!d1 || !d2)
+		return d1 - d2;
+	struct pending_event const* p1 = (struct pending_event const*)d1;
+	struct pending_event const* p2 = (struct pending_event const*)d2;
+	if (p1->wd != p2->wd)
+		return p1->wd - p2->wd;
+	return strcmp(p1->name, p2->name);
+}
+
+static int is_due(struct pending_event const* p, struct timespec const* now) {
+	return p->due.tv_sec < now->tv_sec ||
+	       (p->due.tv_sec == now->tv_sec && p->due.tv_nsec <= now->tv_nsec);
+}
+
+static size_t name_length(struct inotify_event const* event) {
+	size_t max = event->len < NAME_MAX ? event->len : NAME_MAX;
+	return strnlen(event->name, max);
+}
+
+static struct inotify_event* copy_event(void* buf,
+					int wd,
+					uint32_t mask,
+					uint32_t cookie,
+					char const* name,
+					size_t len) {
+	struct inotify_event* event = (struct inotify_event*)buf;
+	event->wd = wd;
+	event->mask = mask;
+	event->cookie = cookie;
+	event->len = len ? len + 1 : 0;
+	memcpy(event->name, name, len);
+	event->name[len] = '\0';
+	return event;
+}
+
+/**
+ * @internal
+ * Set the length of the window in which events on the same name are merged,
+ * or 0 to stop merging.  Events already merged are still returned when due.
+ *
+ * @return 1 on success, 0 and sets errno on error.
+ */
+int coalesce_set_window(long ms) {
+	if (ms < 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	window_ms = ms;
+	return 1;
+}
+
+/**
+ * @internal
+ * @return nonzero if events are being merged, or some are waiting to be
+ *         returned.
+ */
+int coalesce_active() {
+	return window_ms || first_pending || holding;
+}
+
+/**
+ * @internal
+ * Merge an event which passed the filters into the pending event for its
+ * name, starting a new window if there is none.  Events which must not be
+ * merged are held until the next call to coalesce_next().  That must be
+ * called until it returns NULL before another event is added.
+ *
+ * @param time when the event was read; its window is counted from then.
+ */
+void coalesce_add(struct inotify_event const* event,
+		  pid_t pid,
+		  struct event_time const* time) {
+	size_t len = name_length(event);
+	struct pending_event key;
+	key.wd = event->wd;
+	memcpy(key.name, event->name, len);
+	key.name[len] = '\0';
+
+	if (window_ms && event->wd > 0 && !(event->mask & PASS_THROUGH) &&
+	    !((event->mask & IN_ISDIR) && (event->mask & IN_CREATE))) {
+		struct pending_event* p =
+		    tree_pending
+			? (struct pending_event*)rbfind(&key, tree_pending)
+			: 0;
+		if (p) {
+			p->mask |= event->mask;
+			p->pid = pid;
+			return;
+		}
+		if (!tree_pending)
+			tree_pending = rbinit(pending_compare, 0);
+		// Without memory, the event goes through unmerged
+		if (tree_pending &&
+		    (p = (struct pending_event*)malloc(sizeof(*p)))) {
+			memcpy(p->name, key.name, len + 1);
+			p->wd = event->wd;
+			p->mask = event->mask;
+			p->pid = pid;
+			p->time = *time;
+			p->due = time->monotonic;
+			p->due.tv_sec += window_ms / 1000;
+			p->due.tv_nsec += window_ms % 1000 * 1000000L;
+			if (p->due.tv_nsec >= 1000000000L) {
+				++p->due.tv_sec;
+				p->due.tv_nsec -= 1000000000L;
+			}
+			if (rbsearch(p, tree_pending) != p) {
+				free(p);
+			} else {
+				p->prev = last_pending;
+				p->next = 0;
+				if (last_pending)
+					last_pending->next = p;
+				else
+					first_pending = p;
+				last_pending = p;
+				return;
+			}
+		}
+	}
+
+	copy_event(held.buf, event->wd, event->mask, event->cookie, key.name,
+		   len);
+	held_pid = pid;
+	held_time = *time;
+	holding = 1;
+}
+
+/**
+ * @internal
+ * Get the next event which is ready to be returned: a pending event whose
+ * window is over, or a held event once the pending events it would overtake
+ * have been returned.
+ *
+ * @param time set to when the event, or the first of those merged into it,
+ *             was read.
+ *
+ * @return the event, in static storage which is overwritten by the next
+ *         call, or NULL if none is ready yet.
+ */
+struct inotify_event* coalesce_next(struct timespec const* now,
+				    pid_t* pid,
+				    struct event_time* time) {
+	struct pending_event* p = first_pending;
+	if (holding) {
+		// Those due come first, so only those not due need skipping
+		int wd = ((struct inotify_event*)held.buf)->wd;
+		while (p && !is_due(p, now) && wd >= 0 && p->wd != wd)
+			p = p->next;
+		if (!p) {
+			holding = 0;
+			*pid = held_pid;
+			*time = held_time;
+			return (struct inotify_event*)held.buf;
+		}
+	} else if (!p || !is_due(p, now)) {
+		return NULL;
+	}
+
+	struct inotify_event* event = copy_event(
+	    merged.buf, p->wd, p->mask, 0, p->name, strlen(p->name));
+	*pid = p->pid;
+	*time = p->time;
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		first_pending = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	else
+		last_pending = p->prev;
+	rbdelete(p, tree_pending);
+	free(p);
+	return event;
+}
+
+/**
+ * @internal
+ * Get the time the next pending event is due.
+ *
+ * @return 1 and sets @a due if an event is pending, 0 otherwise.
+ */
+int coalesce_next_due(struct timespec* due) {
+	if (holding) {
+		due->tv_sec = 0;
+		due->tv_nsec = 0;
+		return 1;
+	}
+	if (!first_pending)
+		return 0;
+	*due = first_pending->due;
+	return 1;
+}
+
+/**
+ * @internal
+ * Stop merging events and drop those pending.
+ */
+void coalesce_clear() {
+	while (first_pending) {
+		struct pending_event* p = first_pending;
+		first_pending = p->next;
+		free(p);
+	}
+	last_pending = 0;
+	rbdestroy(tree_pending);
+	tree_pending = 0;
+	holding = 0;
+	window_ms = 0;
+}
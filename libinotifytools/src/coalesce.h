@@ -0,0 +1,23 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+#include "inotifytools/inotify.h"
+
+#include <sys/types.h>
+#include <time.h>
+
+struct event_time;
+
+// Internal to the library, so not exported
+#pragma GCC visibility push(hidden)
+int coalesce_set_window(long window_ms);
+int coalesce_active();
+void coalesce_add(struct inotify_event const* event,
+		  pid_t pid,
+		  struct event_time const* time);
+struct inotify_event* coalesce_next(struct timespec const* now,
+				    pid_t* pid,
+				    struct event_time* time);
+int coalesce_next_due(struct timespec* due);
+void coalesce_clear();
+#pragma GCC visibility pop
+#endif	// COALESCE_H
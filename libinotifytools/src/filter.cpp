@@ -0,0 +1,671 @@
+#include "filter.h"
+#include "inotifytools_p.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @internal
+ * A path made of two pieces, usually the watched directory and the name of
+ * the file an event occurred on, so that the two never have to be joined.
+ */
+struct path_view {
+	const char* s1;
+	size_t n1;
+	const char* s2;
+	size_t n2;
+
+	size_t size() const { return n1 + n2; }
+
+	char at(size_t i) const { return i < n1 ? s1[i] : s2[i - n1]; }
+
+	path_view prefix(size_t n) const {
+		path_view ret = *this;
+		if (n <= n1) {
+			ret.n1 = n;
+			ret.n2 = 0;
+		} else {
+			ret.n2 = n - n1;
+		}
+		return ret;
+	}
+};
+
+/**
+ * @internal
+ * One line of a gitignore-style pattern list.
+ */
+struct glob_rule {
+	char* pattern;
+	// Directory the pattern is relative to, ending in '/', or "" for any
+	char* base;
+	size_t base_len;
+	// Absolute spelling of base, so relative and absolute watches both match
+	char* alt_base;
+	size_t alt_base_len;
+	// Pattern up to its last '/', or NULL if it contains "**"
+	char* dir_pattern;
+	int negate;
+	int dir_only;
+	int anchored;
+	int casefold;
+};
+
+struct rule_list {
+	glob_rule* rules;
+	int count;
+	int capacity;
+};
+
+static rule_list exclude_rules;
+static rule_list include_rules;
+
+static int char_eq(char a, char b, int casefold) {
+	if (casefold)
+		return tolower((unsigned char)a) == tolower((unsigned char)b);
+	return a == b;
+}
+
+/**
+ * @internal
+ * Match @a c against the bracket expression starting at @a p.
+ *
+ * @return pointer past the closing ']', or NULL if the expression is not
+ *         terminated, in which case '[' is an ordinary character.
+ */
+static const char* match_class(const char* p,
+			       char c,
+			       int casefold,
+			       int* matched) {
+	const char* q = p + 1;
+	int negate = 0;
+	int found = 0;
+
+	if (*q == '!' || *q == '^') {
+		negate = 1;
+		++q;
+	}
+	for (int first = 1; *q && (*q != ']' || first); first = 0) {
+		unsigned char lo = *q;
+		if (lo == '\\' && q[1])
+			lo = *++q;
+		++q;
+		unsigned char hi = lo;
+		if (*q == '-' && q[1] && q[1] != ']') {
+			++q;
+			if (*q == '\\' && q[1])
+				++q;
+			hi = *q++;
+		}
+		unsigned char lc = tolower((unsigned char)c);
+		unsigned char uc = toupper((unsigned char)c);
+		if (casefold ? ((lc >= lo && lc <= hi) || (uc >= lo && uc <= hi))
+			     : ((unsigned char)c >= lo && (unsigned char)c <= hi))
+			found = 1;
+	}
+	if (*q != ']')
+		return NULL;
+	*matched = found != negate;
+	return q + 1;
+}
+
+/**
+ * @internal
+ * Match the remainder @a p of @a pattern against @a s from index @a i.
+ *
+ * '*' and '?' never match '/', while a "**" path component matches any
+ * number of directories.
+ */
+static int glob_match(const char* pattern,
+		      const char* p,
+		      path_view const& s,
+		      size_t i,
+		      int casefold) {
+	size_t n = s.size();
+	while (*p) {
+		switch (*p) {
+			case '*':
+				if (p[1] == '*' && (p == pattern || p[-1] == '/') &&
+				    (!p[2] || p[2] == '/')) {
+					if (!p[2])
+						return 1;
+					for (size_t j = i; j <= n; ++j) {
+						if ((j == i || s.at(j - 1) == '/') &&
+						    glob_match(pattern, p + 3, s, j,
+							       casefold))
+							return 1;
+					}
+					return 0;
+				}
+				while (*p == '*')
+					++p;
+				for (;; ++i) {
+					if (glob_match(pattern, p, s, i, casefold))
+						return 1;
+					if (i >= n || s.at(i) == '/')
+						return 0;
+				}
+			case '?':
+				if (i >= n || s.at(i) == '/')
+					return 0;
+				++p;
+				++i;
+				continue;
+			case '[': {
+				if (i >= n || s.at(i) == '/')
+					return 0;
+				int matched = 0;
+				const char* next =
+				    match_class(p, s.at(i), casefold, &matched);
+				if (next) {
+					if (!matched)
+						return 0;
+					p = next;
+					++i;
+					continue;
+				}
+				break;
+			}
+			case '\\':
+				if (p[1])
+					++p;
+				break;
+		}
+		if (i >= n || !char_eq(*p, s.at(i), casefold))
+			return 0;
+		++p;
+		++i;
+	}
+	return i == n;
+}
+
+static int under_base(path_view const& s,
+		      size_t start,
+		      const char* base,
+		      size_t len) {
+	if (s.size() <= start + len)
+		return 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (s.at(start + i) != base[i])
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Check whether rule @a r matches the last path component of @a s.
+ *
+ * @param start index of the first character after any leading "./".
+ */
+static int rule_matches(glob_rule const& r,
+			path_view const& s,
+			size_t start,
+			int isdir) {
+	if (r.dir_only && !isdir)
+		return 0;
+
+	size_t off;
+	if (under_base(s, start, r.base, r.base_len))
+		off = start + r.base_len;
+	else if (r.alt_base && under_base(s, start, r.alt_base, r.alt_base_len))
+		off = start + r.alt_base_len;
+	else
+		return 0;
+
+	if (r.anchored)
+		return glob_match(r.pattern, r.pattern, s, off, r.casefold);
+
+	size_t c = s.size();
+	while (c > off && s.at(c - 1) != '/')
+		--c;
+	if (c == s.size())
+		return 0;
+	// "." and ".." are never matched by name
+	if (s.at(c) == '.' &&
+	    (c + 1 == s.size() || (s.at(c + 1) == '.' && c + 2 == s.size())))
+		return 0;
+	return glob_match(r.pattern, r.pattern, s, c, r.casefold);
+}
+
+/**
+ * @internal
+ * gitignore semantics: the last matching pattern decides.
+ */
+static int excluded_at(path_view const& s, size_t start, int isdir) {
+	for (int i = exclude_rules.count - 1; i >= 0; --i) {
+		if (rule_matches(exclude_rules.rules[i], s, start, isdir))
+			return !exclude_rules.rules[i].negate;
+	}
+	return 0;
+}
+
+static int included_at(path_view const& s, size_t start, int isdir) {
+	for (int i = 0; i < include_rules.count; ++i) {
+		if (rule_matches(include_rules.rules[i], s, start, isdir))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * Check an event path against the glob rules.
+ *
+ * Every directory leading to the path is checked top-down, so anything
+ * inside an excluded directory is excluded and anything inside an included
+ * directory is included.
+ *
+ * @param dir watched directory, or the watched file itself.
+ * @param dirlen length of @a dir.
+ * @param name name of the file within @a dir, or "".
+ * @param isdir non-zero if @a name (or @a dir, if @a name is empty) is a
+ *              directory.
+ *
+ * @return GLOB_ACCEPT, GLOB_EXCLUDED or GLOB_NOT_INCLUDED.
+ */
+int glob_filter_check(char const* dir,
+		      size_t dirlen,
+		      char const* name,
+		      int isdir) {
+	path_view s = {dir, dirlen, name, strlen(name)};
+	size_t start = 0;
+	while (s.size() > start + 1 && s.at(start) == '.' &&
+	       s.at(start + 1) == '/')
+		start += 2;
+
+	size_t end = s.size();
+	if (end > start && s.at(end - 1) == '/') {
+		--end;
+		isdir = 1;
+	}
+
+	int included = !include_rules.count;
+	for (size_t k = start + 1; k <= end; ++k) {
+		if (k < end && s.at(k) != '/')
+			continue;
+		path_view level = s.prefix(k);
+		int level_isdir = k < end || isdir;
+		if (exclude_rules.count && excluded_at(level, start, level_isdir))
+			return GLOB_EXCLUDED;
+		if (!included && included_at(level, start, level_isdir))
+			included = 1;
+	}
+
+	return included ? GLOB_ACCEPT : GLOB_NOT_INCLUDED;
+}
+
+/**
+ * @internal
+ * Find where paths inside directory @a dir, which ends in '/', start being
+ * relative to the base of rule @a r.
+ *
+ * @return the offset in @a dir, or (size_t)-1 if @a dir is not below base.
+ */
+static size_t rule_offset(glob_rule const& r,
+			  path_view const& dir,
+			  size_t start) {
+	path_view s = dir;
+	// A file inside base is below it even when dir is base itself
+	s.n2 = 1;
+	s.s2 = "x";
+
+	if (under_base(s, start, r.base, r.base_len))
+		return start + r.base_len;
+	if (r.alt_base && under_base(s, start, r.alt_base, r.alt_base_len))
+		return start + r.alt_base_len;
+	return (size_t)-1;
+}
+
+/**
+ * @internal
+ * Check whether directory @a dir lies strictly above @a base.
+ */
+static int above_base(path_view const& dir,
+		      size_t start,
+		      const char* base,
+		      size_t len) {
+	if (dir.size() - start >= len)
+		return 0;
+	for (size_t i = start; i < dir.size(); ++i) {
+		if (dir.at(i) != base[i - start])
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Check whether rule @a r could match some file directly inside directory
+ * @a dir, which ends in '/'.  Errs on the side of returning 1.
+ */
+static int rule_may_match_name(glob_rule const& r,
+			       path_view const& dir,
+			       size_t start) {
+	size_t off = rule_offset(r, dir, start);
+	if (off == (size_t)-1)
+		return 0;
+
+	if (!r.anchored || !r.dir_pattern)
+		return 1;
+	// The pattern's directory part must match the directory exactly
+	if (off == dir.size())
+		return !*r.dir_pattern;
+	return glob_match(r.dir_pattern, r.dir_pattern, dir.prefix(dir.size() - 1),
+			  off, r.casefold);
+}
+
+/**
+ * @internal
+ * Work out the verdict for every event in directory @a dir at once.
+ *
+ * @param dir watched directory, ending in '/'.
+ *
+ * @return GLOB_EXCLUDED, GLOB_ACCEPT or GLOB_NOT_INCLUDED if all files in
+ *         @a dir share that verdict, GLOB_CHECK_NAME if it depends on the
+ *         name.
+ */
+int glob_filter_dir_verdict(char const* dir, size_t dirlen) {
+	path_view s = {dir, dirlen, "", 0};
+	size_t start = 0;
+	while (s.size() > start + 1 && s.at(start) == '.' &&
+	       s.at(start + 1) == '/')
+		start += 2;
+	if (s.size() <= start || s.at(s.size() - 1) != '/')
+		return GLOB_CHECK_NAME;
+
+	int included = !include_rules.count;
+	for (size_t k = start + 1; k < s.size(); ++k) {
+		if (s.at(k) != '/')
+			continue;
+		path_view level = s.prefix(k);
+		if (exclude_rules.count && excluded_at(level, start, 1))
+			return GLOB_EXCLUDED;
+		if (!included && included_at(level, start, 1))
+			included = 1;
+	}
+
+	int may_exclude = 0;
+	for (int i = 0; i < exclude_rules.count && !may_exclude; ++i) {
+		if (!exclude_rules.rules[i].negate &&
+		    rule_may_match_name(exclude_rules.rules[i], s, start))
+			may_exclude = 1;
+	}
+	if (included)
+		return may_exclude ? GLOB_CHECK_NAME : GLOB_ACCEPT;
+
+	for (int i = 0; i < include_rules.count; ++i) {
+		if (rule_may_match_name(include_rules.rules[i], s, start))
+			return GLOB_CHECK_NAME;
+	}
+	return may_exclude ? GLOB_CHECK_NAME : GLOB_NOT_INCLUDED;
+}
+
+/**
+ * @internal
+ * Check whether rule @a r could match some path below directory @a dir,
+ * which ends in '/'.  Errs on the side of returning 1.
+ */
+static int rule_may_match_below(glob_rule const& r,
+				path_view const& dir,
+				size_t start) {
+	if (above_base(dir, start, r.base, r.base_len) ||
+	    (r.alt_base && above_base(dir, start, r.alt_base, r.alt_base_len)))
+		return 1;
+	size_t off = rule_offset(r, dir, start);
+	if (off == (size_t)-1)
+		return 0;
+	if (!r.anchored || !r.dir_pattern)
+		return 1;
+
+	// A pattern without "**" matches a fixed number of components, the
+	// first of which must match the components of dir
+	size_t depth = 0;
+	for (size_t i = off; i < dir.size(); ++i) {
+		if (dir.at(i) == '/')
+			++depth;
+	}
+	if (!depth)
+		return 1;
+	const char* end = r.pattern;
+	for (size_t i = 0; i < depth; ++i) {
+		end = strchr(end, '/');
+		if (!end)
+			return 0;
+		++end;
+	}
+	char* prefix = strndup(r.pattern, end - r.pattern - 1);
+	if (!prefix)
+		return 1;
+	int ret = glob_match(prefix, prefix, dir.prefix(dir.size() - 1), off,
+			     r.casefold);
+	free(prefix);
+	return ret;
+}
+
+/**
+ * @internal
+ * Work out how much of directory @a dir needs watching given the glob rules.
+ *
+ * @param dir directory, ending in '/'.
+ *
+ * @return WATCH_NONE if no event in or below @a dir can pass the filters,
+ *         WATCH_DIRS_ONLY if only paths below its subdirectories can, and
+ *         WATCH_FULL otherwise.
+ */
+int glob_filter_watch_mode(char const* dir, size_t dirlen) {
+	int verdict = glob_filter_dir_verdict(dir, dirlen);
+	if (verdict == GLOB_EXCLUDED)
+		return WATCH_NONE;
+	if (verdict != GLOB_NOT_INCLUDED)
+		return WATCH_FULL;
+
+	path_view s = {dir, dirlen, "", 0};
+	size_t start = 0;
+	while (s.size() > start + 1 && s.at(start) == '.' &&
+	       s.at(start + 1) == '/')
+		start += 2;
+	for (int i = 0; i < include_rules.count; ++i) {
+		if (rule_may_match_below(include_rules.rules[i], s, start))
+			return WATCH_DIRS_ONLY;
+	}
+	return WATCH_NONE;
+}
+
+/**
+ * @internal
+ * Check whether the subdirectory @a name of @a parent is excluded, so that
+ * recursive watching does not descend into it.
+ */
+int glob_filter_excludes_dir(char const* parent, char const* name) {
+	if (!exclude_rules.count)
+		return 0;
+	return glob_filter_check(parent, strlen(parent), name, 1) ==
+	       GLOB_EXCLUDED;
+}
+
+int glob_filter_active() {
+	return exclude_rules.count || include_rules.count;
+}
+
+static void free_rule(glob_rule* r) {
+	free(r->pattern);
+	free(r->base);
+	free(r->alt_base);
+	free(r->dir_pattern);
+}
+
+static void clear_list(rule_list* list) {
+	for (int i = 0; i < list->count; ++i)
+		free_rule(&list->rules[i]);
+	free(list->rules);
+	list->rules = 0;
+	list->count = 0;
+	list->capacity = 0;
+}
+
+void glob_filter_clear() {
+	clear_list(&exclude_rules);
+	clear_list(&include_rules);
+}
+
+/**
+ * @internal
+ * Parse one gitignore-style pattern and append it to @a list.
+ *
+ * @param base directory the pattern is relative to, ending in '/', or "".
+ * @param alt_base absolute spelling of @a base, or NULL.
+ * @param allow_negate non-zero if a leading '!' negates the pattern.
+ * @param strip_root non-zero if a leading '/' anchors the pattern to
+ *                   @a base rather than to the root directory.
+ *
+ * @return 1 on success, 0 if out of memory, -1 if the pattern is empty.
+ */
+static int add_rule(rule_list* list,
+		    char const* line,
+		    char const* base,
+		    char const* alt_base,
+		    int flags,
+		    int allow_negate,
+		    int strip_root) {
+	glob_rule r = {};
+	if (allow_negate && line[0] == '!') {
+		r.negate = 1;
+		++line;
+	} else if (line[0] == '\\' && (line[1] == '!' || line[1] == '#')) {
+		++line;
+	}
+
+	size_t len = strlen(line);
+	while (len && line[len - 1] == '/') {
+		r.dir_only = 1;
+		--len;
+	}
+	if (strip_root) {
+		while (len && line[0] == '/') {
+			r.anchored = 1;
+			++line;
+			--len;
+		}
+	}
+	if (!len)
+		return -1;
+	if (memchr(line, '/', len))
+		r.anchored = 1;
+	r.casefold = !!(flags & FNM_CASEFOLD);
+
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? 2 * list->capacity : 16;
+		glob_rule* mem = (glob_rule*)realloc(
+		    list->rules, capacity * sizeof(glob_rule));
+		if (!mem)
+			return 0;
+		list->rules = mem;
+		list->capacity = capacity;
+	}
+
+	r.pattern = strndup(line, len);
+	if (r.pattern && !strstr(r.pattern, "**")) {
+		const char* slash = strrchr(r.pattern, '/');
+		r.dir_pattern =
+		    strndup(r.pattern, slash ? slash - r.pattern : 0);
+	}
+	r.base = strdup(base);
+	r.base_len = strlen(base);
+	if (alt_base) {
+		r.alt_base = strdup(alt_base);
+		r.alt_base_len = strlen(alt_base);
+	}
+	if (!r.pattern || !r.base || (alt_base && !r.alt_base) ||
+	    (!r.dir_pattern && !strstr(r.pattern, "**"))) {
+		free_rule(&r);
+		return 0;
+	}
+	list->rules[list->count++] = r;
+	return 1;
+}
+
+/**
+ * @internal
+ * Add a pattern matched anywhere below the watched paths.
+ *
+ * @param invert 0 to exclude matching files, 1 to only include matching
+ *               files.
+ */
+int glob_filter_add(char const* pattern, int flags, int invert) {
+	if (!pattern || !*pattern) {
+		errno = EINVAL;
+		return 0;
+	}
+	if (add_rule(invert ? &include_rules : &exclude_rules, pattern, "", 0,
+		     flags, !invert, 0) <= 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Read exclude patterns from a file in gitignore(5) syntax.  Patterns are
+ * relative to the directory containing the file.
+ */
+int glob_filter_add_file(char const* filename) {
+	FILE* file = fopen(filename, "r");
+	if (!file)
+		return 0;
+
+	char base[PATH_MAX + 1];
+	const char* slash = strrchr(filename, '/');
+	size_t base_len = slash ? slash - filename + 1 : 0;
+	if (base_len > PATH_MAX) {
+		fclose(file);
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	memcpy(base, filename, base_len);
+	base[base_len] = 0;
+
+	char alt_base[PATH_MAX + 2];
+	const char* alt = 0;
+	if (base[0] != '/' && realpath(base_len ? base : ".", alt_base)) {
+		size_t alt_len = strlen(alt_base);
+		if (alt_base[alt_len - 1] != '/')
+			strcpy(&alt_base[alt_len], "/");
+		alt = alt_base;
+	}
+
+	// Normalise "./dir/" to "dir/" to match watch paths the same way
+	char* rel = base;
+	while (rel[0] == '.' && rel[1] == '/')
+		rel += 2;
+
+	char* line = 0;
+	size_t capacity = 0;
+	ssize_t len;
+	int ret = 1;
+	while ((len = getline(&line, &capacity, file)) >= 0) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		// Trailing spaces are ignored unless escaped
+		while (len && line[len - 1] == ' ' &&
+		       !(len > 1 && line[len - 2] == '\\'))
+			line[--len] = 0;
+		if (!len || line[0] == '#')
+			continue;
+		if (!add_rule(&exclude_rules, line, rel, alt, 0, 1, 1)) {
+			errno = ENOMEM;
+			ret = 0;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(file);
+	return ret;
+}
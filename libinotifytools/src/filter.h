@@ -0,0 +1,28 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include <stddef.h>
+
+#define GLOB_ACCEPT 0
+#define GLOB_EXCLUDED 1
+#define GLOB_NOT_INCLUDED 2
+#define GLOB_CHECK_NAME 3
+
+#define WATCH_FULL 0
+#define WATCH_DIRS_ONLY 1
+#define WATCH_NONE 2
+
+// Only the library uses these, so they're kept out of its exported symbols
+#pragma GCC visibility push(hidden)
+int glob_filter_add(char const* pattern, int flags, int invert);
+int glob_filter_add_file(char const* filename);
+void glob_filter_clear();
+int glob_filter_active();
+int glob_filter_check(char const* dir,
+		      size_t dirlen,
+		      char const* name,
+		      int isdir);
+int glob_filter_excludes_dir(char const* parent, char const* name);
+int glob_filter_dir_verdict(char const* dir, size_t dirlen);
+int glob_filter_watch_mode(char const* dir, size_t dirlen);
+#pragma GCC visibility pop
+#endif	// FILTER_H
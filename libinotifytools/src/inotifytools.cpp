@@ -14,20 +14,28 @@
 
 #include "inotifytools/inotifytools.h"
 #include "../../config.h"
+#include "coalesce.h"
+#include "filter.h"
 #include "inotifytools_p.h"
+#include "probes.h"
+#include "scanner.h"
 #include "stats.h"
 
+#include <algorithm>
+
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <regex.h>
-#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -47,7 +55,6 @@ struct fanotify_event_fid;
 // Linux only
 #define LINUX_FANOTIFY
 
-#include <fcntl.h>
 #include <sys/vfs.h>
 #include "inotifytools/fanotify.h"
 
@@ -199,12 +206,149 @@ struct str {
 };
 
 static str timefmt;
+/* Bumped whenever timefmt changes, to invalidate the cached %T string */
+static unsigned timefmt_generation = 1;
+/**
+ * @internal
+ * The events read from the inotify or fanotify descriptor and not yet
+ * returned, and where the next one starts.
+ */
+struct event_reader {
+	// second half of events[] is for fanotify->inotify conversion
+	struct inotify_event events[2 * MAX_EVENTS];
+	int first_byte;
+	ssize_t bytes;
+	ssize_t this_bytes;
+	// When the events in the buffer were read
+	struct event_time time;
+};
+static struct event_reader reader;
+/* When the event last returned was read */
+static struct event_time last_event_time;
+static struct inotifytools_perf_counters perf;
+static int perf_timers = 0;
 static regex_t* regex = 0;
 /* 0: --exclude[i], 1: --include[i] */
 static int invert_regexp = 0;
+/* Whether a match can be decided from the directory part of a path alone */
+static int regex_dir_scoped = 0;
+static int regex_dir_safe = 0;
+/* Don't watch directories the filters would discard all events from */
+static int prune_watches = 0;
+/* Bumped whenever filters change, to invalidate watch verdicts */
+static unsigned filter_generation = 1;
+/* Bumped whenever a watch is created or destroyed */
+static unsigned watch_generation = 1;
+/* Ring of watches created for fanotify fids, when limited */
+static watch** fid_watches = 0;
+static int fid_watch_limit = 0;
+static int num_fid_watches = 0;
+static int fid_clock_hand = 0;
+/* Statistics of watches evicted from fid_watches */
+watch* evicted_stats = 0;
+/* Levels of directories recursive watches set up front, or -1 for all */
+static int lazy_depth = -1;
+/* Whether some watches are waiting for activity to watch their
+ * subdirectories */
+static int lazy_expansion = 0;
+/* Ring of watches added on activity in lazily watched trees, when limited */
+static watch** lazy_watches = 0;
+static int lazy_watch_limit = 0;
+static int num_lazy_watches = 0;
+static int lazy_clock_hand = 0;
+/* Watches removed from lazy_watches which IN_IGNORED is still to come for */
+static int num_evicted_lazy = 0;
+/* Directories excluded from lazily watched trees, NULL terminated */
+static char** lazy_exclude = 0;
+static int num_lazy_exclude = 0;
+/* Whether directories on network filesystems, and those inotify has no
+ * watches left for, are polled */
+static int polling = 0;
+/* Whether the watches being added are polled regardless */
+static int forced_polling = 0;
+/* While a tree is watched with polling on, whether its root is on a network
+ * filesystem, which the directories in it take after, or -1 */
+static int remote_tree = -1;
+/* Levels below the watch roots to roll statistics up to, or -1 */
+static int aggregate_depth = -1;
+/* Bumped whenever aggregate_depth changes, to invalidate watch::aggregate */
+static unsigned aggregate_generation = 1;
+/* Directories statistics are rolled up to, by filename */
+struct rbtree* tree_aggregate = 0;
+/* All watches, for inotifytools_watches_sorted_by_event() */
+static watch** sorted_watches = 0;
+static int num_sorted_watches = 0;
+static int sorted_watches_size = 0;
+static unsigned sorted_watches_generation = 0;
+
+#define REGEX_MATCH 0
+#define REGEX_NO_MATCH 1
+#define REGEX_CHECK_NAME 2
+
+/**
+ * @internal
+ * An event being passed through the filter stages.
+ */
+struct event_info {
+	struct inotify_event* event;
+	// pid of the process which caused a fanotify event, or 0
+	pid_t pid;
+	// watch the event occurred on, if it was needed
+	struct watch* w;
+	// whether w's cached filter verdicts can be used
+	int cached;
+	// when the event was read
+	struct event_time time;
+};
+
+/**
+ * @internal
+ * A step in the event filtering pipeline.  @a accept returns 0 to drop the
+ * event.
+ *
+ * Each event runs through the stages as it is taken from the read buffer,
+ * rather than the whole buffer at once, since the watches an event adds,
+ * as in lazily watched trees, decide how the events after it are filtered.
+ */
+struct filter_stage {
+	char const* name;
+	int (*accept)(struct event_info const* info, void* data);
+	// Set instead of accept for filters added by inotifytools_add_filter()
+	inotifytools_filter_fn filter;
+	void* data;
+	unsigned long dropped;
+};
+
+static int next_filtered_event(struct timespec const* deadline,
+			       int num_events,
+			       struct event_info* info);
+static int accept_not_self(struct event_info const* info, void* data);
+static int accept_regex(struct event_info const* info, void* data);
+static int accept_glob(struct event_info const* info, void* data);
+
+#define NUM_BUILTIN_FILTER_STAGES 3
+#define MAX_FILTER_STAGES 16
+
+static struct filter_stage filter_stages[MAX_FILTER_STAGES] = {
+    {"self", accept_not_self, 0, 0, 0},
+    {"regex", accept_regex, 0, 0, 0},
+    {"glob", accept_glob, 0, 0, 0},
+};
+static int num_filter_stages = NUM_BUILTIN_FILTER_STAGES;
+
+static inotifytools_handler_fn handler = 0;
+static void* handler_data = 0;
 
 static int isdir(char const* path);
-void record_stats(struct inotify_event const* event);
+static int watch_mode(char const* dir);
+static int lazy_activity(struct inotify_event const* event);
+static watch* parent_watch(char const* filename);
+static int watch_tree(char const* path,
+		      int events,
+		      char const** exclude_list,
+		      int levels);
+static void admit_lazy_watch(watch* w);
+static int set_lazy_watch_limit(int max_watches);
 int onestr_to_event(char const* event);
 
 #define nasprintf(...) niceassert(-1 != asprintf(__VA_ARGS__), "out of memory")
@@ -308,7 +452,7 @@ static int filename_compare(const char* d1,
 /**
  * @internal
  */
-watch* watch_from_wd(int wd) {
+watch* watch_from_wd(unsigned long wd) {
 	watch w;
 	w.wd = wd;
 	return (watch*)rbfind(&w, tree_wd);
@@ -355,12 +499,19 @@ int inotifytools_init(int fanotify, int watch_filesystem, int verbose) {
 		fanotify_mode = 1;
 		fanotify_mark_type =
 		    watch_filesystem ? FAN_MARK_FILESYSTEM : FAN_MARK_INODE;
-		inotify_fd =
-		    fanotify_init(FAN_REPORT_FID | FAN_REPORT_DFID_NAME, 0);
+		inotify_fd = fanotify_init(
+		    FAN_CLOEXEC | FAN_REPORT_FID | FAN_REPORT_DFID_NAME, 0);
 #endif
 	} else {
 		fanotify_mode = 0;
+		// Not passed on to the commands run for events
+#ifdef IN_CLOEXEC
+		inotify_fd = inotify_init1(IN_CLOEXEC);
+#else
 		inotify_fd = inotify_init();
+		if (inotify_fd >= 0)
+			fcntl(inotify_fd, F_SETFD, FD_CLOEXEC);
+#endif
 	}
 	if (inotify_fd < 0) {
 		error = errno;
@@ -368,11 +519,14 @@ int inotifytools_init(int fanotify, int watch_filesystem, int verbose) {
 	}
 
 	collect_stats = 0;
+	collect_rates = 0;
 	initialized = 1;
 	tree_wd = rbinit(wd_compare, 0);
 	tree_fid = rbinit(fid_compare, 0);
 	tree_filename = rbinit(filename_compare, 0);
+	tree_aggregate = rbinit(filename_compare, 0);
 	timefmt.clear();
+	inotifytools_reset_perf_counters();
 
 	return 1;
 }
@@ -381,16 +535,97 @@ int inotifytools_initialize() {
 	return inotifytools_init(0, 0, 0);
 }
 
+/**
+ * @internal
+ * Whether @a w is below the directory watched by @a dir, which is named with
+ * or without a trailing '/'.
+ */
+static int watch_contains(watch const* dir, watch const* w) {
+	size_t len = strlen(dir->filename);
+	return dir != w && len && !strncmp(dir->filename, w->filename, len) &&
+	       (dir->filename[len - 1] == '/' || w->filename[len] == '/');
+}
+
+/**
+ * @internal
+ * Set the parent of @a w to the closest watched directory containing it.
+ */
+static void link_parent(watch* w) {
+	w->parent = 0;
+	watch key;
+	key.filename = strdup(w->filename);
+	if (!key.filename)
+		return;
+	size_t len = strlen(key.filename);
+	if (len && key.filename[len - 1] == '/')
+		--len;
+	while (!w->parent) {
+		while (len && key.filename[len - 1] != '/')
+			--len;
+		if (!len)
+			break;
+		key.filename[len] = 0;
+		w->parent = (watch*)rbfind(&key, tree_filename);
+		// fanotify filesystem watches are named without the '/'
+		key.filename[--len] = 0;
+		if (!w->parent)
+			w->parent = (watch*)rbfind(&key, tree_filename);
+	}
+	free(key.filename);
+}
+
+/**
+ * @internal
+ * Move the watches below @a dir whose parent is @a from to @a to.
+ */
+static void reparent_watches(watch* dir, watch* from, watch* to) {
+	size_t len = strlen(dir->filename);
+	watch const* d = dir;
+	while ((d = (watch const*)rblookup(RB_LUGREAT, d, tree_filename)) &&
+	       !strncmp(d->filename, dir->filename, len)) {
+		if (d->parent == from && watch_contains(dir, d))
+			((watch*)d)->parent = to;
+	}
+}
+
+/**
+ * @internal
+ * Remove @a w from tree_filename, handing the watches it was the parent of
+ * to its own parent.
+ */
+static void unlink_filename(watch* w) {
+	rbdelete(w, tree_filename);
+	reparent_watches(w, w, w->parent);
+}
+
 /**
  * @internal
  */
 void destroy_watch(watch* w) {
+	PROBE2(watch_remove, w->wd, w->filename);
+	++watch_generation;
+	top_forget_watch(w);
+	if (w->fid_slot) {
+		watch* last = fid_watches[--num_fid_watches];
+		fid_watches[w->fid_slot - 1] = last;
+		last->fid_slot = w->fid_slot;
+		if (fid_clock_hand >= num_fid_watches)
+			fid_clock_hand = 0;
+	}
+	if (w->lazy_slot) {
+		watch* last = lazy_watches[--num_lazy_watches];
+		lazy_watches[w->lazy_slot - 1] = last;
+		last->lazy_slot = w->lazy_slot;
+		if (lazy_clock_hand >= num_lazy_watches)
+			lazy_clock_hand = 0;
+	}
 	if (w->filename)
 		free(w->filename);
 	if (w->fid)
 		free(w->fid);
 	if (w->dirf)
 		close(w->dirf);
+	free(w->rates);
 	free(w);
 }
 
@@ -407,6 +642,67 @@ void cleanup_tree(const void* nodep,
 	destroy_watch(w);
 }
 
+/**
+ * @internal
+ * Forget a watch created for a fanotify fid, adding its statistics to
+ * those of the evicted watches.
+ */
+static void evict_fid_watch(watch* w) {
+	if (!evicted_stats) {
+		evicted_stats = (watch*)calloc(1, sizeof(watch));
+		if (evicted_stats)
+			evicted_stats->filename = strdup("(other)");
+	}
+	if (evicted_stats) {
+		for (int i = 0; i < STAT_SLOTS; ++i)
+			evicted_stats->hit[i] += w->hit[i];
+	}
+	w->fid_slot = 0;
+	rbdelete(w, tree_wd);
+	rbdelete(w, tree_fid);
+	unlink_filename(w);
+	destroy_watch(w);
+}
+
+/**
+ * @internal
+ * Add a watch created for a fanotify fid to the ring, evicting the first
+ * watch without events since the clock hand last passed it if it is full.
+ */
+static void admit_fid_watch(watch* w) {
+	w->referenced = 1;
+	if (num_fid_watches < fid_watch_limit) {
+		fid_watches[num_fid_watches] = w;
+		w->fid_slot = ++num_fid_watches;
+		return;
+	}
+	for (;;) {
+		watch* old = fid_watches[fid_clock_hand];
+		if (old->referenced) {
+			old->referenced = 0;
+			fid_clock_hand = (fid_clock_hand + 1) % fid_watch_limit;
+			continue;
+		}
+		evict_fid_watch(old);
+		fid_watches[fid_clock_hand] = w;
+		w->fid_slot = fid_clock_hand + 1;
+		fid_clock_hand = (fid_clock_hand + 1) % fid_watch_limit;
+		return;
+	}
+}
+
+/**
+ * @internal
+ * Forget the directories excluded from lazily watched trees.
+ */
+static void free_lazy_exclude() {
+	for (int i = 0; i < num_lazy_exclude; ++i)
+		free(lazy_exclude[i]);
+	free(lazy_exclude);
+	lazy_exclude = 0;
+	num_lazy_exclude = 0;
+}
+
 /**
  * Close inotify and free the memory used by inotifytools.
  *
@@ -420,17 +716,65 @@ void inotifytools_cleanup() {
 	initialized = 0;
 	close(inotify_fd);
 	collect_stats = 0;
+	collect_rates = 0;
 	error = 0;
 	timefmt.clear();
+	++timefmt_generation;
+	reader.first_byte = 0;
+	reader.bytes = 0;
+	memset(&reader.time, 0, sizeof(reader.time));
+	memset(&last_event_time, 0, sizeof(last_event_time));
+	perf_timers = 0;
 
 	if (regex) {
 		regfree(regex);
 		free(regex);
 		regex = 0;
 	}
+	glob_filter_clear();
+	++filter_generation;
+	prune_watches = 0;
+	num_filter_stages = NUM_BUILTIN_FILTER_STAGES;
+	for (int i = 0; i < num_filter_stages; ++i)
+		filter_stages[i].dropped = 0;
+	handler = 0;
+	handler_data = 0;
+	coalesce_clear();
+	scan_clear();
+	polling = 0;
+
+	track_top_watches(0, 0);
+	track_top_files(0, 0);
+	free(sorted_watches);
+	sorted_watches = 0;
+	num_sorted_watches = 0;
+	sorted_watches_size = 0;
+
+	rbwalk(tree_aggregate, cleanup_tree, 0);
+	rbdestroy(tree_aggregate);
+	tree_aggregate = 0;
+	aggregate_depth = -1;
+	++aggregate_generation;
 
 	rbwalk(tree_wd, cleanup_tree, 0);
 	rbdestroy(tree_wd);
+	free(fid_watches);
+	fid_watches = 0;
+	fid_watch_limit = 0;
+	num_fid_watches = 0;
+	fid_clock_hand = 0;
+	if (evicted_stats)
+		destroy_watch(evicted_stats);
+	evicted_stats = 0;
+	free(lazy_watches);
+	lazy_watches = 0;
+	lazy_watch_limit = 0;
+	num_lazy_watches = 0;
+	lazy_clock_hand = 0;
+	num_evicted_lazy = 0;
+	lazy_depth = -1;
+	lazy_expansion = 0;
+	free_lazy_exclude();
 	rbdestroy(tree_fid);
 	rbdestroy(tree_filename);
 	tree_wd = 0;
@@ -467,6 +811,8 @@ static void replace_filename_impl(const void* nodep,
 			rbdelete(w, tree_filename);
 			free(w->filename);
 			w->filename = name;
+			w->filter_generation = 0;
+			w->aggregate_generation = 0;
 			rbsearch(w, tree_filename);
 		}
 	}
@@ -801,13 +1147,33 @@ char* inotifytools_event_to_str_sep(int events, char sep) {
 }
 
 /**
- * Get the filename from fid.
- *
- * Resolve filename from fid + name and return
- * static filename string.
+ * @internal
+ * @return the CLOCK_MONOTONIC time in nanoseconds if the stage timers of
+ *         inotifytools_set_perf_timers() are on, 0 otherwise.
  */
-static const char* inotifytools_filename_from_fid(
-    struct fanotify_event_fid* fid) {
+static uint64_t perf_now() {
+	if (!perf_timers)
+		return 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @internal
+ * Add the time since @a start, from perf_now(), to the timer @a ns.
+ */
+static void perf_add(uint64_t* ns, uint64_t start) {
+	if (start)
+		*ns += perf_now() - start;
+}
+
+/**
+ * @internal
+ * Resolve the path of @a fid for inotifytools_filename_from_fid(), counting
+ * the system calls made in inotifytools_perf_counters::fid_syscalls.
+ */
+static const char* resolve_fid(struct fanotify_event_fid* fid) {
 #ifdef LINUX_FANOTIFY
 	static char filename[PATH_MAX];
 	struct fanotify_event_fid fsid = {};
@@ -833,6 +1199,7 @@ static const char* inotifytools_filename_from_fid(
 
 	// Try to get path from file handle
 	dirf = open_by_handle_at(mount_fd, &fid->handle, 0);
+	++perf.fid_syscalls;
 	if (dirf > 0) {
 		// Got path by handle
 	} else if (fanotify_mark_type == FAN_MARK_FILESYSTEM) {
@@ -854,7 +1221,7 @@ static const char* inotifytools_filename_from_fid(
 			return NULL;
 		}
 
-		dirf = w->dirf ? dup(w->dirf) : -1;
+		dirf = w->dirf ? (++perf.fid_syscalls, dup(w->dirf)) : -1;
 		if (dirf < 0) {
 			fprintf(stderr, "Failed to get directory fd.\n");
 			return NULL;
@@ -869,6 +1236,8 @@ static const char* inotifytools_filename_from_fid(
 	// PATH_MAX - 2 because we have to append two characters to this path,
 	// '/' and 0
 	len = readlink(sym, filename, PATH_MAX - 2);
+	// and the close() below
+	perf.fid_syscalls += 2;
 	if (len < 0) {
 		close(dirf);
 		fprintf(stderr, "Failed to resolve path from directory fd.\n");
@@ -882,6 +1251,7 @@ static const char* inotifytools_filename_from_fid(
 		const char* name = (const char*)fid->handle.f_handle +
 				   fid->handle.handle_bytes;
 		int deleted = faccessat(dirf, name, F_OK, AT_SYMLINK_NOFOLLOW);
+		++perf.fid_syscalls;
 		if (deleted && errno != ENOENT) {
 			fprintf(stderr, "Failed to access file %s (%s).\n",
 				name, strerror(errno));
@@ -899,6 +1269,21 @@ static const char* inotifytools_filename_from_fid(
 #endif
 }
 
+/**
+ * Get the filename from fid.
+ *
+ * Resolve filename from fid + name and return
+ * static filename string.
+ */
+static const char* inotifytools_filename_from_fid(
+    struct fanotify_event_fid* fid) {
+	uint64_t start = perf_now();
+	const char* filename = resolve_fid(fid);
+	perf_add(&perf.resolve_ns, start);
+	PROBE2(fid_resolve, 0, filename);
+	return filename;
+}
+
 /**
  * Get the filename from a watch.
  *
@@ -1071,6 +1456,9 @@ void inotifytools_set_filename_by_wd(int wd, char const* filename) {
 	if (w->filename)
 		free(w->filename);
 	w->filename = strdup(filename);
+	w->filter_generation = 0;
+	w->aggregate_generation = 0;
+	link_parent(w);
 }
 
 /**
@@ -1095,6 +1483,9 @@ void inotifytools_set_filename_by_filename(char const* oldname,
 	if (w->filename)
 		free(w->filename);
 	w->filename = strdup(newname);
+	w->filter_generation = 0;
+	w->aggregate_generation = 0;
+	link_parent(w);
 }
 
 /**
@@ -1129,6 +1520,17 @@ void inotifytools_replace_filename(char const* oldname, char const* newname) {
 	data.new_name = newname;
 	data.old_len = strlen(oldname);
 	rbwalk(tree_filename, replace_filename, (void*)&data);
+
+	// The moved watches keep their parents within the moved tree
+	size_t len = strlen(newname);
+	watch key;
+	key.filename = (char*)newname;
+	watch* w = (watch*)rblookup(RB_LUGTEQ, &key, tree_filename);
+	for (; w && !strncmp(w->filename, newname, len);
+	     w = (watch*)rblookup(RB_LUGREAT, w, tree_filename)) {
+		if (!w->parent || !watch_contains(w->parent, w))
+			link_parent(w);
+	}
 }
 
 /**
@@ -1139,6 +1541,10 @@ int remove_inotify_watch(watch* w) {
 	// There is no kernel object representing the watch with fanotify
 	if (w->fid)
 		return 0;
+	if (scan_owns(w->wd)) {
+		scan_remove(w->wd);
+		return 1;
+	}
 	int status = inotify_rm_watch(inotify_fd, w->wd);
 	if (status < 0) {
 		fprintf(stderr, "Failed to remove watch on %s: %s\n",
@@ -1159,11 +1565,19 @@ watch* create_watch(int wd,
 	if (wd < 0 || !filename)
 		return 0;
 
-	watch* w = (watch*)calloc(1, sizeof(watch));
+	// inotify gives a directory watched again its first watch descriptor,
+	// as when a directory created in a lazily watched tree is also watched
+	// by the program
+	watch* w = wd ? watch_from_wd(wd) : 0;
+	if (w && !w->evicted && !strcmp(w->filename, filename))
+		return w;
+
+	w = (watch*)calloc(1, sizeof(watch));
 	if (!w) {
 		fprintf(stderr, "Failed to allocate watch.\n");
 		return NULL;
 	}
+	++watch_generation;
 	w->wd = wd ?: (unsigned long)fid;
 	w->fid = fid;
 	w->dirf = dirf;
@@ -1172,7 +1586,10 @@ watch* create_watch(int wd,
 	if (fid)
 		rbsearch(w, tree_fid);
 
-	rbsearch(w, tree_filename);
+	link_parent(w);
+	if (rbsearch(w, tree_filename) == w)
+		reparent_watches(w, w->parent, w);
+	PROBE2(watch_add, w->wd, w->filename);
 	return w;
 }
 
@@ -1191,7 +1608,7 @@ watch* create_watch(int wd,
 int inotifytools_remove_watch_by_wd(int wd) {
 	niceassert(initialized, "inotifytools_initialize not called yet");
 	watch* w = watch_from_wd(wd);
-	if (!w)
+	if (!w || w->evicted)
 		return 1;
 
 	if (!remove_inotify_watch(w))
@@ -1199,7 +1616,7 @@ int inotifytools_remove_watch_by_wd(int wd) {
 	rbdelete(w, tree_wd);
 	if (w->fid)
 		rbdelete(w, tree_fid);
-	rbdelete(w, tree_filename);
+	unlink_filename(w);
 	destroy_watch(w);
 	return 1;
 }
@@ -1226,7 +1643,7 @@ int inotifytools_remove_watch_by_filename(char const* filename) {
 	rbdelete(w, tree_wd);
 	if (w->fid)
 		rbdelete(w, tree_fid);
-	rbdelete(w, tree_filename);
+	unlink_filename(w);
 	destroy_watch(w);
 	return 1;
 }
@@ -1249,6 +1666,57 @@ int inotifytools_watch_file(char const* filename, int events) {
 	return inotifytools_watch_files(filenames, events);
 }
 
+/**
+ * @internal
+ * @return the watch descriptor of @a filename if it is polled already, or
+ *         0.
+ */
+static int polled_wd(char const* filename) {
+	watch* w = watch_from_filename(filename);
+	size_t len = strlen(filename);
+	if (!w && len && filename[len - 1] != '/') {
+		char* dirname;
+		nasprintf(&dirname, "%s/", filename);
+		w = watch_from_filename(dirname);
+		free(dirname);
+	}
+	return w && scan_owns(w->wd) ? w->wd : 0;
+}
+
+/**
+ * @internal
+ * Find out whether @a filename is to be polled rather than watched: when
+ * polling is forced, when it or its directory is polled already, or when
+ * inotifytools_set_polling() is in effect and it is on a network
+ * filesystem.
+ *
+ * Only a file whose directory isn't watched has its filesystem checked.
+ * Those in a watched directory go the way of the directory, and those in a
+ * tree being watched the way of its root, so a tree is checked once rather
+ * than for each subdirectory, and a network filesystem mounted within a
+ * watched tree is watched like the rest of it.
+ *
+ * @param wd set to the watch descriptor of @a filename if it is polled
+ *           already, or 0.
+ *
+ * @return nonzero if @a filename is to be polled.
+ */
+static int should_poll(char const* filename, int* wd) {
+	*wd = 0;
+	if (!polling && !scan_active())
+		return forced_polling;
+	*wd = polled_wd(filename);
+	if (forced_polling || *wd)
+		return 1;
+	watch* parent = parent_watch(filename);
+	if (parent)
+		return scan_owns(parent->wd);
+	if (!polling)
+		return 0;
+	return remote_tree >= 0 ? remote_tree
+				: scan_remote_filesystem(filename);
+}
+
 /**
  * Set up a watch on a list of files.
  *
@@ -1284,9 +1752,14 @@ int inotifytools_watch_files(char const* filenames[], int events) {
 					   events | FAN_EVENT_ON_CHILD,
 					   AT_FDCWD, filenames[i]);
 #endif
+		} else if (should_poll(filenames[i], &wd)) {
+			wd = scan_add(filenames[i], events, wd);
 		} else {
 			wd =
 			    inotify_add_watch(inotify_fd, filenames[i], events);
+			// Poll what inotify has no watches left for
+			if (wd == -1 && errno == ENOSPC && polling)
+				wd = scan_add(filenames[i], events, 0);
 		}
 		if (wd < 0) {
 			if (wd == -1) {
@@ -1361,7 +1834,7 @@ int inotifytools_watch_files(char const* filenames[], int events) {
 				fsid->info.hdr.info_type =
 				    FAN_EVENT_INFO_TYPE_FID;
 				fsid->info.hdr.len = sizeof(*fsid);
-				mntid = open(dirname, O_RDONLY);
+				mntid = open(dirname, O_RDONLY | O_CLOEXEC);
 				if (mntid < 0) {
 					free(fid);
 					free(fsid);
@@ -1393,7 +1866,7 @@ int inotifytools_watch_files(char const* filenames[], int events) {
 			fid->info.hdr.len =
 			    sizeof(*fid) + fid->handle.handle_bytes;
 			if (dirname) {
-				dirf = open(dirname, O_PATH);
+				dirf = open(dirname, O_PATH | O_CLOEXEC);
 				if (dirf < 0) {
 					free(fid);
 					fprintf(stderr,
@@ -1412,6 +1885,49 @@ int inotifytools_watch_files(char const* filenames[], int events) {
 	return 1;
 }
 
+/**
+ * @internal
+ * Look up the watch for @a wd, working out which filter verdicts hold for
+ * all of its events if the filters or its filename changed since the last
+ * time.
+ *
+ * A watched file only ever has events on itself, so its verdicts are exact.
+ * For a watched directory, the regex verdict is known when the pattern
+ * matches the directory itself or can only match directories, and the glob
+ * verdict when the directory or one of its parents is excluded or no
+ * pattern can match a file inside it.
+ */
+static watch* filter_verdicts(int wd) {
+	watch* w = watch_from_wd(wd);
+	if (!w || w->filter_generation == filter_generation)
+		return w;
+
+	const char* filename = w->filename;
+	size_t len = strlen(filename);
+	int isdir = len && filename[len - 1] == '/';
+
+	w->regex_verdict = REGEX_CHECK_NAME;
+	if (regex && !isdir) {
+		w->regex_verdict = regexec(regex, filename, 0, 0, 0)
+				       ? REGEX_NO_MATCH
+				       : REGEX_MATCH;
+	} else if (regex) {
+		if (regex_dir_safe &&
+		    !regexec(regex, filename, 0, 0, REG_NOTEOL))
+			w->regex_verdict = REGEX_MATCH;
+		else if (regex_dir_scoped)
+			w->regex_verdict = REGEX_NO_MATCH;
+	}
+
+	if (!isdir)
+		w->glob_verdict = glob_filter_check(filename, len, "", 0);
+	else
+		w->glob_verdict = glob_filter_dir_verdict(filename, len);
+
+	w->filter_generation = filter_generation;
+	return w;
+}
+
 /**
  * Get the next inotify event to occur.
  *
@@ -1435,8 +1951,8 @@ int inotifytools_watch_files(char const* filenames[], int events) {
  *
  * @note If the function inotifytools_ignore_events_by_regex() has been called
  *       with a non-NULL parameter, this function will not return on events
- *       which match the regular expression passed to that function.  However,
- *       the @a timeout period begins again each time a matching event occurs.
+ *       which match the regular expression passed to that function.  Such
+ *       events do not restart the @a timeout period.
  */
 struct inotify_event* inotifytools_next_event(long int timeout) {
 	if (!timeout) {
@@ -1491,8 +2007,8 @@ struct inotify_event* inotifytools_next_event(long int timeout) {
  *
  * @note If the function inotifytools_ignore_events_by_regex() has been called
  *       with a non-NULL parameter, this function will not return on events
- *       which match the regular expression passed to that function.  However,
- *       the @a timeout period begins again each time a matching event occurs.
+ *       which match the regular expression passed to that function.  Such
+ *       events do not restart the @a timeout period.
  */
 struct inotify_event* inotifytools_next_events(long int timeout,
 					       int num_events) {
@@ -1502,27 +2018,103 @@ struct inotify_event* inotifytools_next_events(long int timeout,
 	if (num_events < 1)
 		return NULL;
 
-	// second half of event[] buffer is for fanotify->inotify conversion
-	static struct inotify_event event[2 * MAX_EVENTS];
-	static struct inotify_event* ret;
-	static int first_byte = 0;
-	static ssize_t bytes;
-	static ssize_t this_bytes;
-	static jmp_buf jmp;
-	static struct nstring match_name;
-	static char match_name_string[MAX_STRLEN + 1];
+	struct timespec deadline;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout;
+	}
+
+	struct event_info info;
+	if (!next_filtered_event(timeout < 0 ? NULL : &deadline, num_events,
+				 &info))
+		return NULL;
+	return info.event;
+}
+
+/**
+ * Get the next inotify event to occur, waiting at most @a timeout_ms
+ * milliseconds.
+ *
+ * Like inotifytools_next_event(), but for callers that need to wake up more
+ * often than once a second.
+ *
+ * @param timeout_ms maximum amount of time, in milliseconds, to wait for an
+ *                   event, or negative to block until an event occurs.  0
+ *                   returns at once if no event is ready.
+ *
+ * @return pointer to an inotify event, or NULL if function timed out before
+ *         an event occurred.  The event is located in static storage and it
+ *         may be overwritten in subsequent calls.
+ */
+struct inotify_event* inotifytools_next_event_ms(long int timeout_ms) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+
+	struct timespec deadline;
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	struct event_info info;
+	if (!next_filtered_event(timeout_ms < 0 ? NULL : &deadline, 1, &info))
+		return NULL;
+	return info.event;
+}
 
-	setjmp(jmp);
+#ifdef HAVE_SYS_SDT_H
+/**
+ * @internal
+ * Count the whole events in @a len bytes read into @a buf, for the read
+ * probe.
+ */
+static int count_events(char const* buf, ssize_t len) {
+	int count = 0;
+	for (ssize_t i = 0; i + (ssize_t)sizeof(struct inotify_event) <= len;
+	     ++count) {
+#ifdef LINUX_FANOTIFY
+		if (fanotify_mode) {
+			i += ((struct fanotify_event_metadata*)(buf + i))
+				 ->event_len;
+			continue;
+		}
+#endif
+		i += sizeof(struct inotify_event) +
+		     ((struct inotify_event*)(buf + i))->len;
+	}
+	return count;
+}
+#endif
 
-	pid_t event_pid = 0;
+/**
+ * @internal
+ * Read the next event into @a r, without filtering it.
+ *
+ * @param deadline CLOCK_MONOTONIC time to give up waiting for an event, or
+ *                 NULL to wait forever.
+ * @param pid set to the pid of the process which caused a fanotify event.
+ */
+static struct inotify_event* read_next_event(struct event_reader* r,
+					     struct timespec const* deadline,
+					     int num_events,
+					     pid_t* pid) {
+	struct inotify_event* event = r->events;
+	struct inotify_event* ret;
+	uint64_t start;
+
+	*pid = 0;
 	error = 0;
 
 	// first_byte is index into event buffer
-	if (first_byte != 0 &&
-	    first_byte <= (int)(bytes - sizeof(struct inotify_event))) {
-		ret = (struct inotify_event*)((char*)&event[0] + first_byte);
+	if (r->first_byte != 0 &&
+	    r->first_byte <= (int)(r->bytes - sizeof(struct inotify_event))) {
+		ret = (struct inotify_event*)((char*)&event[0] + r->first_byte);
 		if (!fanotify_mode &&
-		    first_byte + sizeof(*ret) + ret->len > bytes) {
+		    r->first_byte + sizeof(*ret) + ret->len > r->bytes) {
 			// oh... no.  this can't be happening.  An incomplete
 			// event. Copy what we currently have into first
 			// element, call self to read remainder. oh, and they
@@ -1534,32 +2126,45 @@ struct inotify_event* inotifytools_next_events(long int timeout,
 					  event[0].len) <= (long)ret,
 				   "extremely unlucky user, death imminent");
 			// how much of the event do we have?
-			bytes = (char*)&event[0] + bytes - (char*)ret;
-			memcpy(&event[0], ret, bytes);
-			return inotifytools_next_events(timeout, num_events);
+			r->bytes = (char*)&event[0] + r->bytes - (char*)ret;
+			memcpy(&event[0], ret, r->bytes);
+			return read_next_event(r, deadline, num_events, pid);
 		}
-		this_bytes = 0;
+		r->this_bytes = 0;
 		goto more_events;
 
 	}
 
-	else if (first_byte == 0) {
-		bytes = 0;
+	else if (r->first_byte == 0) {
+		r->bytes = 0;
 	}
 
-	static unsigned int bytes_to_read;
-	static int rc;
-	static fd_set read_fds;
-
-	static struct timeval read_timeout;
-	read_timeout.tv_sec = timeout;
-	read_timeout.tv_usec = 0;
-	static struct timeval* read_timeout_ptr;
-	read_timeout_ptr = (timeout < 0 ? NULL : &read_timeout);
+	unsigned int bytes_to_read;
+	int rc;
+	fd_set read_fds;
+
+	struct timeval read_timeout;
+	struct timeval* read_timeout_ptr;
+	read_timeout_ptr = NULL;
+	if (deadline) {
+		// Time left until the deadline, which is not restarted by
+		// events the filters reject
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long nsec = (deadline->tv_sec - now.tv_sec) * 1000000000L +
+			    deadline->tv_nsec - now.tv_nsec;
+		if (nsec < 0)
+			nsec = 0;
+		read_timeout.tv_sec = nsec / 1000000000L;
+		read_timeout.tv_usec = nsec % 1000000000L / 1000;
+		read_timeout_ptr = &read_timeout;
+	}
 
+	start = perf_now();
 	FD_ZERO(&read_fds);
 	FD_SET(inotify_fd, &read_fds);
 	rc = select(inotify_fd + 1, &read_fds, NULL, NULL, read_timeout_ptr);
+	perf_add(&perf.wait_ns, start);
 	if (rc < 0) {
 		// error
 		error = errno;
@@ -1570,6 +2175,7 @@ struct inotify_event* inotifytools_next_events(long int timeout,
 	}
 
 	// wait until we have enough bytes to read
+	start = perf_now();
 	do {
 		rc = ioctl(inotify_fd, FIONREAD, &bytes_to_read);
 	} while (!rc &&
@@ -1580,20 +2186,31 @@ struct inotify_event* inotifytools_next_events(long int timeout,
 		return NULL;
 	}
 
-	this_bytes = read(inotify_fd, (char*)&event[0] + bytes,
-			  sizeof(struct inotify_event) * MAX_EVENTS - bytes);
-	if (this_bytes < 0) {
+	r->this_bytes = read(inotify_fd, (char*)&event[0] + r->bytes,
+			     sizeof(struct inotify_event) * MAX_EVENTS -
+				 r->bytes);
+	perf_add(&perf.read_ns, start);
+	if (r->this_bytes < 0) {
 		error = errno;
 		return NULL;
 	}
-	if (this_bytes == 0) {
+	++perf.reads;
+	perf.bytes_read += r->this_bytes;
+	if (PROBE_ENABLED(read))
+		PROBE2(read, r->this_bytes,
+		       count_events((char*)&event[0] + r->bytes,
+				    r->this_bytes));
+	if (r->this_bytes == 0) {
 		fprintf(stderr,
 			"Inotify reported end-of-file.  Possibly too many "
 			"events occurred at once.\n");
 		return NULL;
 	}
+	// Once for all the events read, rather than as each is printed
+	clock_gettime(CLOCK_REALTIME, &r->time.realtime);
+	clock_gettime(CLOCK_MONOTONIC, &r->time.monotonic);
 more_events:
-	ret = (struct inotify_event*)((char*)&event[0] + first_byte);
+	ret = (struct inotify_event*)((char*)&event[0] + r->first_byte);
 #ifdef LINUX_FANOTIFY
 	// convert fanotify events to inotify events
 	if (fanotify_mode) {
@@ -1606,7 +2223,7 @@ more_events:
 		int fid_len = 0;
 		int name_len = 0;
 
-		first_byte += meta->event_len;
+		r->first_byte += meta->event_len;
 
 		if (meta->event_len > sizeof(*meta)) {
 			switch (info->hdr.info_type) {
@@ -1651,13 +2268,16 @@ more_events:
 			    "fanotify_event: bytes=%zd, first_byte=%d, "
 			    "this_bytes=%zd, event_len=%u, fid_len=%d, "
 			    "name_len=%d, name=%s\n",
-			    bytes, first_byte, this_bytes, meta->event_len,
-			    fid_len, name_len, name);
+			    r->bytes, r->first_byte, r->this_bytes,
+			    meta->event_len, fid_len, name_len, name);
 		}
 
 		ret = &event[MAX_EVENTS];
 		watch* w = watch_from_fid(fid);
-		if (!w) {
+		if (w) {
+			w->referenced = 1;
+			PROBE2(fid_resolve, 1, w->filename);
+		} else {
 			struct fanotify_event_fid* newfid =
 			    (fanotify_event_fid*)calloc(1, info->hdr.len);
 			if (!newfid) {
@@ -1673,6 +2293,8 @@ more_events:
 					free(newfid);
 					return NULL;
 				}
+				if (fid_watch_limit)
+					admit_fid_watch(w);
 			}
 
 			if (verbosity) {
@@ -1690,56 +2312,415 @@ more_events:
 		ret->len = name_len;
 		if (name_len > 0)
 			memcpy(ret->name, name, name_len);
-		event_pid = meta->pid;
+		*pid = meta->pid;
 	} else {
-		first_byte += sizeof(struct inotify_event) + ret->len;
+		r->first_byte += sizeof(struct inotify_event) + ret->len;
 	}
 #endif
 
-	bytes += this_bytes;
-	niceassert(first_byte <= bytes,
+	r->bytes += r->this_bytes;
+	niceassert(r->first_byte <= r->bytes,
 		   "ridiculously long filename, things will "
 		   "almost certainly screw up.");
-	if (first_byte == bytes) {
-		first_byte = 0;
+	if (r->first_byte == r->bytes) {
+		r->first_byte = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @internal
+ * Read the next event, or return the next one synthesized for polled files
+ * if that comes first.
+ */
+static struct inotify_event* read_or_poll_event(
+    struct event_reader* r,
+    struct timespec const* deadline,
+    int num_events,
+    pid_t* pid) {
+	if (!scan_active())
+		return read_next_event(r, deadline, num_events, pid);
+
+	struct timespec now, due;
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		struct inotify_event* event = scan_next(&now);
+		if (event) {
+			*pid = 0;
+			error = 0;
+			clock_gettime(CLOCK_REALTIME, &r->time.realtime);
+			r->time.monotonic = now;
+			return event;
+		}
+
+		// Wake up for the next slice of the scan if it is due first
+		struct timespec const* wait = deadline;
+		if (scan_next_due(&due) &&
+		    (!deadline || due.tv_sec < deadline->tv_sec ||
+		     (due.tv_sec == deadline->tv_sec &&
+		      due.tv_nsec < deadline->tv_nsec)))
+			wait = &due;
+		event = read_next_event(r, wait, num_events, pid);
+		if (event || error || wait == deadline)
+			return event;
+	}
+}
+
+/**
+ * @internal
+ * Skip events from self due to open_by_handle_at().
+ */
+static int accept_not_self(struct event_info const* info, void* data) {
+	return !self_pid || self_pid != info->pid;
+}
+
+/**
+ * @internal
+ * Apply the filter set by inotifytools_ignore_events_by_regex() or
+ * inotifytools_ignore_events_by_inverted_regex().
+ */
+static int accept_regex(struct event_info const* info, void* data) {
+	static struct nstring match_name;
+	static char match_name_string[MAX_STRLEN + 1];
+	struct inotify_event* event = info->event;
+
+	if (!regex)
+		return 1;
+	// Skip regex filtering for directories in recursive mode
+	if (recursive_watch && (event->mask & IN_ISDIR) &&
+	    (event->mask & (IN_CREATE | IN_MOVED_TO)))
+		return 1;
+
+	int verdict = info->cached ? info->w->regex_verdict : REGEX_CHECK_NAME;
+	if (verdict == REGEX_CHECK_NAME) {
+		inotifytools_snprintf(&match_name, MAX_STRLEN, event, "%w%f");
+		memcpy(&match_name_string, &match_name.buf, match_name.len);
+		match_name_string[match_name.len] = '\0';
+		verdict = regexec(regex, match_name_string, 0, 0, 0)
+			      ? REGEX_NO_MATCH
+			      : REGEX_MATCH;
 	}
+	return (verdict == REGEX_MATCH) == invert_regexp;
+}
+
+/**
+ * @internal
+ * Apply the filters set by inotifytools_ignore_events_by_glob() and related
+ * functions.
+ */
+static int accept_glob(struct event_info const* info, void* data) {
+	struct inotify_event* event = info->event;
 
-	/* Skip events from self due to open_by_handle_at() */
-	if (self_pid && self_pid == event_pid) {
-		longjmp(jmp, 0);
+	if (!glob_filter_active())
+		return 1;
+
+	int verdict = info->cached ? info->w->glob_verdict : GLOB_CHECK_NAME;
+	if (verdict == GLOB_CHECK_NAME) {
+		size_t dirnamelen = 0;
+		const char* eventname;
+		const char* filename =
+		    inotifytools_filename_from_event(event, &eventname, &dirnamelen);
+		verdict = glob_filter_check(filename ? filename : "",
+					    dirnamelen, eventname,
+					    event->mask & IN_ISDIR);
 	}
+	// As with regex filtering, let new directories through in recursive
+	// mode so they can be watched.
+	if (verdict == GLOB_NOT_INCLUDED && recursive_watch &&
+	    (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+		return 1;
+	return verdict != GLOB_EXCLUDED && verdict != GLOB_NOT_INCLUDED;
+}
 
-	if (regex) {
-		// Skip regex filtering for directories in recursive mode
-		if (recursive_watch && (ret->mask & IN_ISDIR) &&
-		    (ret->mask & (IN_CREATE | IN_MOVED_TO))) {
-			// Allow directory events through when watching recursively
-		} else {
-			inotifytools_snprintf(&match_name, MAX_STRLEN, ret, "%w%f");
-			memcpy(&match_name_string, &match_name.buf, match_name.len);
-			match_name_string[match_name.len] = '\0';
-			if (0 == regexec(regex, match_name_string, 0, 0, 0)) {
-				if (!invert_regexp)
-					longjmp(jmp, 0);
-			} else {
-				if (invert_regexp)
-					longjmp(jmp, 0);
+/**
+ * @internal
+ * Read events until one passes every filter stage or @a deadline passes.
+ *
+ * @return 1 and fill in @a info if an event was accepted, 0 otherwise.
+ */
+static int next_accepted_event(struct timespec const* deadline,
+			       int num_events,
+			       struct event_info* info) {
+	int i;
+
+	for (;;) {
+		info->event = read_or_poll_event(&reader, deadline, num_events,
+						 &info->pid);
+		if (!info->event)
+			return 0;
+		info->time = reader.time;
+		++perf.events_read;
+		if (info->event->mask & IN_Q_OVERFLOW)
+			PROBE0(overflow);
+		if ((lazy_expansion || num_evicted_lazy) &&
+		    !lazy_activity(info->event))
+			continue;
+
+		uint64_t start = perf_now();
+		info->w = 0;
+		info->cached = 0;
+		if (regex || glob_filter_active()) {
+			// fanotify paths are resolved per event, so cannot be
+			// cached
+			info->w = filter_verdicts(info->event->wd);
+			info->cached = info->w && !fanotify_mode;
+		}
+		if (!info->w &&
+		    (num_filter_stages > NUM_BUILTIN_FILTER_STAGES || handler))
+			info->w = watch_from_wd(info->event->wd);
+
+		for (i = 0; i < num_filter_stages; ++i) {
+			struct filter_stage* stage = &filter_stages[i];
+			int accepted =
+			    stage->accept
+				? stage->accept(info, stage->data)
+				: stage->filter(info->event, info->w,
+						stage->data);
+			if (!accepted) {
+				++stage->dropped;
+				++perf.events_rejected;
+				PROBE3(filter, info->event->wd, info->event->mask,
+				       i);
+				break;
 			}
 		}
+		perf_add(&perf.filter_ns, start);
+		if (i == num_filter_stages)
+			break;
 	}
 
 	if (collect_stats) {
-		record_stats(ret);
+		record_stats(info->event, info->w);
 	}
 
-	return ret;
+	last_event_time = info->time;
+	return 1;
 }
 
 /**
- * Set up recursive watches on an entire directory tree.
+ * @internal
+ * Fire the dispatch probe for an event about to be returned.
+ */
+static void probe_dispatch(struct event_info const* info) {
+	PROBE3(dispatch, info->event->wd, info->event->mask,
+	       info->time.monotonic.tv_sec * 1000000000LL +
+		   info->time.monotonic.tv_nsec);
+}
+
+/**
+ * @internal
+ * Get the next accepted event, merged with the others on the same file if
+ * inotifytools_set_coalescing() is in effect.
  *
- * inotifytools_initialize() must be called before this function can
- * be used.
+ * @return 1 and fill in @a info if there is an event, 0 otherwise.
+ */
+static int next_filtered_event(struct timespec const* deadline,
+			       int num_events,
+			       struct event_info* info) {
+	if (!coalesce_active()) {
+		if (!next_accepted_event(deadline, num_events, info))
+			return 0;
+		probe_dispatch(info);
+		return 1;
+	}
+
+	struct timespec now, due;
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		info->event = coalesce_next(&now, &info->pid, &info->time);
+		if (info->event) {
+			info->w = watch_from_wd(info->event->wd);
+			info->cached = 0;
+			last_event_time = info->time;
+			probe_dispatch(info);
+			return 1;
+		}
+
+		// Wake up for the next pending event if it is due first
+		struct timespec const* wait = deadline;
+		if (coalesce_next_due(&due) &&
+		    (!deadline || due.tv_sec < deadline->tv_sec ||
+		     (due.tv_sec == deadline->tv_sec &&
+		      due.tv_nsec < deadline->tv_nsec)))
+			wait = &due;
+		if (!next_accepted_event(wait, num_events, info)) {
+			if (error || wait == deadline)
+				return 0;
+			continue;
+		}
+		coalesce_add(info->event, info->pid, &info->time);
+	}
+}
+
+/**
+ * Merge bursts of events on the same file into one event.
+ *
+ * Editors and build tools often cause several events on a file within
+ * milliseconds, such as IN_OPEN, IN_MODIFY, IN_CLOSE_WRITE and IN_ATTRIB.
+ * When coalescing, the first event on a name in a watched directory (or on
+ * a watched file) starts a window of @a window_ms milliseconds.  Events on
+ * the same name during the window are merged into it, and one event with
+ * all their masks or'ed together is returned when the window is over.  The
+ * window does not restart on each event, so a file which is written to
+ * continuously is still reported once per window.
+ *
+ * Moves, IN_CREATE on directories and the events which end a watch are not
+ * merged, and are returned after the pending events on the same watch so
+ * that the order of events on a file is kept.  Filters and statistics see
+ * every event before it is merged.  Merged events have no cookie.
+ *
+ * @param window_ms length of the window in milliseconds, or 0 to return
+ *                  every event as it is read.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_set_coalescing(long window_ms) {
+	if (!coalesce_set_window(window_ms)) {
+		error = errno;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Add a filter stage run on every event.
+ *
+ * @a fn is called with each event which passed the earlier stages, the watch
+ * it occurred on (which may be NULL for events not associated with a watch,
+ * such as IN_Q_OVERFLOW) and @a userdata.  If it returns 0, the event is
+ * dropped and neither later stages nor the caller see it.  Stages run in the
+ * order they were added, after the built-in ones.
+ *
+ * @a fn is called from inotifytools_next_events() and
+ * inotifytools_process_events(), and must not call either of them.  The
+ * watch may be passed to inotifytools_filename_from_watch().
+ *
+ * @return 1 on success, 0 if too many filters have been added.
+ */
+int inotifytools_add_filter(inotifytools_filter_fn fn, void* userdata) {
+	if (!fn || num_filter_stages == MAX_FILTER_STAGES) {
+		error = fn ? ENOSPC : EINVAL;
+		return 0;
+	}
+	struct filter_stage* stage = &filter_stages[num_filter_stages++];
+	stage->name = "user";
+	stage->accept = 0;
+	stage->filter = fn;
+	stage->data = userdata;
+	stage->dropped = 0;
+	return 1;
+}
+
+/**
+ * Set the function called by inotifytools_process_events() for each event.
+ *
+ * @a fn is called with the event, the watch it occurred on (which may be
+ * NULL) and @a userdata, without the event being copied or its filename
+ * looked up.  The event is only valid until @a fn returns.
+ *
+ * @param fn handler, or NULL to remove the handler.
+ */
+void inotifytools_set_handler(inotifytools_handler_fn fn, void* userdata) {
+	handler = fn;
+	handler_data = userdata;
+}
+
+/**
+ * Wait for events and pass each one to the handler set with
+ * inotifytools_set_handler().
+ *
+ * Waits for up to @a timeout seconds for an event which passes all filters,
+ * then handles every further event that is already available without
+ * waiting again.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param timeout maximum amount of time, in seconds, to wait for the first
+ *                event, or a negative value to wait forever.
+ *
+ * @return the number of events handled, 0 if the timeout expired, or -1 on
+ *         error, in which case the error can be obtained from
+ *         inotifytools_error().
+ */
+int inotifytools_process_events(long int timeout) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	if (!handler) {
+		error = EINVAL;
+		return -1;
+	}
+
+	struct timespec deadline;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout;
+	}
+
+	struct event_info info;
+	struct timespec const* wait = timeout < 0 ? NULL : &deadline;
+	int handled = 0;
+	while (next_filtered_event(wait, 1, &info)) {
+		handler(info.event, info.w, handler_data);
+		++handled;
+		// Handle what is already queued, but don't wait for more
+		deadline.tv_sec = 0;
+		deadline.tv_nsec = 0;
+		wait = &deadline;
+	}
+
+	if (!handled && error)
+		return -1;
+	return handled;
+}
+
+/**
+ * Get the number of stages events are filtered through.
+ *
+ * Events are passed through each stage in turn, and an event rejected by one
+ * stage is not seen by the next.  The built-in stages are "self", which drops
+ * fanotify events caused by libinotifytools itself, "regex" and "glob";
+ * stages added with inotifytools_add_filter() follow them, named "user".
+ */
+int inotifytools_get_num_filter_stages() {
+	return num_filter_stages;
+}
+
+/**
+ * Get the name of a filter stage.
+ *
+ * @param stage index of the stage, from 0 to
+ *              inotifytools_get_num_filter_stages() - 1.
+ *
+ * @return name of the stage, or NULL if @a stage is out of range.
+ */
+char const* inotifytools_get_filter_stage_name(int stage) {
+	if (stage < 0 || stage >= num_filter_stages)
+		return NULL;
+	return filter_stages[stage].name;
+}
+
+/**
+ * Get the number of events a filter stage has dropped since
+ * inotifytools_initialize().
+ *
+ * @param stage index of the stage, from 0 to
+ *              inotifytools_get_num_filter_stages() - 1.
+ *
+ * @return number of events dropped, or 0 if @a stage is out of range.
+ */
+unsigned long inotifytools_get_filter_stage_dropped(int stage) {
+	if (stage < 0 || stage >= num_filter_stages)
+		return 0;
+	return filter_stages[stage].dropped;
+}
+
+/**
+ * Set up recursive watches on an entire directory tree.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
  *
  * @param path path of directory or file to watch.  If the path is a directory,
  *             every subdirectory will also be watched for the same events up
@@ -1764,6 +2745,351 @@ int inotifytools_watch_recursively(char const* path, int events) {
 	return inotifytools_watch_recursively_with_exclude(path, events, 0);
 }
 
+/**
+ * @internal
+ * Whether subdirectory @a name of @a parent, whose path with a trailing '/'
+ * is @a path, is left out of recursive watches by the glob filters or by
+ * @a exclude_list.
+ */
+static int excluded_dir(char const* parent,
+			char const* name,
+			char const* path,
+			char const** exclude_list) {
+	if (glob_filter_excludes_dir(parent, name))
+		return 1;
+	size_t len = strlen(path);
+	for (char const** entry = exclude_list; entry && *entry; ++entry) {
+		size_t exclude_length = strlen(*entry);
+		if ((*entry)[exclude_length - 1] == '/')
+			--exclude_length;
+		// directory found in exclude list
+		if (len == exclude_length + 1 &&
+		    !strncmp(*entry, path, exclude_length))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * Watch directory @a path, which ends with '/', as recursive watches do when
+ * watch_mode() returned @a mode for it.
+ */
+static int watch_dir(char const* path, int mode, int events) {
+	if (mode == WATCH_DIRS_ONLY) {
+		// Only watch for new subdirectories
+		events &= ~IN_ALL_EVENTS | IN_CREATE | IN_MOVED_TO |
+			  IN_MOVED_FROM;
+		if (!(events & IN_ALL_EVENTS))
+			return 1;
+		return inotifytools_watch_file(
+		    path, events | (fanotify_mode ? 0 : IN_ONLYDIR));
+	}
+	return inotifytools_watch_file(path, events);
+}
+
+/**
+ * @internal
+ * Whether watching a directory tree carries on after failing to watch a
+ * directory in it with @a err.
+ */
+static int skippable_error(int err) {
+	return err == EACCES || err == ENOENT || err == ELOOP;
+}
+
+/**
+ * @internal
+ * Watch directory @a path, which ends with '/', without its subdirectories,
+ * which are watched once there is activity in it.  With @a on_activity, the
+ * watch is added to the ring of watches added on activity.
+ */
+static int watch_lazily(char const* path, int events, int on_activity) {
+	int mode = prune_watches ? watch_mode(path) : WATCH_FULL;
+	if (mode == WATCH_NONE)
+		return 1;
+	if (!watch_dir(path, mode, events))
+		return 0;
+	watch* w = watch_from_filename(path);
+	if (w) {
+		w->lazy_events = events;
+		w->unexpanded = 1;
+		lazy_expansion = 1;
+		if (on_activity && lazy_watch_limit)
+			admit_lazy_watch(w);
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Keep the directories in @a exclude_list, to leave them out when watching
+ * lazily watched trees further.
+ */
+static int keep_lazy_exclude(char const** exclude_list) {
+	int count = 0;
+	while (exclude_list && exclude_list[count])
+		++count;
+	if (!count)
+		return 1;
+	char** list = (char**)realloc(
+	    lazy_exclude, (num_lazy_exclude + count + 1) * sizeof(char*));
+	if (!list) {
+		error = ENOMEM;
+		return 0;
+	}
+	lazy_exclude = list;
+	for (int i = 0; i < count; ++i) {
+		list[num_lazy_exclude] = strdup(exclude_list[i]);
+		if (!list[num_lazy_exclude]) {
+			list[num_lazy_exclude] = 0;
+			error = ENOMEM;
+			return 0;
+		}
+		list[++num_lazy_exclude] = 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Get the watch on the directory containing @a filename, which ends with
+ * '/', if there is one.
+ */
+static watch* parent_watch(char const* filename) {
+	size_t len = strlen(filename);
+	if (len < 2)
+		return 0;
+	--len;
+	while (len && filename[len - 1] != '/')
+		--len;
+	if (!len)
+		return 0;
+
+	watch key;
+	key.filename = strndup(filename, len);
+	if (!key.filename)
+		return 0;
+	watch* w = (watch*)rbfind(&key, tree_filename);
+	free(key.filename);
+	return w;
+}
+
+/**
+ * @internal
+ * Remove a watch added on activity, leaving its parent to watch it again
+ * on further activity.  The watch is kept for the events already queued
+ * for it until IN_IGNORED is read.
+ */
+static void evict_lazy_watch(watch* w) {
+	w->lazy_slot = 0;
+	watch* parent = parent_watch(w->filename);
+	if (parent)
+		parent->unexpanded = 1;
+	unlink_filename(w);
+	++watch_generation;
+	if (remove_inotify_watch(w)) {
+		w->evicted = 1;
+		++num_evicted_lazy;
+	} else {
+		rbdelete(w, tree_wd);
+		destroy_watch(w);
+	}
+}
+
+/**
+ * @internal
+ * Add a watch added on activity to the ring, evicting the first watch
+ * without activity since the clock hand last passed it if it is full.
+ */
+static void admit_lazy_watch(watch* w) {
+	w->referenced = 1;
+	if (num_lazy_watches < lazy_watch_limit) {
+		lazy_watches[num_lazy_watches] = w;
+		w->lazy_slot = ++num_lazy_watches;
+		return;
+	}
+	for (;;) {
+		watch* old = lazy_watches[lazy_clock_hand];
+		if (old->referenced) {
+			old->referenced = 0;
+			lazy_clock_hand = (lazy_clock_hand + 1) % lazy_watch_limit;
+			continue;
+		}
+		evict_lazy_watch(old);
+		lazy_watches[lazy_clock_hand] = w;
+		w->lazy_slot = lazy_clock_hand + 1;
+		lazy_clock_hand = (lazy_clock_hand + 1) % lazy_watch_limit;
+		return;
+	}
+}
+
+/**
+ * @internal
+ * Watch the subdirectories of lazily watched directory @a w which are not
+ * watched yet.
+ */
+static void expand_lazy_watch(watch* w) {
+	// Watching its subdirectories may evict @a w itself
+	char* dirname = strdup(w->filename);
+	int events = w->lazy_events;
+	DIR* dir = dirname ? opendir(dirname) : NULL;
+	if (!dir) {
+		free(dirname);
+		return;
+	}
+	w->unexpanded = 0;
+
+	struct dirent* ent;
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+			continue;
+
+		char* path;
+		nasprintf(&path, "%s%s/", dirname, ent->d_name);
+		if (ent->d_type == DT_UNKNOWN) {
+			// Without the '/', which would follow a symlink
+			size_t len = strlen(path);
+			path[len - 1] = '\0';
+			struct stat st;
+			int subdir = !lstat(path, &st) && S_ISDIR(st.st_mode);
+			path[len - 1] = '/';
+			if (!subdir) {
+				free(path);
+				continue;
+			}
+		}
+		int ok = watch_from_filename(path) ||
+			 excluded_dir(dirname, ent->d_name, path,
+				      (char const**)lazy_exclude) ||
+			 watch_lazily(path, events, 1) ||
+			 skippable_error(error);
+		free(path);
+		if (!ok) {
+			// Out of watches, most likely: try again on the next
+			// activity
+			w = watch_from_filename(dirname);
+			if (w)
+				w->unexpanded = 1;
+			break;
+		}
+	}
+	closedir(dir);
+	free(dirname);
+}
+
+/**
+ * @internal
+ * Note the activity @a event shows in a lazily watched tree: keep the
+ * watches on the directories it occurred below, and watch the
+ * subdirectories of the one it occurred in.
+ *
+ * @return 0 if @a event is the IN_IGNORED of an evicted watch, which the
+ *         caller never asked for, 1 otherwise.
+ */
+static int lazy_activity(struct inotify_event const* event) {
+	watch* w = watch_from_wd(event->wd);
+	if (!w)
+		return 1;
+	if (w->evicted) {
+		if (!(event->mask & IN_IGNORED))
+			return 1;
+		rbdelete(w, tree_wd);
+		--num_evicted_lazy;
+		destroy_watch(w);
+		return 0;
+	}
+	if (event->mask & IN_IGNORED)
+		return 1;
+
+	for (watch* p = w; p && p->lazy_slot; p = parent_watch(p->filename))
+		p->referenced = 1;
+	if (w->unexpanded)
+		expand_lazy_watch(w);
+	return 1;
+}
+
+/**
+ * Set up recursive watches lazily, so that the watches follow the
+ * directories in use rather than the size of the tree.
+ *
+ * inotifytools_watch_recursively() and
+ * inotifytools_watch_recursively_with_exclude() then only read directories
+ * up to @a depth levels below the path given, and watch those at that depth
+ * without their subdirectories.  The subdirectories of a directory watched
+ * that way are watched, likewise, once an event occurs in it.
+ *
+ * With @a max_watches, at most that many watches are added on activity:
+ * once there are as many, the watch without events for the longest time,
+ * roughly, is removed to make room for each new one.  Events in the
+ * directory above it watch it again.  The IN_IGNORED events of watches
+ * removed that way are not returned.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.  Only inotify watches can be removed, so lazy watching is not
+ * available with fanotify.
+ *
+ * @param depth levels of directories to watch up front, where 0 is the
+ *              path given alone, or -1 to watch whole trees.
+ *
+ * @param max_watches maximum number of watches added on activity, or 0 for
+ *                    no limit.  If more than that were added, some are
+ *                    removed.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ *
+ * @note Subdirectories are watched as events are read, so events in them
+ *       before that are missed.  Turning lazy watching off leaves the
+ *       watches as they are.
+ */
+int inotifytools_set_lazy_watching(int depth, int max_watches) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	if (max_watches < 0 || (depth >= 0 && fanotify_mode)) {
+		error = EINVAL;
+		return 0;
+	}
+	if (!set_lazy_watch_limit(max_watches))
+		return 0;
+	lazy_depth = depth < 0 ? -1 : depth;
+	if (lazy_depth < 0)
+		free_lazy_exclude();
+	return 1;
+}
+
+/**
+ * @internal
+ * Limit the watches added on activity in lazily watched trees to
+ * @a max_watches, or 0 for no limit.
+ */
+static int set_lazy_watch_limit(int max_watches) {
+	while (num_lazy_watches > max_watches && max_watches) {
+		watch* w = lazy_watches[--num_lazy_watches];
+		evict_lazy_watch(w);
+	}
+	if (!max_watches) {
+		for (int i = 0; i < num_lazy_watches; ++i)
+			lazy_watches[i]->lazy_slot = 0;
+		num_lazy_watches = 0;
+	}
+	watch** ring = 0;
+	if (max_watches) {
+		ring = (watch**)realloc(lazy_watches,
+					max_watches * sizeof(watch*));
+		if (!ring) {
+			error = ENOMEM;
+			return 0;
+		}
+	} else {
+		free(lazy_watches);
+	}
+	lazy_watches = ring;
+	lazy_watch_limit = max_watches;
+	lazy_clock_hand = 0;
+	return 1;
+}
+
 /**
  * Set up recursive watches on an entire directory tree, optionally excluding
  * some directories.
@@ -1795,12 +3121,124 @@ int inotifytools_watch_recursively(char const* path, int events) {
  *       function to watch a directory tree and files or directories are being
  *       created or removed within that directory tree, there are no guarantees
  *       as to whether or not those files will be watched.
+ *
+ * @note With inotifytools_set_lazy_watching(), only the top of the tree is
+ *       watched up front.
  */
 int inotifytools_watch_recursively_with_exclude(char const* path,
 						int events,
 						char const** exclude_list) {
 	niceassert(initialized, "inotifytools_initialize not called yet");
+	if (lazy_depth >= 0 && !keep_lazy_exclude(exclude_list))
+		return 0;
+	// Subdirectories are watched before their parent, so they can't take
+	// after its watch
+	if (polling)
+		remote_tree = scan_remote_filesystem(path);
+	int ret = watch_tree(path, events, exclude_list, lazy_depth);
+	remote_tree = -1;
+	return ret;
+}
 
+/**
+ * Poll directories where inotify misses events, instead of watching them.
+ *
+ * inotify only reports the changes made through this machine to files on
+ * network filesystems such as NFS and CIFS, and to those on FUSE
+ * filesystems.  Once this is called, directories on those filesystems are
+ * polled by the functions which watch files, and so are the files and
+ * directories inotify has no watches left for.  Files in a polled directory
+ * are polled too, so a subdirectory created in it is polled once watched.
+ * The filesystem is told from the files watched whose directory isn't,
+ * which are the roots of recursive watches: a network filesystem mounted
+ * below a tree watched with inotify is watched with inotify too.
+ *
+ * A polled file gets a watch descriptor like any other, and the events
+ * found by polling are returned by inotifytools_next_event() and the like
+ * among those inotify reports.  Each scan compares the inode, size and
+ * times of the files with the previous one, so the events which can be
+ * told are IN_CREATE, IN_DELETE, IN_MOVED_FROM and IN_MOVED_TO (for a file
+ * renamed within its directory), IN_MODIFY followed by IN_CLOSE_WRITE,
+ * IN_ATTRIB, IN_DELETE_SELF and IN_IGNORED.  A new file is reported as if
+ * written and closed too.  Changes undone between two scans are missed.
+ *
+ * The scan is spread over time: every @a interval_ms milliseconds, the
+ * polled files after those scanned last are scanned until @a max_stats
+ * stat() calls were made.  A directory takes one, plus one per entry when
+ * IN_MODIFY, IN_ATTRIB or IN_CLOSE_WRITE is watched for or its entries
+ * changed.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.  Polling is not available with fanotify.
+ *
+ * @param interval_ms time between slices of the scan in milliseconds, or 0
+ *                    to stop choosing files to poll.  Files polled already
+ *                    are still polled.
+ *
+ * @param max_stats maximum number of stat() calls in each slice, or 0 to
+ *                  scan every polled file each time.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_set_polling(long interval_ms, int max_stats) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	if (interval_ms < 0 || (interval_ms && fanotify_mode)) {
+		error = EINVAL;
+		return 0;
+	}
+	if (interval_ms && !scan_set_rate(interval_ms, max_stats)) {
+		error = errno;
+		return 0;
+	}
+	polling = !!interval_ms;
+	return 1;
+}
+
+/**
+ * Poll an entire directory tree for changes instead of watching it,
+ * optionally excluding some directories.
+ *
+ * This works like inotifytools_watch_recursively_with_exclude(), but the
+ * directories are polled as described for inotifytools_set_polling(), at
+ * the rate set by it if it was called.  Polling needs no inotify watches,
+ * so it can cover trees too large to watch, at the cost of events being
+ * found late.
+ *
+ * @param path path of directory or file to poll.
+ *
+ * @param events Inotify events to poll for.  See section \ref events.
+ *
+ * @param exclude_list NULL terminated path list of directories not to poll.
+ *                     Can be NULL if no paths are to be excluded.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_poll_recursively(char const* path,
+				  int events,
+				  char const** exclude_list) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	if (fanotify_mode) {
+		error = EINVAL;
+		return 0;
+	}
+	forced_polling = 1;
+	int ret = watch_tree(path, events, exclude_list, -1);
+	forced_polling = 0;
+	return ret;
+}
+
+/**
+ * @internal
+ * Recursively watch @a path, as inotifytools_watch_recursively_with_exclude()
+ * does, reading directories only @a levels deep, or all of them if it is -1.
+ * The directories which are not read are watched lazily.
+ */
+static int watch_tree(char const* path,
+		      int events,
+		      char const** exclude_list,
+		      int levels) {
 	DIR* dir;
 	char* my_path;
 	error = 0;
@@ -1821,6 +3259,22 @@ int inotifytools_watch_recursively_with_exclude(char const* path,
 		my_path = (char*)path;
 	}
 
+	if (!levels) {
+		closedir(dir);
+		int ret = watch_lazily(my_path, events, 0);
+		if (my_path != path)
+			free(my_path);
+		return ret;
+	}
+
+	int mode = prune_watches ? watch_mode(my_path) : WATCH_FULL;
+	if (mode == WATCH_NONE) {
+		if (my_path != path)
+			free(my_path);
+		closedir(dir);
+		return 1;
+	}
+
 	static struct dirent* ent;
 	char* next_file;
 	static struct stat my_stat;
@@ -1845,37 +3299,17 @@ int inotifytools_watch_recursively_with_exclude(char const* path,
 				free(next_file);
 				nasprintf(&next_file, "%s%s/", my_path,
 					  ent->d_name);
-				static unsigned int no_watch;
-				static char const** exclude_entry;
-
-				no_watch = 0;
-				for (exclude_entry = exclude_list;
-				     exclude_entry && *exclude_entry &&
-				     !no_watch;
-				     ++exclude_entry) {
-					static int exclude_length;
-
-					exclude_length = strlen(*exclude_entry);
-					if ((*exclude_entry)[exclude_length -
-							     1] == '/') {
-						--exclude_length;
-					}
-					if (strlen(next_file) ==
-						(unsigned)(exclude_length +
-							   1) &&
-					    !strncmp(*exclude_entry, next_file,
-						     exclude_length)) {
-						// directory found in exclude
-						// list
-						no_watch = 1;
-					}
-				}
-				if (!no_watch) {
+				if (!excluded_dir(my_path, ent->d_name,
+						  next_file, exclude_list)) {
 					static int status;
 					status =
-					    inotifytools_watch_recursively_with_exclude(
-						next_file, events,
-						exclude_list);
+					    levels == 1
+						? watch_lazily(next_file,
+							       events, 0)
+						: watch_tree(next_file, events,
+							     exclude_list,
+							     levels < 0 ? levels
+									: levels - 1);
 					// For some errors, we will continue.
 					if (!status && (EACCES != error) &&
 					    (ENOENT != error) &&
@@ -1886,25 +3320,926 @@ int inotifytools_watch_recursively_with_exclude(char const* path,
 						closedir(dir);
 						return 0;
 					}
-				}  // if !no_watch
+				}  // if not excluded
 				free(next_file);
 			}  // if isdir and not islnk
 			else {
 				free(next_file);
 			}
 		}
-		ent = readdir(dir);
-		error = 0;
+		ent = readdir(dir);
+		error = 0;
+	}
+
+	closedir(dir);
+
+	int ret = watch_dir(my_path, mode, events);
+	if (my_path != path)
+		free(my_path);
+	return ret;
+}
+
+/**
+ * @internal
+ * A directory found by plan_tree(), in breadth-first order.
+ */
+struct planned_dir {
+	// Name in the parent directory, or path of the root, ending with '/'.
+	// Full paths are put together when needed, so that the plan of a deep
+	// tree isn't mostly copies of the same leading directories.
+	char* name;
+	int parent;
+	int depth;
+	// watch_mode() of the directory, which ranks it
+	int mode;
+	int64_t mtime;
+	// Whether its subdirectories were left unread because of
+	// inotifytools_set_lazy_watching()
+	char unread;
+	// Whether it is pruned or can't be read, so isn't watched
+	char skipped;
+	char chosen;
+	char watched;
+};
+
+/**
+ * @internal
+ * Order of directories for handing out watches: those the filters accept
+ * events in, then the shallowest, then the most recently modified.
+ */
+struct plan_order {
+	struct planned_dir const* dirs;
+	bool operator()(int a, int b) const {
+		struct planned_dir const& x = dirs[a];
+		struct planned_dir const& y = dirs[b];
+		if (x.mode != y.mode)
+			return x.mode < y.mode;
+		if (x.depth != y.depth)
+			return x.depth < y.depth;
+		return x.mtime > y.mtime;
+	}
+};
+
+/**
+ * @internal
+ * Count the inotify watches of the processes of this user, which share
+ * max_user_watches, by reading the inotify descriptors' fdinfo in /proc.
+ *
+ * @return the number of watches, or -1 if /proc can't be read.
+ */
+static int count_user_watches() {
+	DIR* proc = opendir("/proc");
+	if (!proc)
+		return -1;
+
+	uid_t uid = geteuid();
+	int count = 0;
+	struct dirent* ent;
+	while ((ent = readdir(proc))) {
+		struct stat st;
+		if (ent->d_name[0] < '1' || ent->d_name[0] > '9' ||
+		    fstatat(dirfd(proc), ent->d_name, &st, 0) ||
+		    st.st_uid != uid)
+			continue;
+
+		char* fds;
+		nasprintf(&fds, "/proc/%s/fd/", ent->d_name);
+		DIR* dir = opendir(fds);
+		struct dirent* fd;
+		while (dir && (fd = readdir(dir))) {
+			char link[32];
+			ssize_t len = readlinkat(dirfd(dir), fd->d_name, link,
+						 sizeof(link) - 1);
+			if (len < 0)
+				continue;
+			link[len] = '\0';
+			if (strcmp(link, "anon_inode:inotify"))
+				continue;
+
+			char* info;
+			nasprintf(&info, "/proc/%s/fdinfo/%s", ent->d_name,
+				  fd->d_name);
+			FILE* file = fopen(info, "r");
+			char line[64];
+			while (file && fgets(line, sizeof(line), file)) {
+				if (!strncmp(line, "inotify wd:", 11))
+					++count;
+				// Finish long lines
+				while (!strchr(line, '\n') &&
+				       fgets(line, sizeof(line), file))
+					;
+			}
+			if (file)
+				fclose(file);
+			free(info);
+		}
+		if (dir)
+			closedir(dir);
+		free(fds);
+	}
+	closedir(proc);
+	return count;
+}
+
+/**
+ * @internal
+ * Add the directory @a name to @a *dirs, which holds @a *count directories
+ * and has room for @a *size.
+ */
+static int add_planned_dir(struct planned_dir** dirs,
+			   int* count,
+			   int* size,
+			   char* name,
+			   int parent,
+			   int depth) {
+	if (*count == *size) {
+		int new_size = *size * 2 ?: 64;
+		struct planned_dir* p = (struct planned_dir*)realloc(
+		    *dirs, new_size * sizeof(struct planned_dir));
+		if (!p) {
+			free(name);
+			error = ENOMEM;
+			return 0;
+		}
+		*dirs = p;
+		*size = new_size;
+	}
+	struct planned_dir* d = &(*dirs)[(*count)++];
+	memset(d, 0, sizeof(*d));
+	d->name = name;
+	d->parent = parent;
+	d->depth = depth;
+	return 1;
+}
+
+/**
+ * @internal
+ * Get the path of directory @a i of @a dirs, ending with '/', from the names
+ * of its ancestors.
+ */
+static char* planned_path(struct planned_dir const* dirs, int i) {
+	size_t len = 0;
+	for (int j = i; j >= 0; j = dirs[j].parent)
+		len += strlen(dirs[j].name);
+	char* path = (char*)malloc(len + 1);
+	niceassert(path, "out of memory");
+	path[len] = '\0';
+	for (int j = i; j >= 0; j = dirs[j].parent) {
+		size_t n = strlen(dirs[j].name);
+		len -= n;
+		memcpy(path + len, dirs[j].name, n);
+	}
+	return path;
+}
+
+/**
+ * @internal
+ * Find the directories inotifytools_watch_recursively_with_exclude() would
+ * watch below @a root, which ends with '/', in breadth-first order.  Only
+ * one system call is made for each directory beside reading it, unless the
+ * filesystem does not report the type of directory entries.
+ */
+static int plan_tree(char const* root,
+		     char const** exclude_list,
+		     struct planned_dir** dirs,
+		     int* count) {
+	int size = 0;
+	*dirs = 0;
+	*count = 0;
+	char* path = strdup(root);
+	if (!path || !add_planned_dir(dirs, count, &size, path, -1, 0)) {
+		error = ENOMEM;
+		return 0;
+	}
+
+	for (int i = 0; i < *count; ++i) {
+		struct planned_dir* d = &(*dirs)[i];
+		char* parent = planned_path(*dirs, i);
+		d->mode = watch_mode(parent);
+		if (prune_watches && d->mode == WATCH_NONE) {
+			d->skipped = 1;
+			free(parent);
+			continue;
+		}
+		if (d->depth == lazy_depth) {
+			d->unread = 1;
+			free(parent);
+			continue;
+		}
+
+		DIR* dir = opendir(parent);
+		struct stat st;
+		if (!dir || fstat(dirfd(dir), &st)) {
+			error = errno;
+			if (dir)
+				closedir(dir);
+			free(parent);
+			// Directories which can't be read aren't watched
+			if (i && skippable_error(error)) {
+				d->skipped = 1;
+				continue;
+			}
+			return 0;
+		}
+		d->mtime = st.st_mtim.tv_sec;
+		int depth = d->depth;
+
+		struct dirent* ent;
+		while ((ent = readdir(dir))) {
+			if (!strcmp(ent->d_name, ".") ||
+			    !strcmp(ent->d_name, ".."))
+				continue;
+			if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+				continue;
+
+			nasprintf(&path, "%s%s/", parent, ent->d_name);
+			if (ent->d_type == DT_UNKNOWN) {
+				// Without the '/', which would follow a symlink
+				size_t len = strlen(path);
+				path[len - 1] = '\0';
+				int subdir =
+				    !lstat(path, &st) && S_ISDIR(st.st_mode);
+				path[len - 1] = '/';
+				if (!subdir) {
+					free(path);
+					continue;
+				}
+			}
+			int excluded = excluded_dir(parent, ent->d_name, path,
+						    exclude_list);
+			free(path);
+			if (excluded)
+				continue;
+			char* name;
+			nasprintf(&name, "%s/", ent->d_name);
+			// d may move as dirs grows
+			if (!add_planned_dir(dirs, count, &size, name, i,
+					     depth + 1)) {
+				closedir(dir);
+				free(parent);
+				return 0;
+			}
+		}
+		closedir(dir);
+		free(parent);
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Watch the directories of @a dirs which were chosen, parents first, and
+ * leave those whose subdirectories weren't all watched to watch them once
+ * there is activity.
+ */
+static void watch_planned(struct planned_dir* dirs,
+			  int count,
+			  int events,
+			  struct inotifytools_watch_plan* plan) {
+	for (int i = 0; i < count; ++i) {
+		struct planned_dir* d = &dirs[i];
+		if (!d->chosen)
+			continue;
+		char* path = planned_path(dirs, i);
+		int ok = watch_dir(path, prune_watches ? d->mode : WATCH_FULL,
+				   events);
+		free(path);
+		if (!ok) {
+			// Another process may have taken the watches left
+			if (error == ENOSPC) {
+				plan->limit_reached = 1;
+				break;
+			}
+			continue;
+		}
+		d->watched = 1;
+		++plan->watched;
+	}
+
+	// Without fanotify marks being removable, the lazily watched
+	// directories could take more than their share
+	if (fanotify_mode)
+		return;
+	for (int i = 0; i < count; ++i) {
+		struct planned_dir* d = &dirs[i];
+		struct planned_dir* parent = d->parent < 0 ? 0 : &dirs[d->parent];
+		int lazy = -1;
+		if (d->watched && d->unread)
+			lazy = i;
+		else if (!d->watched && !d->skipped && parent &&
+			 parent->watched)
+			lazy = d->parent;
+		watch* w = 0;
+		if (lazy >= 0) {
+			char* path = planned_path(dirs, lazy);
+			w = watch_from_filename(path);
+			free(path);
+		}
+		if (w && !w->unexpanded) {
+			w->lazy_events = events;
+			w->unexpanded = 1;
+			lazy_expansion = 1;
+			++plan->lazy;
+		}
+	}
+}
+
+/**
+ * Set up recursive watches on a directory tree with the watches available,
+ * rather than failing once they run out.
+ *
+ * The directories which inotifytools_watch_recursively_with_exclude() would
+ * watch are found first.  If there are more of them than the watches left,
+ * which are those max_user_watches allows the user, less those of all of
+ * their processes, and at most @a max_watches, the watches go first to
+ * directories the filters accept events in, then to the shallowest, then to
+ * the most recently modified ones.  A few are held back for activity: the
+ * subdirectories of a watched directory which got no watch are watched once
+ * an event occurs in it, within inotifytools_set_lazy_watching() limits, as
+ * are those of directories left for later by lazy watching.
+ *
+ * The watches of the user's other processes are only counted when the tree
+ * and this process's watches come to over half of max_user_watches.  Below
+ * that, the directories are watched in the same order until inotify runs out.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param path path of directory or file to watch.  If the path is a file, it
+ *             is watched exactly as if inotifytools_watch_file() were used.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @param exclude_list NULL terminated path list of directories not to watch,
+ *                     as for inotifytools_watch_recursively_with_exclude().
+ *                     Can be NULL if no paths are to be excluded.
+ *
+ * @param max_watches most watches to use for the tree, or 0 for as many as
+ *                    are available.
+ *
+ * @param plan if not NULL, filled in with how the watches were shared out.
+ *
+ * @return 1 on success, including when not every directory could be watched,
+ *         0 on failure.  On failure, the error can be obtained from
+ *         inotifytools_error().
+ */
+int inotifytools_watch_recursively_within_budget(
+    char const* path,
+    int events,
+    char const** exclude_list,
+    int max_watches,
+    struct inotifytools_watch_plan* plan) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	struct inotifytools_watch_plan unused;
+	if (!plan)
+		plan = &unused;
+	memset(plan, 0, sizeof(*plan));
+	error = 0;
+	if (max_watches < 0) {
+		error = EINVAL;
+		return 0;
+	}
+
+	DIR* dir = opendir(path);
+	if (!dir) {
+		// If not a directory, don't need to do anything special
+		if (errno != ENOTDIR) {
+			error = errno;
+			return 0;
+		}
+		if (!inotifytools_watch_file(path, events))
+			return 0;
+		plan->budget = plan->dirs = plan->watched = 1;
+		return 1;
+	}
+	closedir(dir);
+	if (lazy_depth >= 0 && !keep_lazy_exclude(exclude_list))
+		return 0;
+
+	char* root;
+	if (path[strlen(path) - 1] != '/')
+		nasprintf(&root, "%s/", path);
+	else
+		root = strdup(path);
+	struct planned_dir* dirs = 0;
+	int count = 0;
+	int ok = root && plan_tree(root, exclude_list, &dirs, &count);
+	free(root);
+	if (!ok) {
+		for (int i = 0; i < count; ++i)
+			free(dirs[i].name);
+		free(dirs);
+		return 0;
+	}
+
+	int* order = (int*)malloc(count * sizeof(int));
+	niceassert(order, "out of memory");
+	int wanted = 0;
+	for (int i = 0; i < count; ++i) {
+		if (!dirs[i].skipped)
+			order[wanted++] = i;
+	}
+	plan->dirs = wanted;
+
+	// fanotify marks are limited by max_user_marks instead.  Counting the
+	// user's watches reads /proc, so it's only worth it for trees taking
+	// much of the limit; otherwise running out shows up as ENOSPC.
+	int budget = max_watches ?: INT_MAX;
+	int limit = fanotify_mode ? -1 : inotifytools_get_max_user_watches();
+	if (limit > 0 &&
+	    (long)wanted + inotifytools_get_num_watches() > limit / 2) {
+		int used = count_user_watches();
+		if (used >= 0 && limit - used < budget) {
+			budget = std::max(limit - used, 0);
+			plan->limit_reached = wanted > budget;
+		}
+	}
+	plan->budget = budget;
+
+	if (wanted > budget) {
+		// Hold some watches back for the directories which show
+		// activity
+		int reserve = fanotify_mode ? 0 : budget / 8;
+		if (reserve && !lazy_watch_limit)
+			set_lazy_watch_limit(reserve);
+		wanted = budget - reserve;
+		plan_order less = {dirs};
+		if (wanted > 0)
+			std::nth_element(order, order + wanted - 1,
+					 order + plan->dirs, less);
+	}
+	for (int i = 0; i < wanted; ++i)
+		dirs[order[i]].chosen = 1;
+	free(order);
+
+	watch_planned(dirs, count, events, plan);
+	for (int i = 0; i < count; ++i)
+		free(dirs[i].name);
+	free(dirs);
+	error = 0;
+	return 1;
+}
+
+// Layout of the files written by inotifytools_save_snapshot(): a header,
+// an entry for each watched directory sorted by path, then the paths.  It
+// is read in place once mapped, so every field is in host byte order and
+// naturally aligned.
+#define SNAPSHOT_MAGIC "ITSNAP1"
+
+struct snapshot_header {
+	char magic[8];
+	// When the snapshot was saved, in seconds since the epoch
+	int64_t saved;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct snapshot_entry {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	// Offset of the path, ending with '/' and NUL terminated, from the
+	// start of the file
+	uint32_t path;
+};
+
+struct snapshot {
+	char const* base;
+	struct snapshot_entry const* entries;
+	uint32_t count;
+	int64_t saved;
+};
+
+/**
+ * @internal
+ * Whether watch @a w is saved in snapshots: a watched directory, rather
+ * than a file or an entry made to resolve fanotify events.
+ */
+static int snapshot_watch(watch const* w) {
+	size_t len = strlen(w->filename);
+	return len && w->filename[len - 1] == '/' &&
+	       (!fanotify_mode || w->dirf > 0);
+}
+
+/**
+ * @internal
+ * lstat() @a path without the '/' it ends in, which would follow a symlink.
+ */
+static int lstat_dir(char const* path, struct stat* st) {
+	size_t len = strlen(path);
+	if (len < 2 || path[len - 1] != '/')
+		return lstat(path, st);
+	char* dir = strndup(path, len - 1);
+	if (!dir)
+		return -1;
+	int ret = lstat(dir, st);
+	free(dir);
+	return ret;
+}
+
+/**
+ * Save the watched directories to a file, so that they can be watched again
+ * with inotifytools_load_snapshot() without reading every one of them.
+ *
+ * The path, device, inode and modification time of each directory are saved.
+ * The file is written under a temporary name and renamed to @a filename, so
+ * an existing snapshot is replaced atomically.  Paths are saved as they were
+ * watched, so relative paths need the same working directory to load.
+ *
+ * @param filename path of the snapshot.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ *
+ * @note Directories which are created after the snapshot is saved are found
+ *       when loading it, because their parent's modification time changed.
+ *       Saving it when the watches are out of date, e.g. while events which
+ *       create directories are still to be handled, is safe but slows down
+ *       loading it.
+ */
+int inotifytools_save_snapshot(char const* filename) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	error = 0;
+
+	struct snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.saved = time(0);
+
+	int num_watches = inotifytools_get_num_watches();
+	struct snapshot_entry* entries = (struct snapshot_entry*)calloc(
+	    num_watches ?: 1, sizeof(struct snapshot_entry));
+	char const** paths = (char const**)calloc(num_watches ?: 1,
+						  sizeof(char const*));
+	if (!entries || !paths) {
+		free(entries);
+		free(paths);
+		error = ENOMEM;
+		return 0;
+	}
+
+	// Directories removed since they were watched are left out
+	size_t size = 0;
+	RBLIST* all = rbopenlist(tree_filename);
+	watch* w;
+	while ((w = (watch*)rbreadlist(all))) {
+		struct stat st;
+		if (!snapshot_watch(w) || lstat_dir(w->filename, &st) ||
+		    !S_ISDIR(st.st_mode))
+			continue;
+		struct snapshot_entry* e = &entries[header.count];
+		e->dev = st.st_dev;
+		e->ino = st.st_ino;
+		e->mtime_sec = st.st_mtim.tv_sec;
+		e->mtime_nsec = st.st_mtim.tv_nsec;
+		e->path = size;
+		paths[header.count++] = w->filename;
+		size += strlen(w->filename) + 1;
+	}
+	rbcloselist(all);
+
+	size_t offset =
+	    sizeof(header) + header.count * sizeof(struct snapshot_entry);
+	if (offset + size > UINT32_MAX) {
+		free(entries);
+		free(paths);
+		error = EFBIG;
+		return 0;
+	}
+	for (uint32_t i = 0; i < header.count; ++i)
+		entries[i].path += offset;
+
+	char* tmpname;
+	nasprintf(&tmpname, "%s.XXXXXX", filename);
+	int fd = mkstemp(tmpname);
+	FILE* file = fd == -1 ? NULL : fdopen(fd, "w");
+	int ok = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+		 fwrite(entries, sizeof(struct snapshot_entry), header.count,
+			file) == header.count;
+	for (uint32_t i = 0; ok && i < header.count; ++i)
+		ok = fwrite(paths[i], strlen(paths[i]) + 1, 1, file) == 1;
+	if (!ok)
+		error = errno;
+	if (file && fclose(file) && ok) {
+		error = errno;
+		ok = 0;
+	} else if (!file && fd != -1) {
+		close(fd);
+	}
+	if (ok && rename(tmpname, filename)) {
+		error = errno;
+		ok = 0;
+	}
+	if (!ok && fd != -1)
+		unlink(tmpname);
+
+	free(tmpname);
+	free(entries);
+	free(paths);
+	return ok;
+}
+
+/**
+ * @internal
+ * Check that the @a size bytes at @a base are a snapshot, and set up
+ * @a snap to read it.
+ */
+static int open_snapshot(struct snapshot* snap, char const* base, size_t size) {
+	struct snapshot_header const* header =
+	    (struct snapshot_header const*)base;
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+	    header->count >
+		(size - sizeof(*header)) / sizeof(struct snapshot_entry))
+		return 0;
+
+	snap->base = base;
+	snap->entries = (struct snapshot_entry const*)(header + 1);
+	snap->count = header->count;
+	snap->saved = header->saved;
+
+	// Lookups rely on the paths being sorted
+	char const* prev = NULL;
+	for (uint32_t i = 0; i < snap->count; ++i) {
+		uint32_t offset = snap->entries[i].path;
+		if (offset >= size)
+			return 0;
+		char const* path = base + offset;
+		size_t len = strnlen(path, size - offset);
+		if (!len || len == size - offset || path[len - 1] != '/' ||
+		    (prev && strcmp(prev, path) >= 0))
+			return 0;
+		prev = path;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Whether directory @a path is in @a snap.
+ */
+static int snapshot_has(struct snapshot const* snap, char const* path) {
+	uint32_t lo = 0, hi = snap->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(path, snap->base + snap->entries[mid].path);
+		if (!cmp)
+			return 1;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * Index of the first entry of @a snap after entry @a i which is not below
+ * its directory.
+ */
+static uint32_t skip_subtree(struct snapshot const* snap, uint32_t i) {
+	char const* dir = snap->base + snap->entries[i].path;
+	size_t len = strlen(dir);
+	while (++i < snap->count &&
+	       !strncmp(dir, snap->base + snap->entries[i].path, len))
+		;
+	return i;
+}
+
+/**
+ * @internal
+ * Whether directory @a path of @a snap is left out of recursive watches by
+ * @a exclude_list or the glob filters.  Only directories whose parent is in
+ * the snapshot can be, as the others were watched as the root of a tree.
+ */
+static int snapshot_excludes(struct snapshot const* snap,
+			     char const* path,
+			     char const** exclude_list) {
+	if (!exclude_list && !glob_filter_active())
+		return 0;
+	size_t len = strlen(path);
+	char const* name = path + len - 1;
+	while (name > path && name[-1] != '/')
+		--name;
+	if (name == path)
+		return 0;
+
+	char* parent = strndup(path, name - path);
+	char* dirname = strndup(name, path + len - 1 - name);
+	niceassert(parent && dirname, "out of memory");
+	int ret = snapshot_has(snap, parent) &&
+		  excluded_dir(parent, dirname, path, exclude_list);
+	free(parent);
+	free(dirname);
+	return ret;
+}
+
+/**
+ * @internal
+ * Recursively watch the subdirectories of @a dir which are not in @a snap,
+ * because they were created since it was saved.
+ */
+static int watch_new_subdirs(struct snapshot const* snap,
+			     char const* dir,
+			     int events,
+			     char const** exclude_list) {
+	DIR* d = opendir(dir);
+	if (!d) {
+		error = errno;
+		return skippable_error(error);
+	}
+
+	int ret = 1;
+	struct dirent* ent;
+	while (ret && (ent = readdir(d))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+			continue;
+
+		char* path;
+		nasprintf(&path, "%s%s/", dir, ent->d_name);
+		if (ent->d_type == DT_UNKNOWN) {
+			// Without the '/', which would follow a symlink
+			size_t len = strlen(path);
+			path[len - 1] = '\0';
+			struct stat st;
+			int subdir = !lstat(path, &st) && S_ISDIR(st.st_mode);
+			path[len - 1] = '/';
+			if (!subdir) {
+				free(path);
+				continue;
+			}
+		}
+		if (!snapshot_has(snap, path) &&
+		    !excluded_dir(dir, ent->d_name, path, exclude_list) &&
+		    !inotifytools_watch_recursively_with_exclude(
+			path, events, exclude_list) &&
+		    !skippable_error(error))
+			ret = 0;
+		free(path);
+	}
+	closedir(d);
+	return ret;
+}
+
+/**
+ * @internal
+ * Watch the directories in @a snap, reading only those which changed.
+ */
+static int watch_snapshot(struct snapshot const* snap,
+			  int events,
+			  char const** exclude_list) {
+	uint32_t i = 0;
+	while (i < snap->count) {
+		struct snapshot_entry const* e = &snap->entries[i];
+		char const* path = snap->base + e->path;
+		struct stat st;
+		// Whatever replaced a directory which is gone is found by
+		// reading its parent, which changed too.
+		if (lstat_dir(path, &st) || !S_ISDIR(st.st_mode) ||
+		    snapshot_excludes(snap, path, exclude_list)) {
+			i = skip_subtree(snap, i);
+			continue;
+		}
+
+		// Nothing saved below a directory which was replaced holds
+		if (st.st_dev != e->dev || st.st_ino != e->ino) {
+			if (!inotifytools_watch_recursively_with_exclude(
+				path, events, exclude_list) &&
+			    !skippable_error(error))
+				return 0;
+			i = skip_subtree(snap, i);
+			continue;
+		}
+
+		int mode = prune_watches ? watch_mode(path) : WATCH_FULL;
+		if (mode == WATCH_NONE) {
+			i = skip_subtree(snap, i);
+			continue;
+		}
+		if (!watch_dir(path, mode, events) && !skippable_error(error))
+			return 0;
+
+		// Modification times are only as fine as the kernel's clock
+		// tick, so a directory modified around the time the snapshot
+		// was saved may have changed again since without its time
+		// changing.
+		if ((st.st_mtim.tv_sec != e->mtime_sec ||
+		     st.st_mtim.tv_nsec != e->mtime_nsec ||
+		     e->mtime_sec + 1 >= snap->saved) &&
+		    !watch_new_subdirs(snap, path, events, exclude_list))
+			return 0;
+		++i;
 	}
+	error = 0;
+	return 1;
+}
 
-	closedir(dir);
+/**
+ * Watch the directories saved with inotifytools_save_snapshot(), as
+ * inotifytools_watch_recursively_with_exclude() would have, without reading
+ * the directories which did not change since.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * Each saved directory which still exists is watched.  Directories modified
+ * since the snapshot was saved are read to recursively watch subdirectories
+ * created in them, and directories which were replaced by another one are
+ * watched recursively from scratch.
+ *
+ * @param filename path of the snapshot.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @param exclude_list NULL terminated path list of directories not to watch,
+ *                     as for inotifytools_watch_recursively_with_exclude().
+ *                     Can be NULL if no paths are to be excluded.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error(): ENOENT if there is no
+ *         snapshot and EINVAL if the file is not one, in which case the
+ *         tree can be watched with
+ *         inotifytools_watch_recursively_with_exclude() instead.  Errors on
+ *         single directories are ignored as they are for recursive watches.
+ */
+int inotifytools_load_snapshot(char const* filename,
+			       int events,
+			       char const** exclude_list) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	error = 0;
 
-	int ret = inotifytools_watch_file(my_path, events);
-	if (my_path != path)
-		free(my_path);
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st)) {
+		error = errno;
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+	size_t size = st.st_size;
+	void* base = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+			  : MAP_FAILED;
+	if (base == MAP_FAILED)
+		error = size ? errno : EINVAL;
+	close(fd);
+	if (base == MAP_FAILED)
+		return 0;
+
+	struct snapshot snap;
+	int ret = 0;
+	if (!open_snapshot(&snap, (char const*)base, size))
+		error = EINVAL;
+	else
+		ret = watch_snapshot(&snap, events, exclude_list);
+	munmap(base, size);
 	return ret;
 }
 
+/**
+ * @internal
+ * Work out how much of directory @a dir needs watching for the regular
+ * expression and glob filters to see every event they would accept.
+ */
+static int watch_mode(char const* dir) {
+	int mode = glob_filter_active() ? glob_filter_watch_mode(dir, strlen(dir))
+					: WATCH_FULL;
+	if (mode == WATCH_NONE || !regex)
+		return mode;
+
+	int matched = regex_dir_safe && !regexec(regex, dir, 0, 0, REG_NOTEOL);
+	if (matched && !invert_regexp)
+		return WATCH_NONE;
+	if (!matched && invert_regexp && regex_dir_scoped)
+		return WATCH_DIRS_ONLY;
+	return mode;
+}
+
+/**
+ * Don't watch directories the filters would discard all events from.
+ *
+ * When enabled, inotifytools_watch_recursively() checks each directory
+ * against the filters set with inotifytools_ignore_events_by_regex(),
+ * inotifytools_ignore_events_by_glob() and related functions before watching
+ * it.  Directories in which no event could pass are neither watched nor
+ * descended into, and directories in which only events below a subdirectory
+ * could pass are watched for new subdirectories only, so that the kernel
+ * does not queue events which would be discarded anyway.
+ *
+ * The filters must be set before watching.  Only patterns which can be
+ * decided from a directory name alone allow pruning: for regular
+ * expressions, one that matches the directory itself, or an include pattern
+ * ending in `/'.
+ *
+ * @param enable 1 to prune watches, 0 to watch every directory.
+ */
+void inotifytools_set_watch_pruning(int enable) {
+	prune_watches = enable;
+}
+
 /**
  * Get the last error which occurred.
  *
@@ -1948,6 +4283,42 @@ int inotifytools_get_num_watches() {
 	return ret;
 }
 
+// Size of a red-black tree node: three links, the colour and the key
+#define RB_NODE_SIZE (5 * sizeof(void*))
+
+static void add_watch_bytes(const void* nodep,
+			    const VISIT which,
+			    const int depth,
+			    void* arg) {
+	if (which != endorder && which != leaf)
+		return;
+	watch* w = (watch*)nodep;
+	size_t bytes = sizeof(watch) + strlen(w->filename) + 1 +
+		       2 * RB_NODE_SIZE;
+#ifdef LINUX_FANOTIFY
+	if (w->fid)
+		bytes += MAX_FID_LEN + sizeof(*w->fid) + RB_NODE_SIZE;
+#endif
+	if (w->rates)
+		bytes += sizeof(struct rates);
+	*(size_t*)arg += bytes;
+}
+
+/**
+ * @internal
+ * Estimate the memory used by the watch index: the watches, their file
+ * names, fids and rates, and their nodes in the trees which index them.
+ * Allocator overhead is not included.
+ *
+ * @return the number of bytes.
+ */
+size_t inotifytools_watch_index_bytes() {
+	size_t bytes = 0;
+	if (initialized)
+		rbwalk(tree_wd, add_watch_bytes, (void*)&bytes);
+	return bytes;
+}
+
 /**
  * Print a string to standard out using an inotify_event and a printf-like
  * syntax.
@@ -1971,13 +4342,26 @@ int inotifytools_get_num_watches() {
  *  \li \c \%e - Replaced with the Event(s) which occurred, comma-separated.
  *  \li \c \%Xe - Replaced with the Event(s) which occurred, separated by
  *                whichever character is in the place of `X'.
- *  \li \c \%T - Replaced by the current Time in the format specified by the
- *               string previously passed to inotifytools_set_printf_timefmt(),
- *               or replaced with an empty string if that function has never
- *               been called.
+ *  \li \c \%T - Replaced by the Time the event was read in the format
+ *               specified by the string previously passed to
+ *               inotifytools_set_printf_timefmt(), or replaced with an empty
+ *               string if that function has never been called.
+ *  \li \c \%N - Replaced by the time the event was read, in Nanoseconds
+ *               since the epoch.
+ *  \li \c \%U - Replaced by the time the event was read, in microseconds
+ *               since the epoch.
+ *  \li \c \%M - Replaced by the time the event was read, in Milliseconds
+ *               since the epoch.
  *  \li \c \%0 - Replaced with the 'NUL' character
  *  \li \c \%n - Replaced with the 'Line Feed' character
  *
+ * The time tokens give the time the event last returned by
+ * inotifytools_next_event() or a related function was read, which is the
+ * time of @a event only if it is that event.  Events kept for later, such
+ * as those taken from an inotifytools_queue, are formatted with the time of
+ * the last event read instead; inotifytools_get_event_time() and
+ * inotifytools_queue_get_event_time() tell when each was read.
+ *
  * @section example Example
  * @code
  * // suppose this is the only file watched.
@@ -2020,13 +4404,26 @@ int inotifytools_printf(struct inotify_event* event, const char* fmt) {
  *  \li \c \%e - Replaced with the Event(s) which occurred, comma-separated.
  *  \li \c \%Xe - Replaced with the Event(s) which occurred, separated by
  *                whichever character is in the place of `X'.
- *  \li \c \%T - Replaced by the current Time in the format specified by the
- *               string previously passed to inotifytools_set_printf_timefmt(),
- *               or replaced with an empty string if that function has never
- *               been called.
+ *  \li \c \%T - Replaced by the Time the event was read in the format
+ *               specified by the string previously passed to
+ *               inotifytools_set_printf_timefmt(), or replaced with an empty
+ *               string if that function has never been called.
+ *  \li \c \%N - Replaced by the time the event was read, in Nanoseconds
+ *               since the epoch.
+ *  \li \c \%U - Replaced by the time the event was read, in microseconds
+ *               since the epoch.
+ *  \li \c \%M - Replaced by the time the event was read, in Milliseconds
+ *               since the epoch.
  *  \li \c \%0 - Replaced with the 'NUL' character
  *  \li \c \%n - Replaced with the 'Line Feed' character
  *
+ * The time tokens give the time the event last returned by
+ * inotifytools_next_event() or a related function was read, which is the
+ * time of @a event only if it is that event.  Events kept for later, such
+ * as those taken from an inotifytools_queue, are formatted with the time of
+ * the last event read instead; inotifytools_get_event_time() and
+ * inotifytools_queue_get_event_time() tell when each was read.
+ *
  * @section example Example
  * @code
  * // suppose this is the only file watched.
@@ -2046,9 +4443,16 @@ int inotifytools_fprintf(FILE* file,
 			 const char* fmt) {
 	static struct nstring out;
 	static int ret;
+	uint64_t start = perf_now();
 	ret = inotifytools_sprintf(&out, event, fmt);
-	if (-1 != ret)
+	perf_add(&perf.format_ns, start);
+	if (-1 != ret) {
+		++perf.events_formatted;
+		start = perf_now();
 		fwrite(out.buf, sizeof(char), out.len, file);
+		perf_add(&perf.output_ns, start);
+		perf.bytes_written += out.len;
+	}
 	return ret;
 }
 
@@ -2081,13 +4485,26 @@ int inotifytools_fprintf(FILE* file,
  *  \li \c \%e - Replaced with the Event(s) which occurred, comma-separated.
  *  \li \c \%Xe - Replaced with the Event(s) which occurred, separated by
  *                whichever character is in the place of `X'.
- *  \li \c \%T - Replaced by the current Time in the format specified by the
- *               string previously passed to inotifytools_set_printf_timefmt(),
- *               or replaced with an empty string if that function has never
- *               been called.
+ *  \li \c \%T - Replaced by the Time the event was read in the format
+ *               specified by the string previously passed to
+ *               inotifytools_set_printf_timefmt(), or replaced with an empty
+ *               string if that function has never been called.
+ *  \li \c \%N - Replaced by the time the event was read, in Nanoseconds
+ *               since the epoch.
+ *  \li \c \%U - Replaced by the time the event was read, in microseconds
+ *               since the epoch.
+ *  \li \c \%M - Replaced by the time the event was read, in Milliseconds
+ *               since the epoch.
  *  \li \c \%0 - Replaced with the 'NUL' character
  *  \li \c \%n - Replaced with the 'Line Feed' character
  *
+ * The time tokens give the time the event last returned by
+ * inotifytools_next_event() or a related function was read, which is the
+ * time of @a event only if it is that event.  Events kept for later, such
+ * as those taken from an inotifytools_queue, are formatted with the time of
+ * the last event read instead; inotifytools_get_event_time() and
+ * inotifytools_queue_get_event_time() tell when each was read.
+ *
  * @section example Example
  * @code
  * // suppose this is the only file watched.
@@ -2136,13 +4553,26 @@ int inotifytools_sprintf(struct nstring* out,
  *  \li \c \%e - Replaced with the Event(s) which occurred, comma-separated.
  *  \li \c \%Xe - Replaced with the Event(s) which occurred, separated by
  *                whichever character is in the place of `X'.
- *  \li \c \%T - Replaced by the current Time in the format specified by the
- *               string previously passed to inotifytools_set_printf_timefmt(),
- *               or replaced with an empty string if that function has never
- *               been called.
+ *  \li \c \%T - Replaced by the Time the event was read in the format
+ *               specified by the string previously passed to
+ *               inotifytools_set_printf_timefmt(), or replaced with an empty
+ *               string if that function has never been called.
+ *  \li \c \%N - Replaced by the time the event was read, in Nanoseconds
+ *               since the epoch.
+ *  \li \c \%U - Replaced by the time the event was read, in microseconds
+ *               since the epoch.
+ *  \li \c \%M - Replaced by the time the event was read, in Milliseconds
+ *               since the epoch.
  *  \li \c \%0 - Replaced with the 'NUL' character
  *  \li \c \%n - Replaced with the 'Line Feed' character
  *
+ * The time tokens give the time the event last returned by
+ * inotifytools_next_event() or a related function was read, which is the
+ * time of @a event only if it is that event.  Events kept for later, such
+ * as those taken from an inotifytools_queue, are formatted with the time of
+ * the last event read instead; inotifytools_get_event_time() and
+ * inotifytools_queue_get_event_time() tell when each was read.
+ *
  * @section example Example
  * @code
  * // suppose this is the only file watched.
@@ -2168,7 +4598,10 @@ int inotifytools_snprintf(struct nstring* out,
 	static unsigned int i, ind;
 	static char ch1;
 	static char timestr[MAX_STRLEN];
-	static time_t now;
+	static size_t timestr_len;
+	static time_t timestr_sec;
+	static unsigned timestr_generation;
+	size_t n;
 
 	size_t dirnamelen = 0;
 	const char* eventname;
@@ -2184,6 +4617,11 @@ int inotifytools_snprintf(struct nstring* out,
 		return -1;
 	}
 
+	// The time the event was read, or now if no event was
+	struct timespec when = last_event_time.realtime;
+	if (!when.tv_sec && !when.tv_nsec)
+		clock_gettime(CLOCK_REALTIME, &when);
+
 	ind = 0;
 	for (i = 0; i < strlen(fmt) && (int)ind < size - 1; ++i) {
 		if (fmt[i] != '%') {
@@ -2251,22 +4689,29 @@ int inotifytools_snprintf(struct nstring* out,
 		}
 
 		if (ch1 == 'T') {
-			if (!timefmt.empty()) {
-				now = time(0);
-				struct tm now_tm;
-				if (!strftime(timestr, MAX_STRLEN - 1,
-					      timefmt.c_str_,
-					      localtime_r(&now, &now_tm))) {
+			// Formatted once a second, since every event read in
+			// the same second gives the same string
+			if (timefmt.empty()) {
+				timestr_len = 0;
+			} else if (timestr_generation != timefmt_generation ||
+				   timestr_sec != when.tv_sec) {
+				struct tm when_tm;
+				timestr_len = strftime(
+				    timestr, MAX_STRLEN - 1, timefmt.c_str_,
+				    localtime_r(&when.tv_sec, &when_tm));
+				if (!timestr_len) {
 					// time format probably invalid
+					timestr_generation = 0;
 					error = EINVAL;
 					return ind;
 				}
-			} else {
-				timestr[0] = 0;
+				timestr_generation = timefmt_generation;
+				timestr_sec = when.tv_sec;
 			}
 
-			strncpy(&out->buf[ind], timestr, size - ind);
-			ind += strlen(timestr);
+			n = std::min(timestr_len, (size_t)(size - ind - 1));
+			memcpy(&out->buf[ind], timestr, n);
+			ind += n;
 			++i;
 			continue;
 		}
@@ -2281,6 +4726,18 @@ int inotifytools_snprintf(struct nstring* out,
 			continue;
 		}
 
+		// After %Xe, so that %Ne, %Ue and %Me still separate events
+		// with N, U and M
+		if (ch1 == 'N' || ch1 == 'U' || ch1 == 'M') {
+			int64_t t = (int64_t)when.tv_sec * 1000000000 +
+				    when.tv_nsec;
+			t /= ch1 == 'N' ? 1 : ch1 == 'U' ? 1000 : 1000000;
+			n = snprintf(&out->buf[ind], size - ind, "%" PRId64, t);
+			ind += std::min(n, (size_t)(size - ind - 1));
+			++i;
+			continue;
+		}
+
 		// OK, this wasn't a special format character, just output it as
 		// normal
 		if (ind < MAX_STRLEN)
@@ -2305,10 +4762,76 @@ int inotifytools_snprintf(struct nstring* out,
  */
 void inotifytools_set_printf_timefmt(const char* fmt) {
 	timefmt.set_size(nasprintf(&timefmt.c_str_, "%s", fmt));
+	++timefmt_generation;
 }
 
 void inotifytools_clear_timefmt() {
 	timefmt.clear();
+	++timefmt_generation;
+}
+
+/**
+ * Get the time the event last returned by inotifytools_next_event() or a
+ * related function was read from the kernel.
+ *
+ * Events are stamped once for each read, so events read together have the
+ * same time, and an event merged by inotifytools_set_coalescing() has the
+ * time of the first event merged into it.
+ *
+ * @param realtime set to the CLOCK_REALTIME time the event was read, if not
+ *                 NULL.
+ *
+ * @param monotonic set to the CLOCK_MONOTONIC time the event was read, if
+ *                  not NULL.  Use it to measure how long events take to
+ *                  handle.
+ *
+ * @return 1 if an event was returned since inotifytools_initialize(), 0
+ *         otherwise, in which case the times are set to 0.
+ */
+int inotifytools_get_event_time(struct timespec* realtime,
+				struct timespec* monotonic) {
+	if (realtime)
+		*realtime = last_event_time.realtime;
+	if (monotonic)
+		*monotonic = last_event_time.monotonic;
+	return last_event_time.realtime.tv_sec ||
+	       last_event_time.realtime.tv_nsec;
+}
+
+/**
+ * Get the counters of the work done handling events since
+ * inotifytools_initialize() or inotifytools_reset_perf_counters().
+ *
+ * The counts are always kept, and cost an increment each.  The times spent
+ * in each stage are only kept while inotifytools_set_perf_timers() is on.
+ *
+ * @param counters set to the counters.
+ */
+void inotifytools_get_perf_counters(
+    struct inotifytools_perf_counters* counters) {
+	*counters = perf;
+}
+
+/**
+ * Set the counters returned by inotifytools_get_perf_counters() to 0, and
+ * start counting the time they cover from now.
+ */
+void inotifytools_reset_perf_counters() {
+	memset(&perf, 0, sizeof(perf));
+	clock_gettime(CLOCK_MONOTONIC, &perf.since);
+}
+
+/**
+ * Time each stage of handling events: waiting for and reading events,
+ * filtering them, resolving fanotify file handles to paths, and formatting
+ * and writing them with inotifytools_fprintf().  Each stage takes two more
+ * reads of the clock, so this is off by default.
+ *
+ * @param enable nonzero to keep the times in inotifytools_perf_counters,
+ *               0 to stop.
+ */
+void inotifytools_set_perf_timers(int enable) {
+	perf_timers = enable;
 }
 
 /**
@@ -2375,6 +4898,7 @@ static int do_ignore_events_by_regex(char const* pattern,
 				     int flags,
 				     int invert,
 				     int recursive) {
+	++filter_generation;
 	if (!pattern) {
 		if (regex) {
 			regfree(regex);
@@ -2394,8 +4918,24 @@ static int do_ignore_events_by_regex(char const* pattern,
 	recursive_watch = recursive;
 
 	int ret = regcomp(regex, pattern, flags | REG_NOSUB);
-	if (0 == ret)
+	if (0 == ret) {
+		size_t len = strlen(pattern);
+		// A match ending in '/' lies within the directory part of a
+		// path, since file names cannot contain '/'
+		regex_dir_scoped = len && pattern[len - 1] == '/' &&
+				   !strchr(pattern, '|');
+		// Without operators looking past the end of the match, a match
+		// in the directory part is a match for any file in it
+		regex_dir_safe = regex_dir_scoped;
+		if (!regex_dir_safe) {
+			const char* p = pattern;
+			while ((p = strchr(p, '\\')) && p[1] &&
+			       !strchr("bB<>'`", p[1]))
+				p += 2;
+			regex_dir_safe = !p || !p[1];
+		}
 		return 1;
+	}
 
 	regfree(regex);
 	free(regex);
@@ -2434,27 +4974,130 @@ int inotifytools_ignore_events_by_inverted_regex(char const* pattern, int flags,
 	return do_ignore_events_by_regex(pattern, flags, 1, recursive);
 }
 
+/**
+ * Ignore inotify events on files matching a glob pattern.
+ *
+ * @a pattern uses gitignore(5) syntax: `*' and `?' match within a single
+ * path component, `**' matches any number of directories, a trailing `/'
+ * matches directories only and a leading `!' re-includes files excluded by
+ * an earlier pattern.  A pattern without a `/' is matched against each
+ * component of the path, otherwise against the whole path.  @a flags may be
+ * 0 or FNM_CASEFOLD.
+ *
+ * Unlike inotifytools_ignore_events_by_regex(), patterns accumulate; pass
+ * NULL to remove all glob patterns.  Patterns are matched against the watched
+ * path and event name without formatting them, and directories they exclude
+ * are not watched by inotifytools_watch_recursively().
+ *
+ * @return 1 on success, 0 if the pattern is invalid.
+ */
+int inotifytools_ignore_events_by_glob(char const* pattern,
+				       int flags,
+				       int recursive) {
+	++filter_generation;
+	if (!pattern) {
+		glob_filter_clear();
+		return 1;
+	}
+	recursive_watch = recursive;
+	if (!glob_filter_add(pattern, flags, 0)) {
+		error = errno;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Ignore inotify events on files NOT matching any of a set of glob patterns.
+ *
+ * @a pattern uses the same syntax as inotifytools_ignore_events_by_glob(),
+ * without negation.  Events are ignored unless the path matches at least one
+ * pattern given to this function.
+ *
+ * @return 1 on success, 0 if the pattern is invalid.
+ */
+int inotifytools_ignore_events_by_inverted_glob(char const* pattern,
+						int flags,
+						int recursive) {
+	++filter_generation;
+	if (!pattern) {
+		glob_filter_clear();
+		return 1;
+	}
+	recursive_watch = recursive;
+	if (!glob_filter_add(pattern, flags, 1)) {
+		error = errno;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Ignore inotify events on files matching the patterns in a gitignore(5)
+ * style file.
+ *
+ * Each line of @a filename is added as if passed to
+ * inotifytools_ignore_events_by_glob(), except that blank lines and lines
+ * starting with `#' are skipped and patterns containing a `/' are relative
+ * to the directory containing @a filename.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_ignore_events_from_file(char const* filename, int recursive) {
+	++filter_generation;
+	recursive_watch = recursive;
+	if (!glob_filter_add_file(filename)) {
+		error = errno;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Order of watches by the count of one event, ties broken by watch
+ * descriptor.
+ *
+ * @a sort_event is an event to sort by ascending count, its negation to sort
+ * by descending count, 0 for the ascending total or -1 for the descending
+ * total.
+ */
+struct stat_order {
+	int index;
+	bool asc;
+
+	explicit stat_order(long sort_event) {
+		asc = sort_event >= 0;
+		if (sort_event == -1)
+			sort_event = 0;
+		else if (sort_event < 0)
+			sort_event = -sort_event;
+		if (sort_event && !(sort_event & (sort_event - 1)) &&
+		    (sort_event & STAT_EVENTS))
+			index = stat_index(sort_event);
+		else
+			index = STAT_TOTAL;
+	}
+
+	bool operator()(watch const* w1, watch const* w2) const {
+		uint64_t i1 = w1->hit[index];
+		uint64_t i2 = w2->hit[index];
+		if (i1 != i2)
+			return asc ? i1 < i2 : i1 > i2;
+		return w1->wd < w2->wd;
+	}
+};
+
 int event_compare(const char* p1, const char* p2, const void* config) {
 	if (!p1 || !p2)
 		return p1 - p2;
-	char asc = 1;
-	long sort_event = (long)config;
-	if (sort_event == -1) {
-		sort_event = 0;
-		asc = 0;
-	} else if (sort_event < 0) {
-		sort_event = -sort_event;
-		asc = 0;
-	}
-	unsigned int* i1 = stat_ptr((watch*)p1, sort_event);
-	unsigned int* i2 = stat_ptr((watch*)p2, sort_event);
-	if (0 == *i1 - *i2) {
-		return ((watch*)p1)->wd - ((watch*)p2)->wd;
-	}
-	if (asc)
-		return *i1 - *i2;
-	else
-		return *i2 - *i1;
+	stat_order less((long)config);
+	watch const* w1 = (watch const*)p1;
+	watch const* w2 = (watch const*)p2;
+	if (less(w1, w2))
+		return -1;
+	return less(w2, w1);
 }
 
 struct rbtree* inotifytools_wd_sorted_by_event(int sort_event) {
@@ -2471,3 +5114,284 @@ struct rbtree* inotifytools_wd_sorted_by_event(int sort_event) {
 	rbcloselist(all);
 	return ret;
 }
+
+/**
+ * Roll statistics up to the directories @a depth levels below the watched
+ * directories.
+ *
+ * Events on a directory deeper than @a depth below the outermost watched
+ * directory containing it are counted for its ancestor at @a depth instead,
+ * so that a recursive watch on a large tree can be summarized by, e.g., the
+ * projects at its top level.  The ancestor of each watch is found once and
+ * remembered, so rolling up costs nothing extra per event.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.  Statistics for the rolled up directories are not available by
+ * watch descriptor; inotifywatch lists them with
+ * inotifytools_watches_sorted_by_event().
+ *
+ * @param depth number of directory levels below the watched directories to
+ *              keep, or -1 to not roll statistics up.  Any statistics rolled
+ *              up so far are discarded.
+ */
+void inotifytools_set_aggregate_depth(int depth) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	rbwalk(tree_aggregate, cleanup_tree, 0);
+	rbdestroy(tree_aggregate);
+	tree_aggregate = rbinit(filename_compare, 0);
+	aggregate_depth = depth < 0 ? -1 : depth;
+	++aggregate_generation;
+	++watch_generation;
+}
+
+/**
+ * Limit the number of paths statistics are kept for in fanotify
+ * filesystem mode.
+ *
+ * When watching a filesystem, a watch is created for each file or directory
+ * events are reported for, to keep its name and statistics.  With a limit,
+ * once it is reached, watches without recent events are dropped to make
+ * room for new ones.  The statistics of dropped watches are kept together in a watch
+ * named "(other)", which inotifytools_watches_sorted_by_event() includes.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param limit maximum number of watches, or 0 for no limit.  If more
+ *              watches than that were created, some are dropped.  With no
+ *              limit, the watches there are stay.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_set_fid_watch_limit(int limit) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	if (limit < 0) {
+		error = EINVAL;
+		return 0;
+	}
+	while (num_fid_watches > limit && limit) {
+		watch* w = fid_watches[--num_fid_watches];
+		evict_fid_watch(w);
+	}
+	if (!limit) {
+		for (int i = 0; i < num_fid_watches; ++i)
+			fid_watches[i]->fid_slot = 0;
+		num_fid_watches = 0;
+	}
+	watch** ring = 0;
+	if (limit) {
+		ring = (watch**)realloc(fid_watches, limit * sizeof(watch*));
+		if (!ring) {
+			error = ENOMEM;
+			return 0;
+		}
+	} else {
+		free(fid_watches);
+	}
+	fid_watches = ring;
+	fid_watch_limit = limit;
+	fid_clock_hand = 0;
+	return 1;
+}
+
+/**
+ * @internal
+ * Get the directory to count events on @a w against: @a w itself, or its
+ * ancestor aggregate_depth levels below the outermost watched directory
+ * containing it.
+ *
+ * The outermost directory is found through the parents of the watches, and
+ * the ancestor is looked up by the name of its own watch where it has one.
+ */
+watch* aggregate_of(watch* w) {
+	if (aggregate_depth < 0)
+		return w;
+	if (w->aggregate_generation == aggregate_generation)
+		return w->aggregate ?: w;
+
+	// Evicted watches are no longer updated as their parents go away
+	if (w->evicted)
+		link_parent(w);
+	watch* root = w;
+	while (root->parent && watch_contains(root->parent, root))
+		root = root->parent;
+
+	char const* name = w->filename;
+	size_t len = strlen(name);
+	size_t end = strlen(root->filename);
+	if (end < len && name[end] == '/')
+		++end;
+	for (int depth = 0; depth < aggregate_depth && end < len; ++depth) {
+		char const* slash = strchr(name + end, '/');
+		end = slash ? slash - name + 1 : len;
+	}
+
+	// The ancestor's own watch, if it has one, knows its aggregate or
+	// saves copying its name for the lookup
+	watch* at = w;
+	while (at != root && strlen(at->filename) > end)
+		at = at->parent;
+	int named = strlen(at->filename) == end;
+	if (named && at != w &&
+	    at->aggregate_generation == aggregate_generation) {
+		w->aggregate = at->aggregate;
+		w->aggregate_generation = aggregate_generation;
+		return w->aggregate ?: w;
+	}
+
+	watch key;
+	key.filename = named ? at->filename : strndup(name, end);
+	watch* a = key.filename ? (watch*)rbfind(&key, tree_aggregate) : 0;
+	if (!a && named)
+		key.filename = strdup(key.filename);
+	if (a) {
+		if (!named)
+			free(key.filename);
+	} else if (key.filename) {
+		a = (watch*)calloc(1, sizeof(watch));
+		if (a) {
+			a->filename = key.filename;
+			rbsearch(a, tree_aggregate);
+			++watch_generation;
+		} else {
+			free(key.filename);
+		}
+	}
+	w->aggregate = a;
+	w->aggregate_generation = aggregate_generation;
+	return a ?: w;
+}
+
+/**
+ * @internal
+ * Track the @a k watches with the most occurrences of @a event, so that
+ * inotifytools_top_watches() costs O(k) rather than O(watches).
+ *
+ * inotifytools_initialize_stats() must be called for events to be counted.
+ * Counting starts afresh with each call.
+ *
+ * @param k number of watches to track, or 0 to stop tracking.
+ *
+ * @param event a single inotify event to count, or 0 for all events.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_track_top_watches(int k, int event) {
+	if (!track_top_watches(k, event)) {
+		error = errno;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Count the files with the most occurrences of @a event, within a fixed
+ * amount of memory, for inotifytools_top_files().
+ *
+ * Events are counted by the watch they occurred on and their name, so
+ * that the busiest files inside watched directories can be found without
+ * keeping a counter for every file.
+ *
+ * inotifytools_initialize_stats() must be called for events to be counted.
+ * Counting starts afresh with each call.
+ *
+ * @param counters number of files to keep counters for, or 0 to stop
+ *                 counting.  Each takes about 300 bytes.  The more there
+ *                 are, the smaller the error of the counts.
+ *
+ * @param event a single inotify event to count, or 0 for all events.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_track_top_files(int counters, int event) {
+	if (!track_top_files(counters, event)) {
+		error = errno;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * Add a watch to sorted_watches, growing it as needed.
+ */
+static int append_sorted_watch(watch* w) {
+	if (num_sorted_watches == sorted_watches_size) {
+		int size = sorted_watches_size * 2 ?: 64;
+		watch** p =
+		    (watch**)realloc(sorted_watches, size * sizeof(watch*));
+		if (!p) {
+			num_sorted_watches = 0;
+			error = ENOMEM;
+			return 0;
+		}
+		sorted_watches = p;
+		sorted_watches_size = size;
+	}
+	sorted_watches[num_sorted_watches++] = w;
+	return 1;
+}
+
+/**
+ * @internal
+ * Get the first @a k watches in the order of inotifytools_wd_sorted_by_event().
+ *
+ * Only the first @a k watches are sorted, which is cheaper than sorting all
+ * of them when only the top few are shown.
+ *
+ * @param k number of watches wanted, or 0 for all of them.
+ *
+ * @param count set to the number of watches returned, which is fewer than
+ *              @a k if fewer watches exist.
+ *
+ * @return array of watches, owned by the library and valid until the next
+ *         call or until watches are added or removed.  NULL with @a count 0
+ *         if there are no watches or memory couldn't be allocated.
+ *
+ * @note When statistics are rolled up with inotifytools_set_aggregate_depth(),
+ *       the directories they are rolled up to are returned instead.
+ *       Otherwise, once watches were dropped because of
+ *       inotifytools_set_fid_watch_limit(), their "(other)" watch is included.
+ */
+watch** inotifytools_watches_sorted_by_event(int sort_event,
+					     int k,
+					     int* count) {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+	*count = 0;
+	// The watches only need collecting again when some were added or
+	// removed since the last call.
+	if (sorted_watches_generation != watch_generation) {
+		num_sorted_watches = 0;
+		RBLIST* all = rbopenlist(aggregate_depth < 0 ? tree_wd
+							     : tree_aggregate);
+		watch* w;
+		while ((w = (watch*)rbreadlist(all))) {
+			if (!append_sorted_watch(w)) {
+				rbcloselist(all);
+				return 0;
+			}
+		}
+		rbcloselist(all);
+		if (evicted_stats && aggregate_depth < 0 &&
+		    !append_sorted_watch(evicted_stats))
+			return 0;
+		sorted_watches_generation = watch_generation;
+	}
+	if (!num_sorted_watches)
+		return 0;
+
+	if (k <= 0 || k > num_sorted_watches)
+		k = num_sorted_watches;
+	stat_order less(sort_event);
+	watch** end = sorted_watches + num_sorted_watches;
+	if (k < num_sorted_watches)
+		std::nth_element(sorted_watches, sorted_watches + k - 1, end,
+				 less);
+	std::sort(sorted_watches, sorted_watches + k, less);
+	*count = k;
+	return sorted_watches;
+}
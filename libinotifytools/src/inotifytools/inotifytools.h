@@ -6,7 +6,9 @@ extern "C"
 {
 #endif
 
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #define MAX_STRLEN 4096
 
@@ -22,6 +24,54 @@ struct nstring {
 	unsigned int len;
 };
 
+/** @struct inotifytools_perf_counters
+ *  @brief Work done handling events, from inotifytools_get_perf_counters().
+ *  The times are in nanoseconds, and only kept while
+ *  inotifytools_set_perf_timers() is on.
+ */
+struct inotifytools_perf_counters {
+	/** CLOCK_MONOTONIC time counting started */
+	struct timespec since;
+	/** Reads from the inotify or fanotify descriptor, and bytes read */
+	uint64_t reads;
+	uint64_t bytes_read;
+	/** Events read, and events dropped by a filter */
+	uint64_t events_read;
+	uint64_t events_rejected;
+	/** System calls made to resolve fanotify file handles to paths */
+	uint64_t fid_syscalls;
+	/** Events formatted by inotifytools_fprintf(), and bytes written */
+	uint64_t events_formatted;
+	uint64_t bytes_written;
+	/** Time waiting for events, reading them and filtering them */
+	uint64_t wait_ns;
+	uint64_t read_ns;
+	uint64_t filter_ns;
+	/** Time resolving fanotify file handles, including while formatting */
+	uint64_t resolve_ns;
+	/** Time formatting and writing events in inotifytools_fprintf() */
+	uint64_t format_ns;
+	uint64_t output_ns;
+};
+
+/** @struct inotifytools_watch_plan
+ *  @brief How inotifytools_watch_recursively_within_budget() shared out the
+ *  watches available among the directories of a tree.
+ */
+struct inotifytools_watch_plan {
+	/** Watches available for the tree */
+	int budget;
+	/** Directories found in the tree, and how many of them are watched */
+	int dirs;
+	int watched;
+	/** Watched directories which watch their subdirectories once an event
+	 *  occurs in them, because some aren't watched yet */
+	int lazy;
+	/** Whether the user's limit on watches left some directories
+	 *  unwatched, as opposed to the @a max_watches given */
+	int limit_reached;
+};
+
 int inotifytools_str_to_event(char const * event);
 int inotifytools_str_to_event_sep(char const * event, char sep);
 char * inotifytools_event_to_str(int events);
@@ -50,17 +100,78 @@ int inotifytools_watch_recursively(char const* path, int events);
 int inotifytools_watch_recursively_with_exclude(char const* path,
 						int events,
 						char const** exclude_list);
+int inotifytools_save_snapshot(char const* filename);
+int inotifytools_load_snapshot(char const* filename,
+			       int events,
+			       char const** exclude_list);
 // [UH]
 int inotifytools_ignore_events_by_regex( char const *pattern, int flags, int recursive );
 int inotifytools_ignore_events_by_inverted_regex( char const *pattern, int flags, int recursive );
+int inotifytools_ignore_events_by_glob(char const* pattern,
+				       int flags,
+				       int recursive);
+int inotifytools_ignore_events_by_inverted_glob(char const* pattern,
+						int flags,
+						int recursive);
+int inotifytools_ignore_events_from_file(char const* filename, int recursive);
+void inotifytools_set_watch_pruning(int enable);
+int inotifytools_set_lazy_watching(int depth, int max_watches);
+int inotifytools_watch_recursively_within_budget(
+    char const* path,
+    int events,
+    char const** exclude_list,
+    int max_watches,
+    struct inotifytools_watch_plan* plan);
+int inotifytools_set_polling(long interval_ms, int max_stats);
+int inotifytools_poll_recursively(char const* path,
+				  int events,
+				  char const** exclude_list);
 struct inotify_event * inotifytools_next_event( long int timeout );
 struct inotify_event * inotifytools_next_events( long int timeout, int num_events );
+struct inotify_event* inotifytools_next_event_ms(long int timeout_ms);
+typedef int (*inotifytools_filter_fn)(struct inotify_event* event,
+				      struct watch* w,
+				      void* userdata);
+typedef void (*inotifytools_handler_fn)(struct inotify_event* event,
+					struct watch* w,
+					void* userdata);
+int inotifytools_add_filter(inotifytools_filter_fn fn, void* userdata);
+void inotifytools_set_handler(inotifytools_handler_fn fn, void* userdata);
+int inotifytools_set_coalescing(long window_ms);
+int inotifytools_process_events(long int timeout);
+int inotifytools_get_num_filter_stages();
+char const* inotifytools_get_filter_stage_name(int stage);
+unsigned long inotifytools_get_filter_stage_dropped(int stage);
 int inotifytools_error();
 int inotifytools_get_stat_by_wd( int wd, int event );
 int inotifytools_get_stat_total( int event );
 int inotifytools_get_stat_by_filename( char const * filename,
                                                 int event );
+int64_t inotifytools_get_stat_by_wd64(int wd, int event);
+int64_t inotifytools_get_stat_total64(int event);
+int64_t inotifytools_get_stat_by_filename64(char const* filename, int event);
 void inotifytools_initialize_stats();
+void inotifytools_initialize_rates();
+double inotifytools_get_rate_by_wd(int wd, int window);
+double inotifytools_get_rate_total(int window);
+double inotifytools_get_rate_ewma_by_wd(int wd, int minutes);
+double inotifytools_get_rate_ewma_total(int minutes);
+struct inotifytools_queue;
+struct inotifytools_queue* inotifytools_queue_new(int capacity, int consumers);
+void inotifytools_queue_free(struct inotifytools_queue* queue);
+int inotifytools_queue_fill(struct inotifytools_queue* queue,
+			    long int timeout_ms);
+void inotifytools_queue_close(struct inotifytools_queue* queue);
+int inotifytools_queue_finished(struct inotifytools_queue* queue);
+struct inotify_event* inotifytools_queue_pop(struct inotifytools_queue* queue,
+					     int consumer);
+int inotifytools_queue_get_event_time(struct inotifytools_queue* queue,
+				      int consumer,
+				      struct timespec* realtime,
+				      struct timespec* monotonic);
+int64_t inotifytools_queue_get_stat(struct inotifytools_queue* queue,
+				    int consumer,
+				    int event);
 int inotifytools_initialize();
 int inotifytools_init(int fanotify, int watch_filesystem, int verbose);
 void inotifytools_cleanup();
@@ -79,6 +190,12 @@ int inotifytools_snprintf(struct nstring* out,
 			  const char* fmt);
 void inotifytools_set_printf_timefmt(const char* fmt);
 void inotifytools_clear_timefmt();
+int inotifytools_get_event_time(struct timespec* realtime,
+				struct timespec* monotonic);
+void inotifytools_get_perf_counters(
+    struct inotifytools_perf_counters* counters);
+void inotifytools_reset_perf_counters();
+void inotifytools_set_perf_timers(int enable);
 
 int inotifytools_get_max_user_watches();
 int inotifytools_get_max_user_instances();
@@ -3,6 +3,10 @@
 
 #include "redblack.h"
 
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
 /**
  * @internal
  * Assert that a condition evaluates to true, and optionally output a message
@@ -48,31 +52,113 @@ long _niceassert(long cond,
 		 char const* mesg);
 
 struct rbtree *inotifytools_wd_sorted_by_event(int sort_event);
+struct watch** inotifytools_watches_sorted_by_event(int sort_event,
+						   int k,
+						   int* count);
+int inotifytools_track_top_watches(int k, int event);
+struct watch** inotifytools_top_watches(int* count);
+void inotifytools_next_top_interval();
+void inotifytools_set_aggregate_depth(int depth);
+int inotifytools_set_fid_watch_limit(int limit);
+int inotifytools_track_top_files(int counters, int event);
+struct file_hits** inotifytools_top_files(int* count);
+const char* inotifytools_file_hits_dir(struct file_hits const* f);
+size_t inotifytools_watch_index_bytes();
+int64_t inotifytools_get_stat_by_watch64(struct watch* w, int event);
+double inotifytools_get_rate_by_watch(struct watch* w, int window);
+double inotifytools_get_rate_ewma_by_watch(struct watch* w, int minutes);
 extern int initialized;
 
 struct fanotify_event_fid;
+struct rates;
+
+/**
+ * @internal
+ * When an event was read from the kernel.  Events read together share it.
+ */
+struct event_time {
+	struct timespec realtime;
+	struct timespec monotonic;
+};
 
 #define MAX_FID_LEN 20
 
+/**
+ * @internal
+ * A file counted by inotifytools_track_top_files(): the name of an event
+ * relative to the watch it occurred on, or "" for the watch itself.
+ */
+struct file_hits {
+	// Events counted for the file.  Up to error of them may belong to
+	// files it replaced in the summary.
+	uint64_t count;
+	uint64_t error;
+	// Hash of wd and name
+	uint64_t key;
+	// Positions in the hash table and the heap
+	unsigned slot;
+	int pos;
+	unsigned long wd;
+	char name[NAME_MAX + 1];
+};
+
+/**
+ * @internal
+ * Index of the counter for a single event in watch::hit, which is the
+ * event's bit position.  The total over all events is kept at STAT_TOTAL.
+ */
+#define stat_index(event) __builtin_ctz(event)
+#define STAT_TOTAL 14
+#define STAT_SLOTS 15
+
 typedef struct watch {
 	struct fanotify_event_fid* fid;
 	char *filename;
 	unsigned long wd;
 	int dirf;
-	unsigned hit_access;
-	unsigned hit_modify;
-	unsigned hit_attrib;
-	unsigned hit_close_write;
-	unsigned hit_close_nowrite;
-	unsigned hit_open;
-	unsigned hit_moved_from;
-	unsigned hit_moved_to;
-	unsigned hit_create;
-	unsigned hit_delete;
-	unsigned hit_delete_self;
-	unsigned hit_unmount;
-	unsigned hit_move_self;
-	unsigned hit_total;
+	// Cached filter verdicts for events in this watch, valid while
+	// filter_generation matches the library's
+	unsigned filter_generation;
+	char regex_verdict;
+	char glob_verdict;
+	uint64_t hit[STAT_SLOTS];
+	// Count of the tracked event in the current top watches interval,
+	// valid while top_interval matches the library's
+	uint64_t interval_hits;
+	unsigned top_interval;
+	// 1-based position in the top watches heap, or 0 if not in it
+	int top_pos;
+	// Recent event rates, allocated on the first event once rates are
+	// being collected
+	struct rates* rates;
+	// Closest watched directory containing the watch, or NULL for the
+	// roots of the watched trees
+	struct watch* parent;
+	// Directory statistics are rolled up to, valid while
+	// aggregate_generation matches the library's
+	struct watch* aggregate;
+	unsigned aggregate_generation;
+	// Position in the ring of watches created for fanotify fids, which
+	// is limited by inotifytools_set_fid_watch_limit(), or 0
+	int fid_slot;
+	// Whether an event occurred since the ring's clock hand last passed
+	int referenced;
+	// Events to watch the subdirectories of a lazily watched directory
+	// for, and whether some of them are yet to be watched
+	int lazy_events;
+	char unexpanded;
+	// Whether the watch was removed to make room for lazy watches, and is
+	// only kept for the events queued before IN_IGNORED
+	char evicted;
+	// Position in the ring of watches added on activity in lazily watched
+	// trees, which is limited by inotifytools_set_lazy_watching(), or 0
+	int lazy_slot;
 } watch;
 extern struct rbtree *tree_wd;
+extern struct rbtree *tree_aggregate;
+watch* create_watch(int wd,
+		    struct fanotify_event_fid* fid,
+		    const char* filename,
+		    int dirf);
+watch* watch_from_wd(unsigned long wd);
 #endif
@@ -0,0 +1,357 @@
+#include "inotifytools/inotify.h"
+#include "inotifytools/inotifytools.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+// End-to-end latency of events, from the file operation to the event being
+// returned by the library or printed by inotifywait.  Not run by
+// `make check'; build with `make latency' and run as e.g. `./latency -j'.
+//
+// Each operation creates a file, writes to it, closes and removes it, at a
+// fixed rate or as fast as possible, in a directory on tmpfs so that the
+// disk does not add to the latency.  Every system call is timestamped, and
+// its event matched back to it by the file name and event.
+
+#define EVENTS (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE)
+#define STEPS 3
+
+// Give up on the rest of the events once none has come for this long
+#define IDLE_TIMEOUT_MS 1000
+
+extern char** environ;
+
+static bool json = false;
+
+static int64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Times each step of each operation began.  The writer stores them before
+// the system call, and the kernel orders that before the event is read.
+static std::atomic<int64_t>* stamps;
+
+static void write_files(char const* dir, long ops, long rate) {
+	char name[PATH_MAX];
+	int64_t start = now_ns();
+	for (long i = 0; i < ops; ++i) {
+		if (rate) {
+			int64_t due = start + i * 1000000000LL / rate;
+			struct timespec ts = {(time_t)(due / 1000000000LL),
+					      (long)(due % 1000000000LL)};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR)
+				;
+		}
+		snprintf(name, sizeof(name), "%s/%ld", dir, i);
+		stamps[STEPS * i].store(now_ns(), std::memory_order_relaxed);
+		int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd == -1) {
+			fprintf(stderr, "Couldn't create %s: %s\n", name,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		stamps[STEPS * i + 1].store(now_ns(),
+					    std::memory_order_relaxed);
+		if (write(fd, "x", 1) != 1) {
+			fprintf(stderr, "Couldn't write %s: %s\n", name,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		stamps[STEPS * i + 2].store(now_ns(),
+					    std::memory_order_relaxed);
+		close(fd);
+		unlink(name);
+	}
+}
+
+// Index of the stamp for the event on file @a name, or -1.
+static long stamp_index(char const* name, uint32_t mask, long ops) {
+	char* end;
+	long i = strtol(name, &end, 10);
+	if (end == name || *end || i < 0 || i >= ops)
+		return -1;
+	if (mask & IN_CREATE)
+		return STEPS * i;
+	if (mask & IN_MODIFY)
+		return STEPS * i + 1;
+	if (mask & IN_CLOSE_WRITE)
+		return STEPS * i + 2;
+	return -1;
+}
+
+struct result {
+	long events;
+	long lost;
+	int64_t first;
+	int64_t last;
+	int64_t* latency;
+};
+
+static void report(char const* source, long rate, long ops, result* r) {
+	std::sort(r->latency, r->latency + r->events);
+	int64_t p[4] = {0, 0, 0, 0};
+	if (r->events) {
+		p[0] = r->latency[r->events / 2];
+		p[1] = r->latency[r->events * 99 / 100];
+		p[2] = r->latency[r->events * 999 / 1000];
+		p[3] = r->latency[r->events - 1];
+	}
+	double secs = (r->last - r->first) / 1e9;
+	double throughput = secs > 0 ? r->events / secs : 0;
+
+	if (json) {
+		printf("{\"source\":\"%s\",\"rate\":%ld,\"ops\":%ld,"
+		       "\"events\":%ld,\"lost\":%ld,\"p50_us\":%.1f,"
+		       "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+		       "\"events_per_sec\":%.0f}\n",
+		       source, rate, ops, r->events, r->lost, p[0] / 1e3,
+		       p[1] / 1e3, p[2] / 1e3, p[3] / 1e3, throughput);
+	} else {
+		char rate_str[32];
+		if (rate)
+			snprintf(rate_str, sizeof(rate_str), "%ld/s", rate);
+		else
+			snprintf(rate_str, sizeof(rate_str), "max");
+		printf("%-12s %10s %9ld %9ld %9.1f %9.1f %9.1f %9.1f %12.0f\n",
+		       source, rate_str, r->events, r->lost, p[0] / 1e3,
+		       p[1] / 1e3, p[2] / 1e3, p[3] / 1e3, throughput);
+	}
+	fflush(stdout);
+}
+
+// Read the events back through the library.
+static void run_library(char const* dir, long ops, long rate, result* r) {
+	// Directories are watched by their name with a trailing slash, which
+	// is also the name the watch has to be removed by
+	char watched[PATH_MAX + 1];
+	strcat(strcpy(watched, dir), "/");
+	if (!inotifytools_watch_file(watched, EVENTS)) {
+		fprintf(stderr, "Couldn't watch %s: %s\n", dir,
+			strerror(inotifytools_error()));
+		exit(EXIT_FAILURE);
+	}
+
+	std::thread writer(write_files, dir, ops, rate);
+	r->first = now_ns();
+	struct inotify_event* event;
+	while (r->events < STEPS * ops &&
+	       (event = inotifytools_next_event_ms(IDLE_TIMEOUT_MS))) {
+		int64_t t = now_ns();
+		if (event->mask & IN_Q_OVERFLOW)
+			continue;
+		long i = event->len ? stamp_index(event->name, event->mask, ops)
+				    : -1;
+		if (i < 0)
+			continue;
+		r->latency[r->events++] =
+		    t - stamps[i].load(std::memory_order_relaxed);
+		r->last = t;
+	}
+	writer.join();
+	r->lost = STEPS * ops - r->events;
+	inotifytools_remove_watch_by_filename(watched);
+}
+
+// Read the events back from the output of inotifywait.
+static void run_inotifywait(char const* binary,
+			    char const* dir,
+			    long ops,
+			    long rate,
+			    result* r) {
+	int out[2], err[2];
+	if (pipe(out) || pipe(err)) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+	posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+	posix_spawn_file_actions_addclose(&actions, out[0]);
+	posix_spawn_file_actions_addclose(&actions, err[0]);
+	char const* argv[] = {binary, "--monitor",	    "--format",
+			      "%e %f",	"--event",	    "create",
+			      "--event", "modify",	    "--event",
+			      "close_write", dir,		    NULL};
+	pid_t pid;
+	int rc = posix_spawn(&pid, binary, &actions, NULL, (char**)argv,
+			     environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(out[1]);
+	close(err[1]);
+	if (rc) {
+		fprintf(stderr, "Couldn't run %s: %s\n", binary, strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+
+	// Wait for the watches before writing
+	char line[PATH_MAX + 64];
+	FILE* errors = fdopen(err[0], "r");
+	while (fgets(line, sizeof(line), errors) &&
+	       strcmp(line, "Watches established.\n"))
+		;
+
+	std::thread writer(write_files, dir, ops, rate);
+	r->first = now_ns();
+	// Lines are split by hand rather than with stdio, so that every line
+	// is stamped as soon as the read() which returned it
+	char buf[PIPE_BUF * 4];
+	size_t used = 0;
+	struct pollfd pfd = {out[0], POLLIN, 0};
+	while (r->events < STEPS * ops && poll(&pfd, 1, IDLE_TIMEOUT_MS) > 0) {
+		ssize_t len = read(out[0], buf + used, sizeof(buf) - used);
+		if (len <= 0)
+			break;
+		int64_t t = now_ns();
+		used += len;
+		char* start = buf;
+		char* end;
+		while ((end = (char*)memchr(start, '\n',
+					    buf + used - start))) {
+			*end = '\0';
+			char* name = strchr(start, ' ');
+			if (name) {
+				*name++ = '\0';
+				long i = stamp_index(
+				    name, inotifytools_str_to_event(start),
+				    ops);
+				if (i >= 0) {
+					r->latency[r->events++] =
+					    t - stamps[i].load(
+						    std::memory_order_relaxed);
+					r->last = t;
+				}
+			}
+			start = end + 1;
+		}
+		used = buf + used - start;
+		memmove(buf, start, used);
+		// A line too long for the buffer isn't one of ours
+		if (used == sizeof(buf))
+			used = 0;
+	}
+	writer.join();
+	r->lost = STEPS * ops - r->events;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	close(out[0]);
+	fclose(errors);
+}
+
+static void usage(char const* name) {
+	fprintf(stderr,
+		"Usage: %s [-j] [-n ops] [-r rate[,rate...]] [-d dir] "
+		"[-b inotifywait]\n"
+		"  -j  print one JSON object per line\n"
+		"  -n  operations per run (default 20000)\n"
+		"  -r  operations per second, 0 for as fast as possible\n"
+		"      (default 1000,10000,0)\n"
+		"  -d  directory to create files in (default /dev/shm)\n"
+		"  -b  inotifywait binary to measure too, or - for none\n"
+		"      (default ../../src/inotifywait)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+	long ops = 20000;
+	char const* rates = "1000,10000,0";
+	char const* parent = "/dev/shm";
+	char const* binary = "../../src/inotifywait";
+	int opt;
+	while ((opt = getopt(argc, argv, "jn:r:d:b:")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = true;
+				break;
+			case 'n':
+				ops = atol(optarg);
+				if (ops <= 0)
+					usage(argv[0]);
+				break;
+			case 'r':
+				rates = optarg;
+				break;
+			case 'd':
+				parent = optarg;
+				break;
+			case 'b':
+				binary = strcmp(optarg, "-") ? optarg : NULL;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s/inotifytools-latency.XXXXXX", parent);
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Couldn't create a directory in %s: %s\n",
+			parent, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (!inotifytools_initialize()) {
+		fprintf(stderr, "Couldn't initialize inotify: %s\n",
+			strerror(inotifytools_error()));
+		return EXIT_FAILURE;
+	}
+
+	stamps = new std::atomic<int64_t>[STEPS * ops];
+	result r;
+	r.latency = (int64_t*)malloc(STEPS * ops * sizeof(int64_t));
+	if (!stamps || !r.latency) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if (!json)
+		printf("%-12s %10s %9s %9s %9s %9s %9s %9s %12s\n", "source",
+		       "rate", "events", "lost", "p50_us", "p99_us",
+		       "p999_us", "max_us", "events/s");
+
+	for (char const* p = rates; *p;) {
+		char* end;
+		long rate = strtol(p, &end, 10);
+		if (end == p || rate < 0 || (*end && *end != ','))
+			usage(argv[0]);
+		p = *end ? end + 1 : end;
+
+		memset(&r, 0, offsetof(result, latency));
+		run_library(dir, ops, rate, &r);
+		report("library", rate, ops, &r);
+		if (binary) {
+			memset(&r, 0, offsetof(result, latency));
+			run_inotifywait(binary, dir, ops, rate, &r);
+			report("inotifywait", rate, ops, &r);
+		}
+	}
+
+	rmdir(dir);
+	delete[] stamps;
+	free(r.latency);
+	return EXIT_SUCCESS;
+}
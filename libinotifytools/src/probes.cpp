@@ -0,0 +1,17 @@
+#include "../../config.h"
+#include "probes.h"
+
+#ifdef HAVE_SYS_SDT_H
+// The semaphores declared in probes.h, in the section tracers look for them
+// in
+#define DEFINE_PROBE_SEMAPHORE(name)                                 \
+	__extension__ unsigned short inotifytools_##name##_semaphore \
+	    __attribute__((section(".probes"))) = 0
+DEFINE_PROBE_SEMAPHORE(read);
+DEFINE_PROBE_SEMAPHORE(dispatch);
+DEFINE_PROBE_SEMAPHORE(filter);
+DEFINE_PROBE_SEMAPHORE(overflow);
+DEFINE_PROBE_SEMAPHORE(watch_add);
+DEFINE_PROBE_SEMAPHORE(watch_remove);
+DEFINE_PROBE_SEMAPHORE(fid_resolve);
+#endif
@@ -0,0 +1,56 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static probes for tracing the library with bpftrace, perf or SystemTap,
+// in the "inotifytools" provider.  They are nops unless traced, and are
+// compiled out entirely without <sys/sdt.h>.  Arguments which take work to
+// compute are guarded with PROBE_ENABLED(), which tracers turn on through
+// the probe's semaphore.  Their names and arguments are kept stable between
+// versions:
+//
+//   read(bytes, events)      a read() from the inotify or fanotify descriptor
+//   dispatch(wd, mask, ns)   an event is returned; ns is the CLOCK_MONOTONIC
+//                            time it was read, in nanoseconds
+//   filter(wd, mask, stage)  an event is dropped by a filter stage
+//   overflow()               the kernel's event queue overflowed
+//   watch_add(wd, path)      a watch is added
+//   watch_remove(wd, path)   a watch is removed
+//   fid_resolve(cached, path) a fanotify file handle is resolved to a path,
+//                            from a watch (1) or with system calls (0)
+
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// Every probe has a semaphore, counting the tracers attached to it, which
+// is defined in probes.cpp
+#define PROBE_SEMAPHORE(name)                                               \
+	__extension__ extern unsigned short inotifytools_##name##_semaphore \
+	    __attribute__((visibility("hidden")))
+PROBE_SEMAPHORE(read);
+PROBE_SEMAPHORE(dispatch);
+PROBE_SEMAPHORE(filter);
+PROBE_SEMAPHORE(overflow);
+PROBE_SEMAPHORE(watch_add);
+PROBE_SEMAPHORE(watch_remove);
+PROBE_SEMAPHORE(fid_resolve);
+
+#define PROBE_ENABLED(name) \
+	__builtin_expect(inotifytools_##name##_semaphore != 0, 0)
+#define PROBE0(name) DTRACE_PROBE(inotifytools, name)
+#define PROBE2(name, a, b) DTRACE_PROBE2(inotifytools, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(inotifytools, name, a, b, c)
+#else
+#define PROBE_ENABLED(name) 0
+#define PROBE0(name) \
+	do {         \
+	} while (0)
+#define PROBE2(name, a, b) \
+	do {               \
+	} while (0)
+#define PROBE3(name, a, b, c) \
+	do {                  \
+	} while (0)
+#endif
+
+#endif	// PROBES_H
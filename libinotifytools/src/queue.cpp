@@ -0,0 +1,351 @@
+#include "queue.h"
+#include "inotifytools_p.h"
+#include "stats.h"
+
+#include <atomic>
+#include <new>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+// Largest event copied into the queue: the header and a name of up to
+// NAME_MAX bytes
+#define QUEUED_EVENT_SIZE (sizeof(struct inotify_event) + NAME_MAX + 1)
+
+/**
+ * @internal
+ * A slot of the ring.  Its sequence number is the position of the event in
+ * it plus one once the event is written, and that plus the size of the ring
+ * once it is read, when it can be written again.
+ */
+struct alignas(CACHE_LINE) queue_slot {
+	std::atomic<size_t> seq;
+	struct event_time time;
+	alignas(struct inotify_event) char event[QUEUED_EVENT_SIZE];
+};
+
+/**
+ * @internal
+ * Statistics of the events taken by one consumer.  Only that consumer writes
+ * them, so they are counted without atomic read-modify-writes, and each is
+ * on its own cache lines so that consumers don't contend.
+ */
+struct alignas(CACHE_LINE) queue_shard {
+	std::atomic<uint64_t> num[STAT_SLOTS];
+	// The consumer's copy of the last event it took, and when that was read
+	struct event_time time;
+	alignas(struct inotify_event) char event[QUEUED_EVENT_SIZE];
+};
+
+/**
+ * @internal
+ * A bounded single producer, multiple consumer ring of events.  Consumers
+ * claim positions with compare and swap on dequeue_pos, and each slot's
+ * sequence number hands it between the producer and the consumers.
+ */
+struct inotifytools_queue {
+	struct queue_slot* slots;
+	size_t mask;
+	struct queue_shard* shards;
+	int num_shards;
+	alignas(CACHE_LINE) size_t enqueue_pos;
+	std::atomic<bool> closed;
+	alignas(CACHE_LINE) std::atomic<size_t> dequeue_pos;
+};
+
+/**
+ * Create a queue for passing events from one thread to others.
+ *
+ * The thread reading events calls inotifytools_queue_fill() to move them
+ * into the queue, and up to @a consumers other threads take them with
+ * inotifytools_queue_pop(), without locks.  Each consumer counts the events
+ * it takes separately, and inotifytools_queue_get_stat() adds them up.
+ *
+ * Only the thread calling inotifytools_queue_fill() may use the rest of
+ * the library; consumers only get copies of the events.
+ *
+ * @param capacity number of events the queue can hold, rounded up to a power
+ *                 of two.  Each takes about 320 bytes.
+ *
+ * @param consumers number of consumer threads, which are numbered from 0.
+ *
+ * @return the queue, or NULL if @a capacity or @a consumers is not positive
+ *         or memory couldn't be allocated.  Free it with
+ *         inotifytools_queue_free().
+ */
+struct inotifytools_queue* inotifytools_queue_new(int capacity,
+						  int consumers) {
+	if (capacity <= 0 || capacity > INT_MAX / 2 || consumers <= 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	size_t size = 1;
+	while (size < (size_t)capacity)
+		size *= 2;
+
+	void* mem = aligned_alloc(CACHE_LINE, sizeof(inotifytools_queue));
+	if (!mem) {
+		errno = ENOMEM;
+		return 0;
+	}
+	struct inotifytools_queue* queue = new (mem) inotifytools_queue();
+	queue->slots = (struct queue_slot*)aligned_alloc(
+	    CACHE_LINE, size * sizeof(struct queue_slot));
+	queue->shards = (struct queue_shard*)aligned_alloc(
+	    CACHE_LINE, consumers * sizeof(struct queue_shard));
+	if (!queue->slots || !queue->shards) {
+		free(queue->slots);
+		free(queue->shards);
+		free(queue);
+		errno = ENOMEM;
+		return 0;
+	}
+	for (size_t i = 0; i < size; ++i)
+		new (&queue->slots[i].seq) std::atomic<size_t>(i);
+	for (int i = 0; i < consumers; ++i) {
+		for (int j = 0; j < STAT_SLOTS; ++j)
+			new (&queue->shards[i].num[j]) std::atomic<uint64_t>(0);
+		memset(&queue->shards[i].time, 0,
+		       sizeof(queue->shards[i].time));
+	}
+	queue->mask = size - 1;
+	queue->num_shards = consumers;
+	queue->enqueue_pos = 0;
+	queue->closed = false;
+	queue->dequeue_pos = 0;
+	return queue;
+}
+
+/**
+ * Free a queue created with inotifytools_queue_new().  No other thread may
+ * be using it.
+ */
+void inotifytools_queue_free(struct inotifytools_queue* queue) {
+	if (!queue)
+		return;
+	free(queue->slots);
+	free(queue->shards);
+	free(queue);
+}
+
+/**
+ * @internal
+ * Whether the producer has no free slot to write to.
+ */
+int inotifytools_queue_full(struct inotifytools_queue const* queue) {
+	struct queue_slot const* slot =
+	    &queue->slots[queue->enqueue_pos & queue->mask];
+	return slot->seq.load(std::memory_order_acquire) !=
+	       queue->enqueue_pos;
+}
+
+/**
+ * @internal
+ * Copy an event into the queue, with the time it was read if @a time is not
+ * NULL.  Only the producer may call this.
+ *
+ * @return 1 on success, 0 if the queue is full.
+ */
+int inotifytools_queue_push(struct inotifytools_queue* queue,
+			    struct inotify_event const* event,
+			    struct event_time const* time) {
+	if (inotifytools_queue_full(queue))
+		return 0;
+	size_t pos = queue->enqueue_pos;
+	struct queue_slot* slot = &queue->slots[pos & queue->mask];
+	size_t len = event->len;
+	if (len > NAME_MAX + 1)
+		len = NAME_MAX + 1;
+	memcpy(slot->event, event, sizeof(*event) + len);
+	if (time)
+		slot->time = *time;
+	else
+		memset(&slot->time, 0, sizeof(slot->time));
+	struct inotify_event* copy = (struct inotify_event*)slot->event;
+	copy->len = len;
+	if (len)
+		copy->name[len - 1] = 0;
+	slot->seq.store(pos + 1, std::memory_order_release);
+	queue->enqueue_pos = pos + 1;
+	return 1;
+}
+
+/**
+ * Read events into a queue created with inotifytools_queue_new().
+ *
+ * Events are read through the same filters and statistics as
+ * inotifytools_next_event_ms(), until no more are ready or the queue is
+ * full.  Only one thread may call this function.
+ *
+ * @param queue the queue to fill.
+ *
+ * @param timeout_ms maximum amount of time, in milliseconds, to wait for the
+ *                   first event, or negative to block until one occurs.
+ *
+ * @return number of events added to the queue, 0 if none occurred before
+ *         the timeout or the queue is full, or -1 on error, which can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_queue_fill(struct inotifytools_queue* queue,
+			    long int timeout_ms) {
+	int n = 0;
+	struct event_time time;
+	// Check for room before reading, so that no event is lost
+	while (!inotifytools_queue_full(queue)) {
+		struct inotify_event* event =
+		    inotifytools_next_event_ms(n ? 0 : timeout_ms);
+		if (!event)
+			return inotifytools_error() ? -1 : n;
+		inotifytools_get_event_time(&time.realtime, &time.monotonic);
+		inotifytools_queue_push(queue, event, &time);
+		++n;
+	}
+	return n;
+}
+
+/**
+ * Mark a queue as having no more events coming, so that consumers can stop
+ * once it is empty.  Only the thread filling the queue may call this.
+ */
+void inotifytools_queue_close(struct inotifytools_queue* queue) {
+	queue->closed.store(true, std::memory_order_release);
+}
+
+/**
+ * Whether a queue was closed with inotifytools_queue_close() and all events
+ * in it have been taken.
+ */
+int inotifytools_queue_finished(struct inotifytools_queue* queue) {
+	if (!queue->closed.load(std::memory_order_acquire))
+		return 0;
+	size_t pos = queue->dequeue_pos.load(std::memory_order_relaxed);
+	return queue->slots[pos & queue->mask].seq.load(
+		   std::memory_order_acquire) != pos + 1;
+}
+
+/**
+ * Take the next event from a queue, and count it in the statistics of
+ * @a consumer.
+ *
+ * Any number of threads may call this at the same time, each with its own
+ * @a consumer.  It never blocks.
+ *
+ * @param queue the queue to take an event from.
+ *
+ * @param consumer number of the calling consumer, less than the number of
+ *                 consumers the queue was created with.
+ *
+ * @return pointer to a copy of the event, valid until @a consumer takes
+ *         another event, or NULL if the queue is empty.  Names longer than
+ *         NAME_MAX bytes are cut short.
+ */
+struct inotify_event* inotifytools_queue_pop(struct inotifytools_queue* queue,
+					     int consumer) {
+	niceassert(consumer >= 0 && consumer < queue->num_shards,
+		   "invalid consumer");
+	size_t pos = queue->dequeue_pos.load(std::memory_order_relaxed);
+	struct queue_slot* slot;
+	for (;;) {
+		slot = &queue->slots[pos & queue->mask];
+		size_t seq = slot->seq.load(std::memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (queue->dequeue_pos.compare_exchange_weak(
+				pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return 0;
+		} else {
+			pos = queue->dequeue_pos.load(
+			    std::memory_order_relaxed);
+		}
+	}
+
+	struct queue_shard* shard = &queue->shards[consumer];
+	struct inotify_event* event = (struct inotify_event*)slot->event;
+	memcpy(shard->event, event, sizeof(*event) + event->len);
+	shard->time = slot->time;
+	slot->seq.store(pos + queue->mask + 1, std::memory_order_release);
+
+	event = (struct inotify_event*)shard->event;
+	for (uint32_t mask = event->mask & STAT_EVENTS; mask;
+	     mask &= mask - 1) {
+		std::atomic<uint64_t>* n = &shard->num[stat_index(mask)];
+		n->store(n->load(std::memory_order_relaxed) + 1,
+			 std::memory_order_relaxed);
+	}
+	std::atomic<uint64_t>* n = &shard->num[STAT_TOTAL];
+	n->store(n->load(std::memory_order_relaxed) + 1,
+		 std::memory_order_relaxed);
+	return event;
+}
+
+/**
+ * Get the time the event last taken by @a consumer was read from the kernel,
+ * as inotifytools_get_event_time() gives it to the thread filling the queue.
+ *
+ * Only @a consumer may call this.  The format tokens of
+ * inotifytools_snprintf() for the time only apply to the thread filling the
+ * queue, so consumers use this to tell when their events were read.
+ *
+ * @param queue the queue the event was taken from.
+ *
+ * @param consumer number of the calling consumer.
+ *
+ * @param realtime set to the CLOCK_REALTIME time the event was read, if not
+ *                 NULL.
+ *
+ * @param monotonic set to the CLOCK_MONOTONIC time the event was read, if
+ *                  not NULL.
+ *
+ * @return 1 if @a consumer has taken an event, 0 otherwise, in which case the
+ *         times are set to 0.
+ */
+int inotifytools_queue_get_event_time(struct inotifytools_queue* queue,
+				      int consumer,
+				      struct timespec* realtime,
+				      struct timespec* monotonic) {
+	niceassert(consumer >= 0 && consumer < queue->num_shards,
+		   "invalid consumer");
+	struct event_time const* time = &queue->shards[consumer].time;
+	if (realtime)
+		*realtime = time->realtime;
+	if (monotonic)
+		*monotonic = time->monotonic;
+	return time->realtime.tv_sec || time->realtime.tv_nsec;
+}
+
+/**
+ * Get the number of events of a type taken from a queue.
+ *
+ * May be called from any thread.  While consumers are taking events, the
+ * result may be slightly out of date.
+ *
+ * @param queue the queue to get statistics for.
+ *
+ * @param consumer number of the consumer to count events for, or -1 for all
+ *                 of them.
+ *
+ * @param event a single inotify event to count, or 0 for all events.
+ *
+ * @return number of events, or -1 if @a consumer or @a event is invalid.
+ */
+int64_t inotifytools_queue_get_stat(struct inotifytools_queue* queue,
+				    int consumer,
+				    int event) {
+	if (consumer < -1 || consumer >= queue->num_shards ||
+	    (event && ((event & (event - 1)) || !(event & STAT_EVENTS))))
+		return -1;
+	int slot = event ? stat_index(event) : STAT_TOTAL;
+	int first = consumer < 0 ? 0 : consumer;
+	int last = consumer < 0 ? queue->num_shards : consumer + 1;
+	uint64_t total = 0;
+	for (int i = first; i < last; ++i)
+		total += queue->shards[i].num[slot].load(
+		    std::memory_order_relaxed);
+	return total;
+}
@@ -0,0 +1,10 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+#include "inotifytools/inotify.h"
+#include "inotifytools/inotifytools.h"
+
+int inotifytools_queue_push(struct inotifytools_queue* queue,
+			    struct inotify_event const* event,
+			    struct event_time const* time);
+int inotifytools_queue_full(struct inotifytools_queue const* queue);
+#endif	// QUEUE_H
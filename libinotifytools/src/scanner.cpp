@@ -0,0 +1,719 @@
+#include "scanner.h"
+#include "inotifytools_p.h"
+
+#include <algorithm>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/vfs.h>
+#else
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+
+// Events which need every entry of a directory stat()ed to be noticed,
+// rather than just the directory itself
+#define CONTENT_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)
+
+#define DEFAULT_INTERVAL_MS 1000
+#define DEFAULT_MAX_STATS 1000
+
+// Seconds a directory's modification time must be older than when it was
+// last read before an unchanged time can be trusted to mean unchanged
+// entries.  Timestamps are coarse on some filesystems, and those of network
+// filesystems come from the server's clock.
+#define MTIME_SLACK 2
+
+/**
+ * @internal
+ * What stat() says about a file, compared from one scan to the next to tell
+ * what happened to it.
+ */
+struct signature {
+	uint64_t ino;
+	int64_t size;
+	// Modification and status change times, in nanoseconds
+	int64_t mtime;
+	int64_t ctime;
+	// File type bits of st_mode
+	uint32_t type;
+};
+
+/**
+ * @internal
+ * An entry of a polled directory.  The names are kept one after another in
+ * a separate block, so each entry only holds the offset of its name.
+ */
+struct entry {
+	struct signature sig;
+	uint32_t name;
+};
+
+/**
+ * @internal
+ * The entries of a polled directory, sorted by name.
+ */
+struct listing {
+	struct entry* entries;
+	int num_entries;
+	char* names;
+};
+
+/**
+ * @internal
+ * A file or directory polled for changes in place of an inotify watch.
+ */
+struct target {
+	int wd;
+	uint32_t events;
+	struct signature sig;
+	// The entries of a directory, and when they were read by the
+	// CLOCK_REALTIME clock
+	struct listing list;
+	time_t listed;
+};
+
+/**
+ * @internal
+ * A synthesized event waiting to be returned.
+ */
+struct queued {
+	struct queued* next;
+	struct inotify_event event;
+};
+
+static long interval_ms = DEFAULT_INTERVAL_MS;
+static int max_stats = DEFAULT_MAX_STATS;
+// Polled files by watch descriptor, which count down from INT_MAX to stay
+// clear of those inotify hands out
+static struct rbtree* tree_targets = 0;
+static int num_targets = 0;
+static int next_wd = INT_MAX;
+// The target scanned last, and when the next slice of the scan is due
+static int cursor = 0;
+static struct timespec next_due;
+static uint32_t next_cookie = 0;
+static struct queued* first_queued = 0;
+static struct queued* last_queued = 0;
+// The event last returned, which is kept until the next call
+static struct queued* returned = 0;
+
+static int target_compare(const char* d1,
+			  const char* d2,
+			  const void* config) {
+	if (!d1 || !d2)
+		return d1 - d2;
+	int wd1 = ((struct target const*)d1)->wd;
+	int wd2 = ((struct target const*)d2)->wd;
+	return wd1 < wd2 ? -1 : wd1 > wd2;
+}
+
+static void signature_of(struct stat const* st, struct signature* sig) {
+	sig->ino = st->st_ino;
+	sig->size = st->st_size;
+	sig->mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	sig->ctime = st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+	sig->type = st->st_mode & S_IFMT;
+}
+
+static int stat_target(char const* path, int events, struct stat* st) {
+	return (events & IN_DONT_FOLLOW) ? lstat(path, st) : stat(path, st);
+}
+
+static void free_listing(struct listing* list) {
+	free(list->entries);
+	free(list->names);
+	list->entries = 0;
+	list->num_entries = 0;
+	list->names = 0;
+}
+
+/**
+ * @internal
+ * Queue an event on a polled file if it is one of @a events.  IN_IGNORED
+ * is always queued, as inotify does.
+ */
+static void queue_event(int wd,
+			uint32_t events,
+			uint32_t mask,
+			uint32_t cookie,
+			char const* name) {
+	if (!(mask & events & ~IN_ISDIR) && !(mask & IN_IGNORED))
+		return;
+	// Names are padded like inotify's, for those who step through a
+	// buffer of events by their length
+	size_t len = name ? strlen(name) : 0;
+	size_t padded = len ? (len + sizeof(struct inotify_event)) /
+				  sizeof(struct inotify_event) *
+				  sizeof(struct inotify_event)
+			    : 0;
+	struct queued* q = (struct queued*)calloc(1, sizeof(*q) + padded);
+	if (!q)
+		return;
+	q->event.wd = wd;
+	q->event.mask = mask;
+	q->event.cookie = cookie;
+	q->event.len = padded;
+	if (len)
+		memcpy(q->event.name, name, len);
+	if (last_queued)
+		last_queued->next = q;
+	else
+		first_queued = q;
+	last_queued = q;
+}
+
+static void drop_target(struct target* t) {
+	rbdelete(t, tree_targets);
+	--num_targets;
+	free_listing(&t->list);
+	free(t);
+}
+
+/**
+ * @internal
+ * Report a polled file as deleted, which ends its watch.
+ */
+static void target_gone(struct target* t) {
+	queue_event(t->wd, t->events, IN_DELETE_SELF, 0, 0);
+	queue_event(t->wd, t->events, IN_IGNORED, 0, 0);
+	drop_target(t);
+}
+
+/**
+ * @internal
+ * Read and stat() the entries of a directory, adding the number of stat()
+ * calls to @a stats.
+ *
+ * @return 1 on success, 0 and sets errno on error.
+ */
+static int read_listing(char const* path,
+			struct listing* list,
+			int* stats) {
+	DIR* dir = opendir(path);
+	if (!dir)
+		return 0;
+	int fd = dirfd(dir);
+	int size = 0;
+	size_t names_len = 0;
+	size_t names_size = 0;
+	list->entries = 0;
+	list->num_entries = 0;
+	list->names = 0;
+
+	struct dirent* ent;
+	while ((ent = readdir(dir))) {
+		char const* name = ent->d_name;
+		if (name[0] == '.' &&
+		    (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		struct stat st;
+		++*stats;
+		// Removed since the directory was read
+		if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+
+		size_t len = strlen(name) + 1;
+		if (list->num_entries == size) {
+			size = size ? 2 * size : 16;
+			struct entry* entries = (struct entry*)realloc(
+			    list->entries, size * sizeof(struct entry));
+			if (!entries)
+				goto nomem;
+			list->entries = entries;
+		}
+		if (names_len + len > names_size) {
+			names_size = std::max(2 * names_size, names_len + len);
+			char* names = (char*)realloc(list->names, names_size);
+			if (!names)
+				goto nomem;
+			list->names = names;
+		}
+		struct entry* e = &list->entries[list->num_entries++];
+		signature_of(&st, &e->sig);
+		e->name = names_len;
+		memcpy(list->names + names_len, name, len);
+		names_len += len;
+	}
+	closedir(dir);
+
+	{
+		char const* names = list->names;
+		std::sort(list->entries, list->entries + list->num_entries,
+			  [names](struct entry const& a, struct entry const& b) {
+				  return strcmp(names + a.name,
+						names + b.name) < 0;
+			  });
+	}
+	return 1;
+
+nomem:
+	closedir(dir);
+	free_listing(list);
+	errno = ENOMEM;
+	return 0;
+}
+
+static uint32_t isdir_flag(struct signature const* sig) {
+	return S_ISDIR(sig->type) ? IN_ISDIR : 0;
+}
+
+/**
+ * @internal
+ * Queue the events for an entry found in both listings of a directory.
+ */
+static void entry_changed(struct target const* t,
+			  struct signature const* old,
+			  struct signature const* sig,
+			  char const* name) {
+	if (S_ISDIR(sig->type)) {
+		// A directory's times change with its entries, which aren't
+		// events in its parent
+		if (sig->mtime == old->mtime && sig->ctime != old->ctime)
+			queue_event(t->wd, t->events, IN_ATTRIB | IN_ISDIR, 0,
+				    name);
+		return;
+	}
+	if (sig->size != old->size || sig->mtime != old->mtime) {
+		queue_event(t->wd, t->events, IN_MODIFY, 0, name);
+		if (S_ISREG(sig->type))
+			queue_event(t->wd, t->events, IN_CLOSE_WRITE, 0, name);
+	} else if (sig->ctime != old->ctime) {
+		queue_event(t->wd, t->events, IN_ATTRIB, 0, name);
+	}
+}
+
+/**
+ * @internal
+ * Queue the events which tell how a directory got from one listing to the
+ * next.  An entry which is gone and one which is new with the same inode
+ * are reported as moved, with a cookie pairing them.
+ */
+static void compare_listings(struct target const* t,
+			     struct listing const* old,
+			     struct listing const* list) {
+	int* removed = (int*)malloc((old->num_entries + 1) * sizeof(int));
+	int* added = (int*)malloc((list->num_entries + 1) * sizeof(int));
+	char* paired = (char*)calloc(list->num_entries + 1, 1);
+	if (!removed || !added || !paired) {
+		free(removed);
+		free(added);
+		free(paired);
+		return;
+	}
+	int num_removed = 0;
+	int num_added = 0;
+
+	int i = 0;
+	int j = 0;
+	while (i < old->num_entries || j < list->num_entries) {
+		struct entry const* a =
+		    i < old->num_entries ? &old->entries[i] : 0;
+		struct entry const* b =
+		    j < list->num_entries ? &list->entries[j] : 0;
+		int order = !a ? 1
+			    : !b
+				? -1
+				: strcmp(old->names + a->name,
+					 list->names + b->name);
+		if (order < 0) {
+			removed[num_removed++] = i++;
+		} else if (order > 0) {
+			added[num_added++] = j++;
+		} else if (a->sig.ino != b->sig.ino ||
+			   a->sig.type != b->sig.type) {
+			// Replaced by another file
+			removed[num_removed++] = i++;
+			added[num_added++] = j++;
+		} else {
+			entry_changed(t, &a->sig, &b->sig,
+				      list->names + b->name);
+			++i;
+			++j;
+		}
+	}
+
+	// New entries by inode, to look up the other half of each move
+	std::sort(added, added + num_added, [list](int a, int b) {
+		return list->entries[a].sig.ino < list->entries[b].sig.ino;
+	});
+	for (i = 0; i < num_removed; ++i) {
+		struct entry const* a = &old->entries[removed[i]];
+		char const* name = old->names + a->name;
+		int* k = std::lower_bound(
+		    added, added + num_added, a->sig.ino,
+		    [list](int b, uint64_t ino) {
+			    return list->entries[b].sig.ino < ino;
+		    });
+		// Hard links share an inode, so skip those already paired
+		for (; k < added + num_added &&
+		       list->entries[*k].sig.ino == a->sig.ino;
+		     ++k) {
+			if (!paired[*k] &&
+			    list->entries[*k].sig.type == a->sig.type)
+				break;
+		}
+		if (k < added + num_added &&
+		    list->entries[*k].sig.ino == a->sig.ino) {
+			struct entry const* b = &list->entries[*k];
+			uint32_t cookie = ++next_cookie ?: ++next_cookie;
+			queue_event(t->wd, t->events,
+				    IN_MOVED_FROM | isdir_flag(&a->sig), cookie,
+				    name);
+			queue_event(t->wd, t->events,
+				    IN_MOVED_TO | isdir_flag(&b->sig), cookie,
+				    list->names + b->name);
+			paired[*k] = 1;
+			continue;
+		}
+		queue_event(t->wd, t->events, IN_DELETE | isdir_flag(&a->sig),
+			    0, name);
+	}
+
+	// New files are reported as if written and closed, so that those
+	// waiting for IN_CLOSE_WRITE see them
+	for (i = 0; i < num_added; ++i) {
+		if (paired[added[i]])
+			continue;
+		struct entry const* b = &list->entries[added[i]];
+		char const* name = list->names + b->name;
+		queue_event(t->wd, t->events, IN_CREATE | isdir_flag(&b->sig),
+			    0, name);
+		if (S_ISREG(b->sig.type)) {
+			if (b->sig.size)
+				queue_event(t->wd, t->events, IN_MODIFY, 0,
+					    name);
+			queue_event(t->wd, t->events, IN_CLOSE_WRITE, 0, name);
+		}
+	}
+	free(removed);
+	free(added);
+	free(paired);
+}
+
+/**
+ * @internal
+ * Scan a polled file, or the entries of a polled directory, queueing the
+ * events which tell what changed since the last scan.
+ *
+ * @param now CLOCK_REALTIME seconds.
+ * @param stats incremented by the number of stat() calls made.
+ */
+static void scan_target(struct target* t, time_t now, int* stats) {
+	watch* w = watch_from_wd(t->wd);
+	if (!w) {
+		drop_target(t);
+		return;
+	}
+
+	struct stat st;
+	++*stats;
+	if (stat_target(w->filename, t->events, &st)) {
+		// Transient errors are retried on the next scan
+		if (errno == ENOENT || errno == ENOTDIR || errno == ESTALE)
+			target_gone(t);
+		return;
+	}
+	struct signature sig;
+	signature_of(&st, &sig);
+	if (sig.ino != t->sig.ino || sig.type != t->sig.type) {
+		// Replaced, so the file watched is gone
+		target_gone(t);
+		return;
+	}
+
+	if (!S_ISDIR(sig.type)) {
+		if (sig.size != t->sig.size || sig.mtime != t->sig.mtime) {
+			queue_event(t->wd, t->events, IN_MODIFY, 0, 0);
+			if (S_ISREG(sig.type))
+				queue_event(t->wd, t->events, IN_CLOSE_WRITE,
+					    0, 0);
+		} else if (sig.ctime != t->sig.ctime) {
+			queue_event(t->wd, t->events, IN_ATTRIB, 0, 0);
+		}
+		t->sig = sig;
+		return;
+	}
+
+	// Unless the entries themselves are of interest, a directory whose
+	// modification time is unchanged need not be read again
+	if ((t->events & CONTENT_EVENTS) || sig.mtime != t->sig.mtime ||
+	    sig.mtime / 1000000000LL + MTIME_SLACK >= t->listed) {
+		struct listing list;
+		if (!read_listing(w->filename, &list, stats)) {
+			if (errno == ENOENT || errno == ENOTDIR ||
+			    errno == ESTALE)
+				target_gone(t);
+			return;
+		}
+		compare_listings(t, &t->list, &list);
+		free_listing(&t->list);
+		t->list = list;
+		t->listed = now;
+	}
+	if (sig.mtime == t->sig.mtime && sig.ctime != t->sig.ctime)
+		queue_event(t->wd, t->events, IN_ATTRIB | IN_ISDIR, 0, 0);
+	t->sig = sig;
+}
+
+/**
+ * @internal
+ * Scan the polled files after the one scanned last, until @a max_stats
+ * stat() calls were made or each was scanned once.  A directory is always
+ * scanned whole, so at least one is scanned however many entries it has.
+ */
+static void scan_slice(struct timespec const* now) {
+	struct timespec realtime;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	int stats = 0;
+	for (int scanned = 0;
+	     scanned < num_targets && (!max_stats || stats < max_stats);
+	     ++scanned) {
+		struct target key;
+		key.wd = cursor;
+		struct target* t = (struct target*)rblookup(RB_LUGREAT, &key,
+							    tree_targets);
+		if (!t)
+			t = (struct target*)rbmin(tree_targets);
+		if (!t)
+			break;
+		cursor = t->wd;
+		scan_target(t, realtime.tv_sec, &stats);
+	}
+
+	next_due = *now;
+	next_due.tv_sec += interval_ms / 1000;
+	next_due.tv_nsec += interval_ms % 1000 * 1000000L;
+	if (next_due.tv_nsec >= 1000000000L) {
+		++next_due.tv_sec;
+		next_due.tv_nsec -= 1000000000L;
+	}
+}
+
+/**
+ * @internal
+ * Set how often polled files are scanned: every @a interval_ms
+ * milliseconds, the files after those scanned last are scanned until
+ * @a max_stats stat() calls were made, or all of them were if it is 0.
+ *
+ * @return 1 on success, 0 and sets errno on error.
+ */
+int scan_set_rate(long ms, int stats) {
+	if (ms <= 0 || stats < 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	interval_ms = ms;
+	max_stats = stats;
+	return 1;
+}
+
+/**
+ * @internal
+ * @return nonzero if @a path is on a network or FUSE filesystem, where
+ *         inotify only reports the changes made through this machine.
+ */
+int scan_remote_filesystem(char const* path) {
+	struct statfs buf;
+	if (statfs(path, &buf))
+		return 0;
+#ifdef __linux__
+	static const uint32_t remote[] = {
+	    0x6969,	 // NFS
+	    0x517b,	 // SMB
+	    0xff534d42,	 // CIFS
+	    0xfe534d42,	 // SMB2
+	    0x65735546,	 // FUSE
+	    0x00c36400,	 // Ceph
+	    0x01021997,	 // 9P
+	    0x5346414f,	 // AFS
+	    0x6b414653,	 // kAFS
+	    0x73757245,	 // Coda
+	    0x564c,	 // NCP
+	    0x01161970,	 // GFS2
+	    0x7461636f,	 // OCFS2
+	};
+	for (uint32_t type : remote) {
+		if ((uint32_t)buf.f_type == type)
+			return 1;
+	}
+	return 0;
+#else
+	static char const* const remote[] = {"nfs", "smbfs", "fusefs",
+					     "fuse"};
+	for (char const* type : remote) {
+		if (!strcmp(buf.f_fstypename, type))
+			return 1;
+	}
+	return 0;
+#endif
+}
+
+/**
+ * @internal
+ * Start polling @a path for @a events, reading the entries of a directory
+ * so that the next scan has something to compare with.
+ *
+ * @param wd the watch descriptor of @a path if it is polled already, which
+ *           then only has its events changed, or 0.
+ *
+ * @return the watch descriptor for the polled file, or -1 and sets errno
+ *         on error.
+ */
+int scan_add(char const* path, int events, int wd) {
+	struct target key;
+	key.wd = wd;
+	struct target* t =
+	    wd && tree_targets
+		? (struct target*)rbfind(&key, tree_targets)
+		: 0;
+	if (t) {
+		t->events = (events & IN_MASK_ADD) ? t->events | events
+						   : events;
+		return wd;
+	}
+
+	struct stat st;
+	if (stat_target(path, events, &st))
+		return -1;
+	if ((events & IN_ONLYDIR) && !S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (!tree_targets && !(tree_targets = rbinit(target_compare, 0))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	t = (struct target*)calloc(1, sizeof(*t));
+	if (!t) {
+		errno = ENOMEM;
+		return -1;
+	}
+	int stats = 0;
+	if (S_ISDIR(st.st_mode) && !read_listing(path, &t->list, &stats)) {
+		free(t);
+		return -1;
+	}
+	t->wd = next_wd--;
+	t->events = events;
+	signature_of(&st, &t->sig);
+	t->listed = time(0);
+	rbsearch(t, tree_targets);
+	++num_targets;
+	return t->wd;
+}
+
+/**
+ * @internal
+ * @return nonzero if @a wd was handed out by scan_add().
+ */
+int scan_owns(int wd) {
+	return wd > next_wd;
+}
+
+/**
+ * @internal
+ * Stop polling the file with watch descriptor @a wd, queueing IN_IGNORED
+ * for it as inotify does when a watch is removed.
+ */
+void scan_remove(int wd) {
+	struct target key;
+	key.wd = wd;
+	struct target* t =
+	    tree_targets ? (struct target*)rbfind(&key, tree_targets) : 0;
+	if (!t)
+		return;
+	queue_event(wd, t->events, IN_IGNORED, 0, 0);
+	drop_target(t);
+}
+
+/**
+ * @internal
+ * @return nonzero if files are polled, or events are waiting to be
+ *         returned.
+ */
+int scan_active() {
+	return num_targets || first_queued;
+}
+
+/**
+ * @internal
+ * Get the next synthesized event, scanning the next slice of the polled
+ * files first if it is due and no events are waiting.
+ *
+ * @return the event, which is valid until the next call, or NULL if there
+ *         is none yet.
+ */
+struct inotify_event* scan_next(struct timespec const* now) {
+	free(returned);
+	returned = 0;
+	if (!first_queued && num_targets &&
+	    (now->tv_sec > next_due.tv_sec ||
+	     (now->tv_sec == next_due.tv_sec &&
+	      now->tv_nsec >= next_due.tv_nsec)))
+		scan_slice(now);
+	if (!first_queued)
+		return NULL;
+
+	returned = first_queued;
+	first_queued = returned->next;
+	if (!first_queued)
+		last_queued = 0;
+	return &returned->event;
+}
+
+/**
+ * @internal
+ * Get the time the next event is due, which is at once if some are
+ * waiting, or else when the next slice of the scan is.
+ *
+ * @return 1 and sets @a due if files are polled or events are waiting, 0
+ *         otherwise.
+ */
+int scan_next_due(struct timespec* due) {
+	if (first_queued) {
+		due->tv_sec = 0;
+		due->tv_nsec = 0;
+		return 1;
+	}
+	if (!num_targets)
+		return 0;
+	*due = next_due;
+	return 1;
+}
+
+/**
+ * @internal
+ * Stop polling, and drop the events waiting to be returned.
+ */
+void scan_clear() {
+	struct target* t;
+	while (tree_targets && (t = (struct target*)rbmin(tree_targets)))
+		drop_target(t);
+	rbdestroy(tree_targets);
+	tree_targets = 0;
+	num_targets = 0;
+	while (first_queued) {
+		struct queued* q = first_queued;
+		first_queued = q->next;
+		free(q);
+	}
+	last_queued = 0;
+	free(returned);
+	returned = 0;
+	next_wd = INT_MAX;
+	cursor = 0;
+	next_due.tv_sec = 0;
+	next_due.tv_nsec = 0;
+	interval_ms = DEFAULT_INTERVAL_MS;
+	max_stats = DEFAULT_MAX_STATS;
+}
@@ -0,0 +1,19 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+#include "inotifytools/inotify.h"
+
+#include <time.h>
+
+// Not part of the library ABI
+#pragma GCC visibility push(hidden)
+int scan_set_rate(long interval_ms, int max_stats);
+int scan_remote_filesystem(char const* path);
+int scan_add(char const* path, int events, int wd);
+int scan_owns(int wd);
+void scan_remove(int wd);
+int scan_active();
+struct inotify_event* scan_next(struct timespec const* now);
+int scan_next_due(struct timespec* due);
+void scan_clear();
+#pragma GCC visibility pop
+#endif	// SCANNER_H
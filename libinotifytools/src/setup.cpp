@@ -0,0 +1,407 @@
+#include "inotifytools/inotify.h"
+#include "inotifytools/inotifytools.h"
+#include "inotifytools_p.h"
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Time taken to set up watches on a large tree, in each of the modes
+// watches can be set up in.  Not run by `make check'; build with
+// `make setup' and run as e.g. `./setup -d 4 -f 10'.
+//
+// The tree is created in a directory on tmpfs, and each mode is measured
+// in a child process of its own so that the peak RSS is its alone.  The
+// system calls the library makes while setting up watches and the heap
+// allocations are counted by wrapping the libc functions, which works for
+// glibc only.  The snapshot mode times loading a snapshot of the
+// inotify watches, as a restarting program would.  The budget mode sets up
+// inotify watches the way inotifywait and inotifywatch do with -r, planning
+// them within the watches available.
+
+#define EVENTS                                                           \
+	(IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | \
+	 IN_MOVED_TO)
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+static long num_syscalls = 0;
+static long num_allocs = 0;
+static long heap_bytes = 0;
+
+static void* count_alloc(void* ptr) {
+	if (ptr) {
+		++num_allocs;
+		heap_bytes += malloc_usable_size(ptr);
+	}
+	return ptr;
+}
+
+extern "C" void* malloc(size_t size) noexcept {
+	return count_alloc(__libc_malloc(size));
+}
+
+extern "C" void* calloc(size_t count, size_t size) noexcept {
+	return count_alloc(__libc_calloc(count, size));
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) noexcept {
+	return count_alloc(__libc_memalign(alignment, size));
+}
+
+extern "C" void* realloc(void* ptr, size_t size) noexcept {
+	size_t old = ptr ? malloc_usable_size(ptr) : 0;
+	void* ret = __libc_realloc(ptr, size);
+	if (ret) {
+		heap_bytes -= old;
+		count_alloc(ret);
+	}
+	return ret;
+}
+
+extern "C" void free(void* ptr) noexcept {
+	if (ptr)
+		heap_bytes -= malloc_usable_size(ptr);
+	__libc_free(ptr);
+}
+
+// Wrap a libc function which makes a system call, counting the calls
+#define COUNT_SYSCALL(ret, name, params, args, ...)                   \
+	extern "C" ret name params __VA_ARGS__ {                      \
+		static ret(*real) params =                            \
+		    (ret(*) params)dlsym(RTLD_NEXT, #name);           \
+		++num_syscalls;                                       \
+		return real args;                                     \
+	}
+
+COUNT_SYSCALL(int,
+	      inotify_add_watch,
+	      (int fd, const char* path, uint32_t mask),
+	      (fd, path, mask),
+	      noexcept)
+COUNT_SYSCALL(int,
+	      fanotify_mark,
+	      (int fd,
+	       unsigned flags,
+	       uint64_t mask,
+	       int dirfd,
+	       const char* path),
+	      (fd, flags, mask, dirfd, path),
+	      noexcept)
+COUNT_SYSCALL(int,
+	      name_to_handle_at,
+	      (int dirfd,
+	       const char* path,
+	       struct file_handle* handle,
+	       int* mount_id,
+	       int flags),
+	      (dirfd, path, handle, mount_id, flags),
+	      noexcept)
+COUNT_SYSCALL(int,
+	      lstat,
+	      (const char* path, struct stat* buf),
+	      (path, buf),
+	      noexcept)
+COUNT_SYSCALL(int,
+	      statfs,
+	      (const char* path, struct statfs* buf),
+	      (path, buf),
+	      noexcept)
+COUNT_SYSCALL(ssize_t,
+	      readlink,
+	      (const char* path, char* buf, size_t size),
+	      (path, buf, size),
+	      noexcept)
+COUNT_SYSCALL(DIR*, opendir, (const char* path), (path))
+COUNT_SYSCALL(int, closedir, (DIR * dir), (dir))
+
+// readdir() is left out: it only makes a system call when its buffer of
+// entries runs out
+extern "C" int open(const char* path, int flags, ...) {
+	static int (*real)(const char*, int, ...) =
+	    (int (*)(const char*, int, ...))dlsym(RTLD_NEXT, "open");
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	++num_syscalls;
+	return real(path, flags, mode);
+}
+
+static bool json = false;
+// Most watches the budget mode may use, or 0 for as many as are available
+static int max_watches = 0;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Create @a fanout directories in @a path, each with @a files files, down
+// to @a depth levels.  @a path has room for PATH_MAX bytes.
+static long create_tree(char* path, int depth, int fanout, int files) {
+	size_t len = strlen(path);
+	long dirs = 0;
+	for (int i = 0; i < files; ++i) {
+		snprintf(path + len, PATH_MAX - len, "/file%d", i);
+		int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd == -1) {
+			fprintf(stderr, "Couldn't create %s: %s\n", path,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+	}
+	for (int i = 0; depth && i < fanout; ++i) {
+		snprintf(path + len, PATH_MAX - len, "/%d", i);
+		if (mkdir(path, 0700)) {
+			fprintf(stderr, "Couldn't create %s: %s\n", path,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		dirs += 1 + create_tree(path, depth - 1, fanout, files);
+	}
+	path[len] = '\0';
+	return dirs;
+}
+
+static int remove_file(const char* path, const struct stat*, int, FTW*) {
+	return remove(path);
+}
+
+static char const* const mode_names[] = {"inotify", "fanotify",
+					 "filesystem", "snapshot", "budget"};
+#define NUM_MODES 5
+
+// Set up the watches in one mode, and print what it took.
+static void run_mode(int mode, char const* root, long dirs) {
+	// A fanotify watch holds descriptors open for its directory.  Raising
+	// the hard limit as far as the kernel allows takes privilege.
+	struct rlimit limit;
+	if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+		FILE* nr_open = fopen("/proc/sys/fs/nr_open", "r");
+		unsigned long max;
+		if (nr_open && fscanf(nr_open, "%lu", &max) == 1 &&
+		    max > limit.rlim_max) {
+			struct rlimit raised = {max, max};
+			if (!setrlimit(RLIMIT_NOFILE, &raised))
+				limit = raised;
+		}
+		if (nr_open)
+			fclose(nr_open);
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// A restart from a snapshot, saved by watching the tree first.
+	// Directories modified within a second of saving it are read again
+	// when loading it, so the tree which was just created is let settle.
+	char snapshot[PATH_MAX + 1];
+	if (mode == 3) {
+		sleep(2);
+		strcpy(snapshot, root);
+		strcat(snapshot, ".snapshot");
+		if (!inotifytools_init(0, 0, 0) ||
+		    !inotifytools_watch_recursively(root, EVENTS) ||
+		    !inotifytools_save_snapshot(snapshot)) {
+			fprintf(stderr, "%s: couldn't save a snapshot: %s\n",
+				mode_names[mode],
+				strerror(inotifytools_error()));
+			exit(EXIT_FAILURE);
+		}
+		inotifytools_cleanup();
+	}
+
+	if (!inotifytools_init(mode == 1 || mode == 2, mode == 2, 0)) {
+		fprintf(stderr, "%s: couldn't initialize: %s\n",
+			mode_names[mode], strerror(inotifytools_error()));
+		exit(EXIT_FAILURE);
+	}
+
+	long syscalls = num_syscalls;
+	long allocs = num_allocs;
+	long heap = heap_bytes;
+	double start = now();
+	int ok;
+	if (mode == 2) {
+		char const* files[] = {root, NULL};
+		ok = inotifytools_watch_files(files, EVENTS);
+	} else if (mode == 3) {
+		ok = inotifytools_load_snapshot(snapshot, EVENTS, NULL);
+		unlink(snapshot);
+	} else if (mode == 4) {
+		ok = inotifytools_watch_recursively_within_budget(
+		    root, EVENTS, NULL, max_watches, NULL);
+	} else {
+		ok = inotifytools_watch_recursively_with_exclude(root, EVENTS,
+								 NULL);
+	}
+	double secs = now() - start;
+	syscalls = num_syscalls - syscalls;
+	allocs = num_allocs - allocs;
+	heap = heap_bytes - heap;
+	if (!ok) {
+		// Some failures are reported by the library but leave no error
+		int err = inotifytools_error();
+		fprintf(stderr, "%s: couldn't set up watches%s%s\n",
+			mode_names[mode], err ? ": " : "",
+			err ? strerror(err) : "");
+		if (err == ENOSPC)
+			fprintf(stderr,
+				"Raise the limit in "
+				"/proc/sys/fs/inotify/max_user_watches\n");
+		else if (mode == 1)
+			fprintf(stderr, "Open files are limited to %lu\n",
+				(unsigned long)limit.rlim_cur);
+		exit(EXIT_FAILURE);
+	}
+
+	int watches = inotifytools_get_num_watches();
+	long index = inotifytools_watch_index_bytes();
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	if (json) {
+		printf("{\"mode\":\"%s\",\"dirs\":%ld,\"watches\":%d,"
+		       "\"secs\":%.6f,\"watches_per_sec\":%.0f,"
+		       "\"syscalls\":%ld,\"allocs\":%ld,\"heap_kb\":%ld,"
+		       "\"index_kb\":%ld,\"peak_rss_kb\":%ld}\n",
+		       mode_names[mode], dirs, watches, secs, watches / secs,
+		       syscalls, allocs, heap / 1024, index / 1024,
+		       usage.ru_maxrss);
+	} else {
+		printf("%-10s %9ld %9d %9.3f %12.0f %9ld %9ld %9ld %9ld %9ld\n",
+		       mode_names[mode], dirs, watches, secs, watches / secs,
+		       syscalls, allocs, heap / 1024, index / 1024,
+		       usage.ru_maxrss);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static void usage(char const* name) {
+	fprintf(stderr,
+		"Usage: %s [-j] [-d depth] [-f fanout] [-n files] "
+		"[-m mode[,mode...]] [-w watches] [-t dir]\n"
+		"  -j  print one JSON object per line\n"
+		"  -d  levels of directories below the root (default 4)\n"
+		"  -f  directories in each directory (default 10)\n"
+		"  -n  files in each directory (default 0)\n"
+		"  -m  inotify, fanotify, filesystem, snapshot or budget\n"
+		"      (default inotify,fanotify,filesystem,snapshot,budget)\n"
+		"  -w  most watches the budget mode may use (default 0, for\n"
+		"      as many as are available)\n"
+		"  -t  directory to create the tree in (default /dev/shm)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+	int depth = 4;
+	int fanout = 10;
+	int files = 0;
+	char const* modes = "inotify,fanotify,filesystem,snapshot,budget";
+	char const* parent = "/dev/shm";
+	int opt;
+	while ((opt = getopt(argc, argv, "jd:f:n:m:w:t:")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = true;
+				break;
+			case 'd':
+				depth = atoi(optarg);
+				break;
+			case 'f':
+				fanout = atoi(optarg);
+				break;
+			case 'n':
+				files = atoi(optarg);
+				break;
+			case 'm':
+				modes = optarg;
+				break;
+			case 'w':
+				max_watches = atoi(optarg);
+				break;
+			case 't':
+				parent = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc || depth < 0 || fanout < 1 || files < 0 ||
+	    max_watches < 0)
+		usage(argv[0]);
+
+	// Check the modes before the tree takes its time being created
+	int run[NUM_MODES] = {0, 0, 0, 0, 0};
+	for (char const* p = modes; *p;) {
+		size_t len = strcspn(p, ",");
+		int mode = 0;
+		while (mode < NUM_MODES && (strlen(mode_names[mode]) != len ||
+					    strncmp(p, mode_names[mode], len)))
+			++mode;
+		if (mode == NUM_MODES)
+			usage(argv[0]);
+		run[mode] = 1;
+		p += len + (p[len] == ',');
+	}
+
+	char root[PATH_MAX];
+	snprintf(root, sizeof(root), "%s/inotifytools-setup.XXXXXX", parent);
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "Couldn't create a directory in %s: %s\n",
+			parent, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	double start = now();
+	long dirs = 1 + create_tree(root, depth, fanout, files);
+	fprintf(stderr, "Created %ld directories in %.1f seconds\n", dirs,
+		now() - start);
+
+	if (!json)
+		printf("%-10s %9s %9s %9s %12s %9s %9s %9s %9s %9s\n", "mode",
+		       "dirs", "watches", "secs", "watches/s", "syscalls",
+		       "allocs", "heap_kb", "index_kb", "rss_kb");
+	fflush(stdout);
+	int status = EXIT_SUCCESS;
+	for (int mode = 0; mode < NUM_MODES; ++mode) {
+		if (!run[mode])
+			continue;
+		pid_t pid = fork();
+		if (pid == 0)
+			run_mode(mode, root, dirs);
+		int child;
+		if (pid == -1 || waitpid(pid, &child, 0) == -1 ||
+		    !WIFEXITED(child) || WEXITSTATUS(child))
+			status = EXIT_FAILURE;
+	}
+
+	nftw(root, remove_file, 64, FTW_DEPTH | FTW_PHYS);
+	return status;
+}
@@ -1,19 +1,54 @@
 #include "stats.h"
 
-static unsigned num_access;
-static unsigned num_modify;
-static unsigned num_attrib;
-static unsigned num_close_nowrite;
-static unsigned num_close_write;
-static unsigned num_open;
-static unsigned num_move_self;
-static unsigned num_moved_to;
-static unsigned num_moved_from;
-static unsigned num_create;
-static unsigned num_delete;
-static unsigned num_delete_self;
-static unsigned num_unmount;
-static unsigned num_total;
+#include <algorithm>
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t num[STAT_SLOTS];
+
+int collect_rates = 0;
+static struct rates total_rates;
+// Second rate collection started, to not average over time before it
+static uint64_t rates_start;
+static int const ring_resolution[RATE_RINGS] = {1, 10, 60};
+static int const ewma_minutes[RATE_EWMAS] = {1, 5, 15};
+static double ewma_decay[RATE_EWMAS];
+
+// Min-heap of the top_k watches with the most occurrences of the tracked
+// event in the current interval.  Counts only ever go up by one, so every
+// watch outside the heap has a count no greater than the heap's minimum.
+static watch** top_heap;
+// The heap sorted, busiest first, as last returned by
+// inotifytools_top_watches(); the second half of the heap's allocation
+static watch** top_sorted;
+static int top_k;
+static int top_size;
+static int top_slot;
+static unsigned top_interval = 1;
+
+// Space-Saving summary of the files with the most occurrences of the tracked
+// event: files_size <= files_max counters, a min-heap of their indexes by
+// count and an open addressing hash table of their indexes by key.  When all
+// are in use, a new file takes over the counter with the smallest count,
+// which it inherits as its error, so no file's count is ever underestimated.
+static struct file_hits* files;
+// Counts are kept in the heap too, to not touch the counters when sifting
+static struct files_heap_entry {
+	uint64_t count;
+	int i;
+}* files_heap;
+static int files_max;
+static int files_size;
+static int files_slot;
+static int* files_table;
+static unsigned files_mask;
+static struct file_hits** files_sorted;
 
 /**
  * @internal
@@ -25,118 +60,347 @@ void empty_stats(const void* nodep,
 	if (which != endorder && which != leaf)
 		return;
 	watch* w = (watch*)nodep;
-	w->hit_access = 0;
-	w->hit_modify = 0;
-	w->hit_attrib = 0;
-	w->hit_close_nowrite = 0;
-	w->hit_close_write = 0;
-	w->hit_open = 0;
-	w->hit_move_self = 0;
-	w->hit_moved_from = 0;
-	w->hit_moved_to = 0;
-	w->hit_create = 0;
-	w->hit_delete = 0;
-	w->hit_delete_self = 0;
-	w->hit_unmount = 0;
-	w->hit_total = 0;
+	memset(w->hit, 0, sizeof(w->hit));
+}
+
+static void top_swap(int i, int j) {
+	watch* w = top_heap[i];
+	top_heap[i] = top_heap[j];
+	top_heap[j] = w;
+	top_heap[i]->top_pos = i + 1;
+	top_heap[j]->top_pos = j + 1;
+}
+
+static void top_sift_up(int i) {
+	while (i) {
+		int parent = (i - 1) / 2;
+		if (top_heap[parent]->interval_hits <=
+		    top_heap[i]->interval_hits)
+			break;
+		top_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void top_sift_down(int i) {
+	for (;;) {
+		int least = i;
+		int child = 2 * i + 1;
+		for (int c = child; c < child + 2 && c < top_size; ++c) {
+			if (top_heap[c]->interval_hits <
+			    top_heap[least]->interval_hits)
+				least = c;
+		}
+		if (least == i)
+			return;
+		top_swap(i, least);
+		i = least;
+	}
 }
 
 /**
  * @internal
+ * Count an occurrence of the tracked event on @a w, updating the heap in
+ * O(log k).
  */
-void record_stats(struct inotify_event const* event) {
-	if (!event)
+static void top_record(watch* w) {
+	if (w->top_interval != top_interval) {
+		w->top_interval = top_interval;
+		w->interval_hits = 0;
+		w->top_pos = 0;
+	}
+	++w->interval_hits;
+	if (w->top_pos) {
+		top_sift_down(w->top_pos - 1);
+	} else if (top_size < top_k) {
+		top_heap[top_size] = w;
+		w->top_pos = ++top_size;
+		top_sift_up(top_size - 1);
+	} else if (w->interval_hits > top_heap[0]->interval_hits) {
+		top_heap[0]->top_pos = 0;
+		top_heap[0] = w;
+		w->top_pos = 1;
+		top_sift_down(0);
+	}
+}
+
+/**
+ * @internal
+ * Remove a watch that is about to be destroyed from the top watches.
+ */
+void top_forget_watch(watch* w) {
+	if (!w->top_pos || w->top_interval != top_interval)
 		return;
-	watch* w = watch_from_wd(event->wd);
-	if (!w)
+	int i = w->top_pos - 1;
+	w->top_pos = 0;
+	if (i == --top_size)
 		return;
-	if (IN_ACCESS & event->mask) {
-		++w->hit_access;
-		++num_access;
+	top_heap[i] = top_heap[top_size];
+	top_heap[i]->top_pos = i + 1;
+	top_sift_down(i);
+	top_sift_up(i);
+}
+
+static uint64_t file_key(unsigned long wd, char const* name) {
+	// FNV-1a
+	uint64_t h = 14695981039346656037ull ^ (uint64_t)wd;
+	for (; *name; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 1099511628211ull;
 	}
-	if (IN_MODIFY & event->mask) {
-		++w->hit_modify;
-		++num_modify;
+	return h;
+}
+
+static void files_swap(int i, int j) {
+	struct files_heap_entry e = files_heap[i];
+	files_heap[i] = files_heap[j];
+	files_heap[j] = e;
+	files[files_heap[i].i].pos = i;
+	files[files_heap[j].i].pos = j;
+}
+
+static void files_sift_up(int i) {
+	while (i) {
+		int parent = (i - 1) / 2;
+		if (files_heap[parent].count <= files_heap[i].count)
+			break;
+		files_swap(i, parent);
+		i = parent;
 	}
-	if (IN_ATTRIB & event->mask) {
-		++w->hit_attrib;
-		++num_attrib;
+}
+
+static void files_sift_down(int i) {
+	for (;;) {
+		int least = i;
+		int child = 2 * i + 1;
+		for (int c = child; c < child + 2 && c < files_size; ++c) {
+			if (files_heap[c].count < files_heap[least].count)
+				least = c;
+		}
+		if (least == i)
+			return;
+		files_swap(i, least);
+		i = least;
 	}
-	if (IN_CLOSE_WRITE & event->mask) {
-		++w->hit_close_write;
-		++num_close_write;
+}
+
+static void files_table_insert(int i) {
+	unsigned slot = files[i].key & files_mask;
+	while (files_table[slot] >= 0)
+		slot = (slot + 1) & files_mask;
+	files_table[slot] = i;
+	files[i].slot = slot;
+}
+
+// Linear probing deletion, moving back entries that probed past the slot.
+static void files_table_remove(unsigned slot) {
+	for (unsigned next = (slot + 1) & files_mask; files_table[next] >= 0;
+	     next = (next + 1) & files_mask) {
+		struct file_hits* f = &files[files_table[next]];
+		unsigned home = f->key & files_mask;
+		if (((next - home) & files_mask) >= ((next - slot) & files_mask)) {
+			files_table[slot] = files_table[next];
+			f->slot = slot;
+			slot = next;
+		}
 	}
-	if (IN_CLOSE_NOWRITE & event->mask) {
-		++w->hit_close_nowrite;
-		++num_close_nowrite;
+	files_table[slot] = -1;
+}
+
+static void files_record(unsigned long wd, char const* name) {
+	uint64_t key = file_key(wd, name);
+	unsigned slot = key & files_mask;
+	for (; files_table[slot] >= 0; slot = (slot + 1) & files_mask) {
+		struct file_hits* f = &files[files_table[slot]];
+		if (f->key == key && f->wd == wd) {
+			files_heap[f->pos].count = ++f->count;
+			files_sift_down(f->pos);
+			return;
+		}
 	}
-	if (IN_OPEN & event->mask) {
-		++w->hit_open;
-		++num_open;
+
+	int i;
+	uint64_t count = 0;
+	if (files_size < files_max) {
+		i = files_size;
+		files_heap[files_size].i = i;
+		files[i].pos = files_size++;
+	} else {
+		i = files_heap[0].i;
+		count = files[i].count;
+		files_table_remove(files[i].slot);
 	}
-	if (IN_MOVED_FROM & event->mask) {
-		++w->hit_moved_from;
-		++num_moved_from;
+	struct file_hits* f = &files[i];
+	f->count = count + 1;
+	files_heap[f->pos].count = f->count;
+	f->error = count;
+	f->key = key;
+	f->wd = wd;
+	size_t len = strnlen(name, sizeof(f->name) - 1);
+	memcpy(f->name, name, len);
+	f->name[len] = 0;
+	files_table_insert(i);
+	if (count)
+		files_sift_down(f->pos);
+	else
+		files_sift_up(f->pos);
+}
+
+static void files_clear() {
+	files_size = 0;
+	if (files_table) {
+		for (unsigned i = 0; i <= files_mask; ++i)
+			files_table[i] = -1;
 	}
-	if (IN_MOVED_TO & event->mask) {
-		++w->hit_moved_to;
-		++num_moved_to;
+}
+
+static uint64_t rates_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * @internal
+ * Fold the events counted in @a r's pending second into the moving
+ * averages, decayed up to second @a now.
+ */
+static void ewma_fold(double* ewma, struct rates const* r, uint64_t now) {
+	for (int i = 0; i < RATE_EWMAS; ++i) {
+		double d = ewma_decay[i];
+		ewma[i] = r->ewma[i] * d + r->pending * (1 - d);
+		if (now > r->second + 1)
+			ewma[i] *= pow(d, now - r->second - 1);
 	}
-	if (IN_CREATE & event->mask) {
-		++w->hit_create;
-		++num_create;
+}
+
+static void rates_record(struct rates* r, uint64_t now) {
+	for (int i = 0; i < RATE_RINGS; ++i) {
+		struct rate_ring* ring = &r->rings[i];
+		uint64_t slot = now / ring_resolution[i];
+		if (slot != ring->last) {
+			// Clear buckets left over from a lap ago
+			uint64_t stale = std::min<uint64_t>(slot - ring->last,
+							    RATE_BUCKETS);
+			for (uint64_t j = 0; j < stale; ++j)
+				ring->buckets[(slot - j) % RATE_BUCKETS] = 0;
+			ring->last = slot;
+		}
+		++ring->buckets[slot % RATE_BUCKETS];
 	}
-	if (IN_DELETE & event->mask) {
-		++w->hit_delete;
-		++num_delete;
+	if (now != r->second) {
+		ewma_fold(r->ewma, r, now);
+		r->second = now;
+		r->pending = 0;
 	}
-	if (IN_DELETE_SELF & event->mask) {
-		++w->hit_delete_self;
-		++num_delete_self;
+	++r->pending;
+}
+
+/**
+ * @internal
+ * Average rate of events per second over the last @a window seconds, not
+ * counting the current, incomplete bucket.
+ */
+static double rates_window(struct rates const* r, int window) {
+	if (!collect_rates || window < 1 ||
+	    window > ring_resolution[RATE_RINGS - 1] * RATE_BUCKETS)
+		return -1;
+	int i = 0;
+	while (window > ring_resolution[i] * RATE_BUCKETS)
+		++i;
+	if (!r)
+		return 0;
+	struct rate_ring const* ring = &r->rings[i];
+	int resolution = ring_resolution[i];
+	uint64_t now = rates_now();
+	uint64_t current = now / resolution;
+	int n = std::max(window / resolution, 1);
+	uint64_t sum = 0;
+	for (int j = 1; j <= n && j <= (int)current; ++j) {
+		uint64_t slot = current - j;
+		if (slot <= ring->last && ring->last - slot < RATE_BUCKETS)
+			sum += ring->buckets[slot % RATE_BUCKETS];
 	}
-	if (IN_UNMOUNT & event->mask) {
-		++w->hit_unmount;
-		++num_unmount;
+	// Don't average over time before collection started
+	int64_t span = std::min<int64_t>(n * resolution,
+					 (int64_t)(current * resolution) -
+					     (int64_t)rates_start);
+	return span > 0 ? (double)sum / span : 0;
+}
+
+static double rates_ewma(struct rates const* r, int minutes) {
+	if (!collect_rates)
+		return -1;
+	int i = 0;
+	while (i < RATE_EWMAS && ewma_minutes[i] != minutes)
+		++i;
+	if (i == RATE_EWMAS)
+		return -1;
+	if (!r)
+		return 0;
+	uint64_t now = rates_now();
+	if (now == r->second)
+		return r->ewma[i];
+	double ewma[RATE_EWMAS];
+	ewma_fold(ewma, r, now);
+	return ewma[i];
+}
+
+/**
+ * @internal
+ * Count an event against watch @a w, or the watch for the event's wd if
+ * @a w is NULL.
+ */
+void record_stats(struct inotify_event const* event, watch* w) {
+	if (!event)
+		return;
+	if (!w)
+		w = watch_from_wd(event->wd);
+	if (!w)
+		return;
+	if (files_max && (files_slot == STAT_TOTAL ||
+			  (event->mask & (1u << files_slot))))
+		files_record(w->wd, event->len ? event->name : "");
+	w = aggregate_of(w);
+	for (uint32_t mask = event->mask & STAT_EVENTS; mask;
+	     mask &= mask - 1) {
+		int i = stat_index(mask);
+		++w->hit[i];
+		++num[i];
 	}
-	if (IN_MOVE_SELF & event->mask) {
-		++w->hit_move_self;
-		++num_move_self;
+	++w->hit[STAT_TOTAL];
+	++num[STAT_TOTAL];
+	if (collect_rates) {
+		uint64_t now = rates_now();
+		rates_record(&total_rates, now);
+		if (!w->rates)
+			w->rates = (struct rates*)calloc(1, sizeof(*w->rates));
+		if (w->rates)
+			rates_record(w->rates, now);
 	}
+	if (top_k && (top_slot == STAT_TOTAL ||
+		      (event->mask & (1u << top_slot))))
+		top_record(w);
+}
 
-	++w->hit_total;
-	++num_total;
-}
-
-unsigned int* stat_ptr(watch* w, int event) {
-	if (IN_ACCESS == event)
-		return &w->hit_access;
-	if (IN_MODIFY == event)
-		return &w->hit_modify;
-	if (IN_ATTRIB == event)
-		return &w->hit_attrib;
-	if (IN_CLOSE_WRITE == event)
-		return &w->hit_close_write;
-	if (IN_CLOSE_NOWRITE == event)
-		return &w->hit_close_nowrite;
-	if (IN_OPEN == event)
-		return &w->hit_open;
-	if (IN_MOVED_FROM == event)
-		return &w->hit_moved_from;
-	if (IN_MOVED_TO == event)
-		return &w->hit_moved_to;
-	if (IN_CREATE == event)
-		return &w->hit_create;
-	if (IN_DELETE == event)
-		return &w->hit_delete;
-	if (IN_DELETE_SELF == event)
-		return &w->hit_delete_self;
-	if (IN_UNMOUNT == event)
-		return &w->hit_unmount;
-	if (IN_MOVE_SELF == event)
-		return &w->hit_move_self;
-	if (0 == event)
-		return &w->hit_total;
-	return 0;
+/**
+ * @internal
+ * Get the counter for a single @a event, or the total if @a event is 0.
+ */
+uint64_t* stat_ptr(watch* w, int event) {
+	if (!event)
+		return &w->hit[STAT_TOTAL];
+	if ((event & (event - 1)) || !(event & STAT_EVENTS))
+		return 0;
+	return &w->hit[stat_index(event)];
+}
+
+/**
+ * @internal
+ * Clamp a counter to the range of the int returning getters.
+ */
+static int clamp_stat(int64_t n) {
+	return n > INT_MAX ? INT_MAX : (int)n;
 }
 
 /**
@@ -152,16 +416,38 @@ unsigned int* stat_ptr(watch* w, int event) {
  *
  * @return the number of times the event specified by @a event has occurred on
  *         the watch descriptor specified by @a wd since stats collection was
- *         enabled, or -1 if @a event or @a wd are invalid.
+ *         enabled, or -1 if @a event or @a wd are invalid.  Counts above
+ *         INT_MAX are returned as INT_MAX; use
+ *         inotifytools_get_stat_by_wd64() to get the exact count.
  */
 int inotifytools_get_stat_by_wd(int wd, int event) {
+	return clamp_stat(inotifytools_get_stat_by_wd64(wd, event));
+}
+
+/**
+ * Get statistics by a particular watch descriptor as a 64-bit count.
+ *
+ * Like inotifytools_get_stat_by_wd(), but does not clamp the count.
+ */
+int64_t inotifytools_get_stat_by_wd64(int wd, int event) {
 	if (!collect_stats)
 		return -1;
 
 	watch* w = watch_from_wd(wd);
 	if (!w)
 		return -1;
-	unsigned int* i = stat_ptr(w, event);
+	return inotifytools_get_stat_by_watch64(w, event);
+}
+
+/**
+ * @internal
+ * Like inotifytools_get_stat_by_wd64(), for a watch or a directory
+ * statistics are rolled up to.
+ */
+int64_t inotifytools_get_stat_by_watch64(watch* w, int event) {
+	if (!collect_stats)
+		return -1;
+	uint64_t* i = stat_ptr(w, event);
 	if (!i)
 		return -1;
 	return *i;
@@ -178,42 +464,27 @@ int inotifytools_get_stat_by_wd(int wd, int event) {
  *
  * @return the number of times the event specified by @a event has occurred over
  *         all watches since stats collection was enabled, or -1 if @a event
- *         is not a valid event.
+ *         is not a valid event.  Counts above INT_MAX are returned as
+ *         INT_MAX; use inotifytools_get_stat_total64() to get the exact
+ *         count.
  */
 int inotifytools_get_stat_total(int event) {
+	return clamp_stat(inotifytools_get_stat_total64(event));
+}
+
+/**
+ * Get statistics aggregated across all watches as a 64-bit count.
+ *
+ * Like inotifytools_get_stat_total(), but does not clamp the count.
+ */
+int64_t inotifytools_get_stat_total64(int event) {
 	if (!collect_stats)
 		return -1;
-	if (IN_ACCESS == event)
-		return num_access;
-	if (IN_MODIFY == event)
-		return num_modify;
-	if (IN_ATTRIB == event)
-		return num_attrib;
-	if (IN_CLOSE_WRITE == event)
-		return num_close_write;
-	if (IN_CLOSE_NOWRITE == event)
-		return num_close_nowrite;
-	if (IN_OPEN == event)
-		return num_open;
-	if (IN_MOVED_FROM == event)
-		return num_moved_from;
-	if (IN_MOVED_TO == event)
-		return num_moved_to;
-	if (IN_CREATE == event)
-		return num_create;
-	if (IN_DELETE == event)
-		return num_delete;
-	if (IN_DELETE_SELF == event)
-		return num_delete_self;
-	if (IN_UNMOUNT == event)
-		return num_unmount;
-	if (IN_MOVE_SELF == event)
-		return num_move_self;
-
-	if (0 == event)
-		return num_total;
-
-	return -1;
+	if (!event)
+		return num[STAT_TOTAL];
+	if ((event & (event - 1)) || !(event & STAT_EVENTS))
+		return -1;
+	return num[stat_index(event)];
 }
 
 /**
@@ -230,7 +501,8 @@ int inotifytools_get_stat_total(int event) {
  * @return the number of times the event specified by @a event has occurred on
  *         the file specified by @a filename since stats collection was
  *         enabled, or -1 if the file is not being watched or @a event is
- *         invalid.
+ *         invalid.  Counts above INT_MAX are returned as INT_MAX; use
+ *         inotifytools_get_stat_by_filename64() to get the exact count.
  *
  * @note The filename specified must always be the original name used to
  *       establish the watch.
@@ -240,6 +512,284 @@ int inotifytools_get_stat_by_filename(char const* filename, int event) {
 	    inotifytools_wd_from_filename(filename), event);
 }
 
+/**
+ * Get statistics by a particular filename as a 64-bit count.
+ *
+ * Like inotifytools_get_stat_by_filename(), but does not clamp the count.
+ */
+int64_t inotifytools_get_stat_by_filename64(char const* filename, int event) {
+	return inotifytools_get_stat_by_wd64(
+	    inotifytools_wd_from_filename(filename), event);
+}
+
+/**
+ * @internal
+ * Implementation of inotifytools_track_top_watches(); sets errno on failure.
+ */
+int track_top_watches(int k, int event) {
+	if (k < 0 || (event && ((event & (event - 1)) ||
+				!(event & STAT_EVENTS)))) {
+		errno = EINVAL;
+		return 0;
+	}
+	watch** heap = 0;
+	if (k) {
+		heap = (watch**)malloc(2 * k * sizeof(watch*));
+		if (!heap)
+			return 0;
+	}
+	// Empty the old heap first, to reset the positions of its watches
+	inotifytools_next_top_interval();
+	free(top_heap);
+	top_heap = heap;
+	top_sorted = heap ? heap + k : 0;
+	top_k = k;
+	top_slot = event ? stat_index(event) : STAT_TOTAL;
+	return 1;
+}
+
+/**
+ * @internal
+ * Implementation of inotifytools_track_top_files(); sets errno on failure.
+ */
+int track_top_files(int counters, int event) {
+	if (counters < 0 || counters > INT_MAX / 4 ||
+	    (event && ((event & (event - 1)) || !(event & STAT_EVENTS)))) {
+		errno = EINVAL;
+		return 0;
+	}
+	struct file_hits* hits = 0;
+	struct files_heap_entry* heap = 0;
+	struct file_hits** sorted = 0;
+	int* table = 0;
+	unsigned size = 0;
+	if (counters) {
+		// At most half full, so probes stay short
+		size = 1;
+		while (size < 2u * counters)
+			size *= 2;
+		hits =
+		    (struct file_hits*)malloc(counters * sizeof(*hits));
+		heap = (struct files_heap_entry*)malloc(counters *
+							 sizeof(*heap));
+		sorted = (struct file_hits**)malloc(counters * sizeof(*sorted));
+		table = (int*)malloc(size * sizeof(*table));
+		if (!hits || !heap || !sorted || !table) {
+			free(hits);
+			free(heap);
+			free(sorted);
+			free(table);
+			return 0;
+		}
+		for (unsigned i = 0; i < size; ++i)
+			table[i] = -1;
+	}
+	free(files);
+	free(files_heap);
+	free(files_sorted);
+	free(files_table);
+	files = hits;
+	files_heap = heap;
+	files_sorted = sorted;
+	files_table = table;
+	files_mask = size - 1;
+	files_max = counters;
+	files_size = 0;
+	files_slot = event ? stat_index(event) : STAT_TOTAL;
+	return 1;
+}
+
+/**
+ * @internal
+ * Get the files with the most occurrences of the event tracked by
+ * inotifytools_track_top_files(), busiest first.
+ *
+ * With n events counted by m counters, each count is at most n / m, and at
+ * most file_hits::error, more than the file's actual number of events.
+ * Every file with more than n / m events is included.
+ *
+ * @param count set to the number of files returned.
+ *
+ * @return array of files, owned by the library and valid until the next
+ *         event is read.
+ */
+struct file_hits** inotifytools_top_files(int* count) {
+	for (int i = 0; i < files_size; ++i)
+		files_sorted[i] = &files[i];
+	std::sort(files_sorted, files_sorted + files_size,
+		  [](struct file_hits const* f1, struct file_hits const* f2) {
+			  if (f1->count != f2->count)
+				  return f1->count > f2->count;
+			  if (f1->wd != f2->wd)
+				  return f1->wd < f2->wd;
+			  return strcmp(f1->name, f2->name) < 0;
+		  });
+	*count = files_size;
+	return files_sorted;
+}
+
+/**
+ * @internal
+ * Get the path of the watch @a f was counted on, or "" if it was removed.
+ */
+const char* inotifytools_file_hits_dir(struct file_hits const* f) {
+	return inotifytools_filename_from_watch(watch_from_wd(f->wd));
+}
+
+/**
+ * @internal
+ * Get the watches with the most occurrences of the tracked event since the
+ * last call to inotifytools_next_top_interval(), busiest first.
+ *
+ * Each watch's count in the interval is in watch::interval_hits.
+ *
+ * @param count set to the number of watches returned.
+ *
+ * @return array of watches, owned by the library and valid until the next
+ *         event is read or the interval ends.
+ */
+watch** inotifytools_top_watches(int* count) {
+	// Sort a copy, since the heap goes on being updated
+	std::copy(top_heap, top_heap + top_size, top_sorted);
+	std::sort(top_sorted, top_sorted + top_size,
+		  [](watch const* w1, watch const* w2) {
+			  if (w1->interval_hits != w2->interval_hits)
+				  return w1->interval_hits > w2->interval_hits;
+			  return w1->wd < w2->wd;
+		  });
+	*count = top_size;
+	return top_sorted;
+}
+
+/**
+ * @internal
+ * Start a new interval for the top watches, in O(k).
+ */
+void inotifytools_next_top_interval() {
+	for (int i = 0; i < top_size; ++i)
+		top_heap[i]->top_pos = 0;
+	top_size = 0;
+	++top_interval;
+}
+
+/**
+ * Get the rate of events on a watch descriptor over a recent time window.
+ *
+ * inotifytools_initialize_rates() must be called before this function can
+ * be used.
+ *
+ * @param wd watch descriptor to get the rate for.
+ *
+ * @param window number of seconds to average over, up to 3600.  Windows of
+ *               up to a minute are measured to the second, up to ten
+ *               minutes to ten seconds and longer windows to the minute.
+ *
+ * @return the average number of events per second on @a wd over the last
+ *         @a window seconds, not counting the current second (or ten seconds
+ *         or minute), or -1 if @a wd or @a window are invalid.
+ */
+double inotifytools_get_rate_by_wd(int wd, int window) {
+	watch* w = watch_from_wd(wd);
+	if (!w)
+		return -1;
+	return inotifytools_get_rate_by_watch(w, window);
+}
+
+/**
+ * @internal
+ * Like inotifytools_get_rate_by_wd(), but for a watch, which may be one
+ * statistics are rolled up to and so have no watch descriptor.
+ */
+double inotifytools_get_rate_by_watch(watch* w, int window) {
+	return rates_window(w->rates, window);
+}
+
+/**
+ * Get the rate of events over all watches over a recent time window.
+ *
+ * Like inotifytools_get_rate_by_wd(), but for all watches together.
+ */
+double inotifytools_get_rate_total(int window) {
+	return rates_window(&total_rates, window);
+}
+
+/**
+ * Get an exponentially weighted moving average of the rate of events on a
+ * watch descriptor, like the load average.
+ *
+ * inotifytools_initialize_rates() must be called before this function can
+ * be used.
+ *
+ * @param wd watch descriptor to get the rate for.
+ *
+ * @param minutes time constant of the average: 1, 5 or 15 minutes.
+ *
+ * @return the moving average of events per second on @a wd, or -1 if @a wd
+ *         or @a minutes are invalid.
+ */
+double inotifytools_get_rate_ewma_by_wd(int wd, int minutes) {
+	watch* w = watch_from_wd(wd);
+	if (!w)
+		return -1;
+	return inotifytools_get_rate_ewma_by_watch(w, minutes);
+}
+
+/**
+ * @internal
+ * Like inotifytools_get_rate_ewma_by_wd(), but for a watch.
+ */
+double inotifytools_get_rate_ewma_by_watch(watch* w, int minutes) {
+	return rates_ewma(w->rates, minutes);
+}
+
+/**
+ * Get an exponentially weighted moving average of the rate of events over
+ * all watches.
+ *
+ * Like inotifytools_get_rate_ewma_by_wd(), but for all watches together.
+ */
+double inotifytools_get_rate_ewma_total(int minutes) {
+	return rates_ewma(&total_rates, minutes);
+}
+
+/**
+ * @internal
+ */
+static void empty_rates(const void* nodep,
+			const VISIT which,
+			const int depth,
+			void* arg) {
+	if (which != endorder && which != leaf)
+		return;
+	watch* w = (watch*)nodep;
+	free(w->rates);
+	w->rates = 0;
+}
+
+/**
+ * Initialize or reset event rate collection.
+ *
+ * inotifytools_initialize_stats() must also be called, as rates are
+ * collected along with the other statistics.  Rates cost about 800 bytes of
+ * memory for each watch that has had an event.
+ *
+ * After the first call, subsequent calls to this function will forget all
+ * rates collected so far.
+ */
+void inotifytools_initialize_rates() {
+	niceassert(initialized, "inotifytools_initialize not called yet");
+
+	rbwalk(tree_wd, empty_rates, 0);
+	rbwalk(tree_aggregate, empty_rates, 0);
+	if (evicted_stats)
+		empty_rates(evicted_stats, leaf, 0, 0);
+	memset(&total_rates, 0, sizeof(total_rates));
+	for (int i = 0; i < RATE_EWMAS; ++i)
+		ewma_decay[i] = exp(-1.0 / (60 * ewma_minutes[i]));
+	rates_start = rates_now();
+	collect_rates = 1;
+}
+
 /**
  * Initialize or reset statistics.
  *
@@ -258,22 +808,15 @@ void inotifytools_initialize_stats() {
 	// if already collecting stats, reset stats
 	if (collect_stats) {
 		rbwalk(tree_wd, empty_stats, 0);
+		rbwalk(tree_aggregate, empty_stats, 0);
+		if (evicted_stats)
+			memset(evicted_stats->hit, 0,
+			       sizeof(evicted_stats->hit));
 	}
 
-	num_access = 0;
-	num_modify = 0;
-	num_attrib = 0;
-	num_close_nowrite = 0;
-	num_close_write = 0;
-	num_open = 0;
-	num_move_self = 0;
-	num_moved_from = 0;
-	num_moved_to = 0;
-	num_create = 0;
-	num_delete = 0;
-	num_delete_self = 0;
-	num_unmount = 0;
-	num_total = 0;
+	memset(num, 0, sizeof(num));
+	inotifytools_next_top_interval();
+	files_clear();
 
 	collect_stats = 1;
 }
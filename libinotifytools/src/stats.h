@@ -4,8 +4,38 @@
 #include "inotifytools/inotifytools.h"
 #include "inotifytools_p.h"
 
+// Events with a counter in watch::hit
+#define STAT_EVENTS (IN_ALL_EVENTS | IN_UNMOUNT)
+
+// Event rates over the last RATE_BUCKETS seconds, tens of seconds and
+// minutes, counted in one ring of buckets per resolution, and exponentially
+// weighted moving averages with 1, 5 and 15 minute time constants.
+#define RATE_RINGS 3
+#define RATE_BUCKETS 60
+#define RATE_EWMAS 3
+
+struct rate_ring {
+	// Bucket number (time / resolution) of the latest bucket
+	uint64_t last;
+	uint32_t buckets[RATE_BUCKETS];
+};
+
+struct rates {
+	struct rate_ring rings[RATE_RINGS];
+	double ewma[RATE_EWMAS];
+	// Second whose events are counted in pending but not yet in ewma
+	uint64_t second;
+	uint32_t pending;
+};
+
 extern int collect_stats;
-void record_stats( struct inotify_event const * event );
-unsigned int *stat_ptr(watch *w, int event);
-watch *watch_from_wd(int wd);
+extern int collect_rates;
+extern watch* evicted_stats;
+void record_stats(struct inotify_event const* event, watch* w);
+uint64_t* stat_ptr(watch* w, int event);
+watch *watch_from_wd(unsigned long wd);
+watch* aggregate_of(watch* w);
+void top_forget_watch(watch* w);
+int track_top_watches(int k, int event);
+int track_top_files(int counters, int event);
 #endif	// STATS_H
@@ -7,14 +7,19 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <regex.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 
+#include <thread>
+
 #ifdef HAVE_MCHECK_H
 #include <mcheck.h>
 #endif
@@ -54,6 +59,19 @@
 
 #define TEST_DIR "/tmp/inotifytools_test"
 
+// Private to the library, see inotifytools_p.h
+int inotifytools_set_fid_watch_limit(int limit);
+int inotifytools_track_top_watches(int k, int event);
+struct watch** inotifytools_top_watches(int* count);
+int inotifytools_track_top_files(int counters, int event);
+struct file_hits** inotifytools_top_files(int* count);
+void inotifytools_set_aggregate_depth(int depth);
+struct watch** inotifytools_watches_sorted_by_event(int sort_event,
+						   int k,
+						   int* count);
+int64_t inotifytools_get_stat_by_watch64(struct watch* w, int event);
+double inotifytools_get_rate_by_watch(struct watch* w, int window);
+
 #define INFO(...)                                    \
 	do {                                         \
 		printf("%s: ", __PRETTY_FUNCTION__); \
@@ -322,6 +340,981 @@ void watch_limit() {
 	EXIT
 }
 
+void cleanup();
+
+static void touch(char const* filename) {
+	int fd = creat(filename, 0700);
+	if (fd != -1)
+		close(fd);
+}
+
+#define NEXT_NAME()                                           \
+	do {                                                  \
+		event = inotifytools_next_event(1);           \
+		verify(event != 0);                           \
+		verify2(event->len > 0, "event has a name"); \
+	} while (0)
+
+void glob_filters() {
+	ENTER
+	struct inotify_event* event;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/build", 0700));
+	verify(0 == mkdir(TEST_DIR "/src", 0700));
+	verify(inotifytools_initialize());
+	verify(!inotifytools_ignore_events_by_glob("", 0, 1));
+	compare(inotifytools_error(), EINVAL);
+	verify(inotifytools_ignore_events_by_glob("build/", 0, 1));
+	verify(inotifytools_ignore_events_by_glob("*.[oa]", 0, 1));
+	verify(inotifytools_ignore_events_by_glob("!keep.o", 0, 1));
+	verify(inotifytools_watch_recursively(TEST_DIR, IN_CREATE));
+	compare(inotifytools_wd_from_filename(TEST_DIR "/build/"), -1);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/src/") > 0);
+
+	touch(TEST_DIR "/build/out.c");
+	touch(TEST_DIR "/src/a.o");
+	touch(TEST_DIR "/src/keep.o");
+	touch(TEST_DIR "/src/b.c");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "keep.o"), event->name);
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "b.c"), event->name);
+	verify(!inotifytools_next_event(1));
+
+	verify(inotifytools_ignore_events_by_glob(NULL, 0, 1));
+	verify(inotifytools_ignore_events_by_inverted_glob("*.c", FNM_CASEFOLD,
+							   1));
+	touch(TEST_DIR "/src/x.h");
+	verify(0 == mkdir(TEST_DIR "/src/sub", 0700));
+	touch(TEST_DIR "/src/Y.C");
+	// New directories are let through in recursive mode
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "sub"), event->name);
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "Y.C"), event->name);
+	verify(!inotifytools_next_event(1));
+	EXIT
+}
+
+void filter_cache() {
+	ENTER
+	struct inotify_event* event;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/a", 0700));
+	verify(0 == mkdir(TEST_DIR "/b", 0700));
+	verify(inotifytools_initialize());
+	verify(inotifytools_ignore_events_by_regex("/a/", REG_EXTENDED, 0));
+	verify(inotifytools_watch_file(TEST_DIR "/a", IN_CREATE));
+	verify(inotifytools_watch_file(TEST_DIR "/b", IN_CREATE));
+	int b = inotifytools_wd_from_filename(TEST_DIR "/b/");
+	verify(b > 0);
+
+	touch(TEST_DIR "/a/1");
+	touch(TEST_DIR "/b/1");
+	touch(TEST_DIR "/a/2");
+	NEXT_NAME();
+	compare(event->wd, b);
+	verify(!inotifytools_next_event(1));
+
+	// Renaming the watch must not keep the old verdict
+	verify(0 == rename(TEST_DIR "/a", TEST_DIR "/c"));
+	inotifytools_replace_filename(TEST_DIR "/a/", TEST_DIR "/c/");
+	touch(TEST_DIR "/c/3");
+	NEXT_NAME();
+	compare(event->wd, inotifytools_wd_from_filename(TEST_DIR "/c/"));
+	verify2(!strcmp(event->name, "3"), event->name);
+
+	// Nor must changing the filters
+	verify(inotifytools_ignore_events_by_regex(NULL, 0, 0));
+	verify(inotifytools_ignore_events_by_glob("c/", 0, 0));
+	verify(inotifytools_ignore_events_by_inverted_glob("*.txt", 0, 0));
+	touch(TEST_DIR "/c/4.txt");
+	touch(TEST_DIR "/b/4");
+	touch(TEST_DIR "/b/5.txt");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "5.txt"), event->name);
+	verify(!inotifytools_next_event(1));
+	EXIT
+}
+
+void watch_pruning() {
+	ENTER
+	struct inotify_event* event;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/keep", 0700));
+	verify(0 == mkdir(TEST_DIR "/skip", 0700));
+	verify(0 == mkdir(TEST_DIR "/skip/deep", 0700));
+	verify(0 == mkdir(TEST_DIR "/inc", 0700));
+	verify(0 == mkdir(TEST_DIR "/inc/src", 0700));
+	verify(inotifytools_initialize());
+	inotifytools_set_watch_pruning(1);
+
+	verify(inotifytools_ignore_events_by_regex("/skip/", REG_EXTENDED, 1));
+	verify(inotifytools_watch_recursively(TEST_DIR, IN_CREATE));
+	verify(inotifytools_wd_from_filename(TEST_DIR "/keep/") > 0);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/skip/"), -1);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/skip/deep/"), -1);
+	compare(inotifytools_get_num_watches(), 4);
+	cleanup();
+
+	// Only directories leading to an include pattern need watching
+	verify(0 == mkdir(TEST_DIR, 0700));
+	verify(0 == mkdir(TEST_DIR "/other", 0700));
+	verify(0 == mkdir(TEST_DIR "/inc", 0700));
+	verify(0 == mkdir(TEST_DIR "/inc/src", 0700));
+	verify(inotifytools_initialize());
+	inotifytools_set_watch_pruning(1);
+	verify(inotifytools_ignore_events_by_inverted_glob(
+	    TEST_DIR "/inc/src/*", 0, 1));
+	verify(inotifytools_watch_recursively(TEST_DIR, IN_CREATE | IN_ATTRIB));
+	compare(inotifytools_wd_from_filename(TEST_DIR "/other/"), -1);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/inc/") > 0);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/inc/src/") > 0);
+
+	touch(TEST_DIR "/inc/1");
+	verify(0 == chmod(TEST_DIR "/inc", 0755));
+	touch(TEST_DIR "/inc/src/2");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "2"), event->name);
+	verify(0 == mkdir(TEST_DIR "/new", 0700));
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "new"), event->name);
+	verify(!inotifytools_next_event(1));
+	EXIT
+}
+
+void snapshot() {
+	ENTER
+	struct inotify_event* event;
+	char const* exclude[] = {TEST_DIR "/tree/skip", NULL};
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/tree", 0700));
+	verify(0 == mkdir(TEST_DIR "/tree/a", 0700));
+	verify(0 == mkdir(TEST_DIR "/tree/a/b", 0700));
+	verify(0 == mkdir(TEST_DIR "/tree/c", 0700));
+	verify(0 == mkdir(TEST_DIR "/tree/skip", 0700));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_recursively_with_exclude(TEST_DIR "/tree",
+							   IN_CREATE, exclude));
+	compare(inotifytools_get_num_watches(), 4);
+	verify(inotifytools_save_snapshot(TEST_DIR "/snap"));
+	inotifytools_cleanup();
+
+	// Change the tree while it isn't watched
+	verify(0 == rmdir(TEST_DIR "/tree/c"));
+	verify(0 == mkdir(TEST_DIR "/tree/a/new", 0700));
+	verify(0 == mkdir(TEST_DIR "/tree/a/new/deep", 0700));
+	verify(0 == rename(TEST_DIR "/tree/a/b", TEST_DIR "/tree/moved"));
+	verify(0 == mkdir(TEST_DIR "/tree/a/b", 0700));
+	verify(0 == mkdir(TEST_DIR "/tree/a/b/x", 0700));
+
+	verify(inotifytools_initialize());
+	verify(inotifytools_load_snapshot(TEST_DIR "/snap", IN_CREATE, exclude));
+	verify(inotifytools_wd_from_filename(TEST_DIR "/tree/") > 0);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/tree/a/b/x/") > 0);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/tree/a/new/") > 0);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/tree/moved/") > 0);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/tree/c/"), -1);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/tree/skip/"), -1);
+	compare(inotifytools_get_num_watches(), 7);
+
+	touch(TEST_DIR "/tree/a/new/deep/1");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "1"), event->name);
+	compare(strcmp(inotifytools_filename_from_wd(event->wd),
+		       TEST_DIR "/tree/a/new/deep/"),
+		0);
+	verify(inotifytools_save_snapshot(TEST_DIR "/snap"));
+	inotifytools_cleanup();
+
+	// A directory replaced by a symlink isn't followed
+	verify(0 == rmdir(TEST_DIR "/tree/moved"));
+	verify(0 == symlink("a", TEST_DIR "/tree/moved"));
+	verify(inotifytools_initialize());
+	verify(inotifytools_load_snapshot(TEST_DIR "/snap", IN_CREATE, exclude));
+	compare(inotifytools_wd_from_filename(TEST_DIR "/tree/moved/"), -1);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/tree/moved/b/"), -1);
+	compare(inotifytools_get_num_watches(), 6);
+	inotifytools_cleanup();
+
+	verify(inotifytools_initialize());
+	verify(!inotifytools_load_snapshot(TEST_DIR "/none", IN_CREATE, NULL));
+	compare(inotifytools_error(), ENOENT);
+	touch(TEST_DIR "/empty");
+	verify(!inotifytools_load_snapshot(TEST_DIR "/empty", IN_CREATE, NULL));
+	compare(inotifytools_error(), EINVAL);
+	FILE* file = fopen(TEST_DIR "/junk", "w");
+	verify(file != NULL);
+	fputs("ITSNAP1\nnot a snapshot", file);
+	fclose(file);
+	verify(!inotifytools_load_snapshot(TEST_DIR "/junk", IN_CREATE, NULL));
+	compare(inotifytools_error(), EINVAL);
+	compare(inotifytools_get_num_watches(), 0);
+	EXIT
+}
+
+void lazy_watching() {
+	ENTER
+	struct inotify_event* event;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/a", 0700));
+	verify(0 == mkdir(TEST_DIR "/a/b", 0700));
+	verify(0 == mkdir(TEST_DIR "/a/b/c", 0700));
+	verify(0 == mkdir(TEST_DIR "/a/f", 0700));
+	verify(0 == mkdir(TEST_DIR "/d", 0700));
+	verify(0 == mkdir(TEST_DIR "/d/e", 0700));
+	verify(inotifytools_initialize());
+	verify(inotifytools_set_lazy_watching(1, 0));
+	verify(inotifytools_watch_recursively(TEST_DIR, IN_CREATE));
+	verify(inotifytools_wd_from_filename(TEST_DIR "/a/") > 0);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/a/b/"), -1);
+	compare(inotifytools_get_num_watches(), 3);
+
+	// Activity in a directory watches its subdirectories
+	touch(TEST_DIR "/a/1");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "1"), event->name);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/a/b/") > 0);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/a/f/") > 0);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/a/b/c/"), -1);
+	compare(inotifytools_get_num_watches(), 5);
+	touch(TEST_DIR "/a/b/2");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "2"), event->name);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/a/b/c/") > 0);
+	compare(inotifytools_get_num_watches(), 6);
+	inotifytools_cleanup();
+
+	// With a budget of one watch, each new one replaces the last
+	verify(inotifytools_initialize());
+	verify(inotifytools_set_lazy_watching(1, 1));
+	verify(inotifytools_watch_recursively(TEST_DIR, IN_CREATE));
+	touch(TEST_DIR "/d/3");
+	NEXT_NAME();
+	verify(inotifytools_wd_from_filename(TEST_DIR "/d/e/") > 0);
+	compare(inotifytools_get_num_watches(), 4);
+	touch(TEST_DIR "/a/4");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "4"), event->name);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/d/e/"), -1);
+	compare(inotifytools_get_num_watches(), 4);
+
+	// The evicted watches' IN_IGNORED are not returned, and activity
+	// watches them again
+	touch(TEST_DIR "/d/5");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "5"), event->name);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/d/e/") > 0);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/a/b/"), -1);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/a/f/"), -1);
+	compare(inotifytools_get_num_watches(), 4);
+	verify(!inotifytools_next_event(1));
+	EXIT
+}
+
+void watch_budget() {
+	ENTER
+	struct inotify_event* event;
+	struct inotifytools_watch_plan plan;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/a", 0700));
+	verify(0 == mkdir(TEST_DIR "/a/b", 0700));
+	verify(0 == mkdir(TEST_DIR "/a/b/c", 0700));
+	verify(0 == mkdir(TEST_DIR "/d", 0700));
+	verify(0 == mkdir(TEST_DIR "/d/e", 0700));
+	touch(TEST_DIR "/a/file");
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_recursively_within_budget(TEST_DIR, IN_CREATE,
+							    NULL, 0, &plan));
+	compare(plan.dirs, 6);
+	compare(plan.watched, 6);
+	compare(plan.lazy, 0);
+	compare(plan.limit_reached, 0);
+	compare(inotifytools_get_num_watches(), 6);
+	inotifytools_cleanup();
+
+	// The shallowest directories get the watches, and the others are
+	// watched once there are events in their parent
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_recursively_within_budget(TEST_DIR, IN_CREATE,
+							    NULL, 3, &plan));
+	compare(plan.budget, 3);
+	compare(plan.dirs, 6);
+	compare(plan.watched, 3);
+	compare(plan.lazy, 2);
+	compare(plan.limit_reached, 0);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/a/") > 0);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/d/") > 0);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/a/b/"), -1);
+	touch(TEST_DIR "/a/1");
+	NEXT_NAME();
+	verify2(!strcmp(event->name, "1"), event->name);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/a/b/") > 0);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/d/e/"), -1);
+	inotifytools_cleanup();
+
+	// Then the most recently modified
+	struct timespec old[2] = {{0, UTIME_OMIT}, {1000000000, 0}};
+	verify(0 == utimensat(AT_FDCWD, TEST_DIR "/a", old, 0));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_recursively_within_budget(TEST_DIR, IN_CREATE,
+							    NULL, 2, &plan));
+	compare(plan.watched, 2);
+	compare(inotifytools_wd_from_filename(TEST_DIR "/a/"), -1);
+	verify(inotifytools_wd_from_filename(TEST_DIR "/d/") > 0);
+	EXIT
+}
+
+void polling() {
+	ENTER
+	struct inotify_event* event;
+	int events = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+		     IN_CLOSE_WRITE | IN_DELETE_SELF;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/a", 0700));
+	touch(TEST_DIR "/a/old");
+	verify(inotifytools_initialize());
+	verify(inotifytools_set_polling(10, 0));
+	verify(inotifytools_poll_recursively(TEST_DIR, events, NULL));
+	int wd = inotifytools_wd_from_filename(TEST_DIR "/");
+	int subdir = inotifytools_wd_from_filename(TEST_DIR "/a/");
+	verify(wd > 0);
+	verify(subdir > 0);
+	compare(inotifytools_get_num_watches(), 2);
+	verify(!inotifytools_next_event_ms(100));
+
+	// New files are found by the next scan, as if written and closed
+	touch(TEST_DIR "/1");
+	NEXT_NAME();
+	compare(event->wd, wd);
+	compare(event->mask, IN_CREATE);
+	verify2(!strcmp(event->name, "1"), event->name);
+	NEXT_NAME();
+	compare(event->mask, IN_CLOSE_WRITE);
+
+	// Renames within a directory are paired by the inode
+	verify(0 == rename(TEST_DIR "/a/old", TEST_DIR "/a/new"));
+	NEXT_NAME();
+	compare(event->wd, subdir);
+	compare(event->mask, IN_MOVED_FROM);
+	verify2(!strcmp(event->name, "old"), event->name);
+	uint32_t cookie = event->cookie;
+	verify(cookie);
+	NEXT_NAME();
+	compare(event->mask, IN_MOVED_TO);
+	verify2(!strcmp(event->name, "new"), event->name);
+	compare(event->cookie, cookie);
+
+	// Removing a polled directory ends its watch
+	verify(0 == unlink(TEST_DIR "/a/new"));
+	NEXT_NAME();
+	compare(event->mask, IN_DELETE);
+	verify(0 == rmdir(TEST_DIR "/a"));
+	// The directory and its parent may be scanned in either order
+	uint32_t masks[2] = {0, 0};
+	for (int i = 0; i < 3; ++i) {
+		event = inotifytools_next_event(1);
+		verify(event != 0);
+		verify(event->wd == wd || event->wd == subdir);
+		masks[event->wd == subdir] |= event->mask;
+	}
+	compare(masks[0], IN_DELETE | IN_ISDIR);
+	compare(masks[1], IN_DELETE_SELF | IN_IGNORED);
+
+	// Directories watched in a polled directory are polled too
+	verify(0 == mkdir(TEST_DIR "/b", 0700));
+	NEXT_NAME();
+	compare(event->mask, IN_CREATE | IN_ISDIR);
+	verify(inotifytools_watch_recursively(TEST_DIR "/b", events));
+	int b = inotifytools_wd_from_filename(TEST_DIR "/b/");
+	verify(b > 0);
+	touch(TEST_DIR "/b/2");
+	NEXT_NAME();
+	compare(event->wd, b);
+	compare(event->mask, IN_CREATE);
+	NEXT_NAME();
+	compare(event->mask, IN_CLOSE_WRITE);
+
+	// Removing the watch gives IN_IGNORED, as with inotify
+	verify(inotifytools_remove_watch_by_wd(b));
+	event = inotifytools_next_event(1);
+	verify(event != 0);
+	compare(event->wd, b);
+	compare(event->mask, IN_IGNORED);
+	touch(TEST_DIR "/b/3");
+	verify(!inotifytools_next_event_ms(100));
+	inotifytools_cleanup();
+
+	verify(inotifytools_initialize());
+	verify(!inotifytools_set_polling(-1, 0));
+	compare(inotifytools_error(), EINVAL);
+	EXIT
+}
+
+void fid_watch_limit() {
+	ENTER
+	char fn[64];
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	for (int i = 0; i < 4; ++i) {
+		snprintf(fn, sizeof(fn), TEST_DIR "/%d", i);
+		verify(0 == mkdir(fn, 0700));
+	}
+	// Filesystem marks need privileges
+	if (!inotifytools_init(1, 1, 0)) {
+		EXIT
+		return;
+	}
+	verify(inotifytools_set_fid_watch_limit(4));
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE));
+	int base = inotifytools_get_num_watches();
+	for (int i = 0; i < 4; ++i) {
+		snprintf(fn, sizeof(fn), TEST_DIR "/%d/file", i);
+		touch(fn);
+	}
+	while (inotifytools_next_event(1))
+		;
+	int num = inotifytools_get_num_watches();
+	verify2(num - base > 2, "a watch for each directory");
+	verify(num - base <= 4);
+
+	// Lowering the limit drops the watches over it
+	verify(inotifytools_set_fid_watch_limit(2));
+	verify(inotifytools_get_num_watches() - base <= 2);
+
+	// Lifting it keeps those there are
+	num = inotifytools_get_num_watches();
+	verify(inotifytools_set_fid_watch_limit(0));
+	compare(inotifytools_get_num_watches(), num);
+	verify(inotifytools_set_fid_watch_limit(1));
+	verify(inotifytools_set_fid_watch_limit(0));
+	EXIT
+}
+
+void top_watches() {
+	ENTER
+	char fn[64];
+	struct watch** top;
+	int count;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/a", 0700));
+	verify(0 == mkdir(TEST_DIR "/b", 0700));
+	verify(0 == mkdir(TEST_DIR "/c", 0700));
+	verify(inotifytools_initialize());
+	inotifytools_initialize_stats();
+	verify(inotifytools_track_top_watches(2, IN_CREATE));
+	verify(inotifytools_watch_recursively(TEST_DIR, IN_CREATE));
+	char const* dirs[] = {"a", "b", "b", "c", "c", "c"};
+	for (int i = 0; i < 6; ++i) {
+		snprintf(fn, sizeof(fn), TEST_DIR "/%s/%d", dirs[i], i);
+		touch(fn);
+	}
+	while (inotifytools_next_event(1))
+		;
+	top = inotifytools_top_watches(&count);
+	compare(count, 2);
+	verify(!strcmp(inotifytools_filename_from_watch(top[0]),
+		       TEST_DIR "/c/"));
+
+	// Getting the top watches must leave the least of them to be replaced
+	for (int i = 0; i < 4; ++i) {
+		snprintf(fn, sizeof(fn), TEST_DIR "/a/x%d", i);
+		touch(fn);
+	}
+	while (inotifytools_next_event(1))
+		;
+	top = inotifytools_top_watches(&count);
+	compare(count, 2);
+	verify(!strcmp(inotifytools_filename_from_watch(top[0]),
+		       TEST_DIR "/a/"));
+	verify(!strcmp(inotifytools_filename_from_watch(top[1]),
+		       TEST_DIR "/c/"));
+	EXIT
+}
+
+void top_files_reset() {
+	ENTER
+	int count;
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	inotifytools_initialize_stats();
+	verify(inotifytools_track_top_files(4, IN_CREATE));
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE));
+	touch(TEST_DIR "/a");
+	touch(TEST_DIR "/b");
+	while (inotifytools_next_event(1))
+		;
+	inotifytools_top_files(&count);
+	compare(count, 2);
+
+	// The files are counted afresh with the other statistics
+	inotifytools_initialize_stats();
+	inotifytools_top_files(&count);
+	compare(count, 0);
+	touch(TEST_DIR "/c");
+	while (inotifytools_next_event(1))
+		;
+	inotifytools_top_files(&count);
+	compare(count, 1);
+	EXIT
+}
+
+void filter_stages() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_ignore_events_by_regex("junk", REG_EXTENDED, 0));
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE));
+
+	int regex_stage = -1;
+	for (int i = 0; i < inotifytools_get_num_filter_stages(); ++i) {
+		if (!strcmp(inotifytools_get_filter_stage_name(i), "regex"))
+			regex_stage = i;
+	}
+	verify(regex_stage >= 0);
+	compare(inotifytools_get_filter_stage_dropped(regex_stage), 0);
+	verify(!inotifytools_get_filter_stage_name(-1));
+
+	// Rejected events must not restart the timeout
+	pid_t child = fork();
+	verify(child >= 0);
+	if (!child) {
+		char fn[64];
+		for (int i = 0; i < 15; ++i) {
+			snprintf(fn, sizeof(fn), TEST_DIR "/junk%d", i);
+			touch(fn);
+			usleep(200000);
+		}
+		_exit(0);
+	}
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	verify(!inotifytools_next_event(1));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	verify(end.tv_sec - begin.tv_sec < 2);
+	verify(waitpid(child, 0, 0) == child);
+	verify(inotifytools_get_filter_stage_dropped(regex_stage) > 0);
+	EXIT
+}
+
+static int drop_x(struct inotify_event* event, struct watch* w, void* data) {
+	++*(int*)data;
+	return !w || event->len == 0 || event->name[0] != 'x';
+}
+
+static void collect_names(struct inotify_event* event,
+			  struct watch* w,
+			  void* data) {
+	char* names = (char*)data;
+	if (w && !strcmp(inotifytools_filename_from_watch(w), TEST_DIR "/"))
+		strcat(names, event->name);
+}
+
+void user_filters() {
+	ENTER
+	char names[64] = "";
+	int filtered = 0;
+
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE));
+	compare(inotifytools_process_events(0), -1);
+	compare(inotifytools_error(), EINVAL);
+	verify(!inotifytools_add_filter(NULL, NULL));
+	verify(inotifytools_add_filter(drop_x, &filtered));
+	inotifytools_set_handler(collect_names, names);
+	verify(!strcmp(inotifytools_get_filter_stage_name(
+			   inotifytools_get_num_filter_stages() - 1),
+		       "user"));
+
+	compare(inotifytools_process_events(0), 0);
+	touch(TEST_DIR "/a");
+	touch(TEST_DIR "/x");
+	touch(TEST_DIR "/b");
+	compare(inotifytools_process_events(1), 2);
+	verify2(!strcmp(names, "ab"), names);
+	compare(filtered, 3);
+	compare(inotifytools_get_filter_stage_dropped(
+		    inotifytools_get_num_filter_stages() - 1),
+		1);
+	EXIT
+}
+
+void stats() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE | IN_CLOSE_WRITE));
+	int wd = inotifytools_wd_from_filename(TEST_DIR "/");
+	verify(wd > 0);
+	compare(inotifytools_get_stat_total(0), -1);
+	inotifytools_initialize_stats();
+
+	touch(TEST_DIR "/a");
+	touch(TEST_DIR "/b");
+	while (inotifytools_next_events(0, 1))
+		;
+	compare(inotifytools_get_stat_total(0), 4);
+	compare(inotifytools_get_stat_total(IN_CREATE), 2);
+	compare(inotifytools_get_stat_total(IN_CLOSE_WRITE), 2);
+	compare(inotifytools_get_stat_total(IN_DELETE), 0);
+	compare(inotifytools_get_stat_total(IN_CREATE | IN_DELETE), -1);
+	compare(inotifytools_get_stat_by_wd(wd, IN_CREATE), 2);
+	compare(inotifytools_get_stat_by_filename(TEST_DIR "/", 0), 4);
+	verify(inotifytools_get_stat_total64(0) == 4);
+	verify(inotifytools_get_stat_by_wd64(wd, IN_CLOSE_WRITE) == 2);
+	verify(inotifytools_get_stat_by_filename64(TEST_DIR "/", 0) == 4);
+	verify(inotifytools_get_stat_by_wd64(wd + 1, 0) == -1);
+
+	inotifytools_initialize_stats();
+	compare(inotifytools_get_stat_total(0), 0);
+	compare(inotifytools_get_stat_by_wd(wd, 0), 0);
+	EXIT
+}
+
+void rates() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE));
+	int wd = inotifytools_wd_from_filename(TEST_DIR "/");
+	verify(inotifytools_get_rate_total(60) == -1);
+	inotifytools_initialize_stats();
+	inotifytools_initialize_rates();
+	verify(inotifytools_get_rate_total(0) == -1);
+	verify(inotifytools_get_rate_total(3601) == -1);
+	verify(inotifytools_get_rate_ewma_total(2) == -1);
+	verify(inotifytools_get_rate_by_wd(wd + 1, 60) == -1);
+	verify(inotifytools_get_rate_by_wd(wd, 60) == 0);
+
+	touch(TEST_DIR "/a");
+	touch(TEST_DIR "/b");
+	while (inotifytools_next_events(0, 1))
+		;
+	// Rates don't count the current second
+	sleep(1);
+	verify(inotifytools_get_rate_total(60) > 0);
+	verify(inotifytools_get_rate_total(60) <= 2);
+	verify(inotifytools_get_rate_by_wd(wd, 10) > 0);
+	verify(inotifytools_get_rate_ewma_total(1) > 0);
+	verify(inotifytools_get_rate_ewma_by_wd(wd, 15) > 0);
+	verify(inotifytools_get_rate_ewma_by_wd(wd, 15) <
+	       inotifytools_get_rate_ewma_by_wd(wd, 1));
+
+	inotifytools_initialize_rates();
+	verify(inotifytools_get_rate_by_wd(wd, 60) == 0);
+	verify(inotifytools_get_rate_ewma_total(5) == 0);
+	EXIT
+}
+
+// The directory statistics were rolled up to, or NULL
+static struct watch* aggregate_watch(char const* filename) {
+	int count;
+	struct watch** watches =
+	    inotifytools_watches_sorted_by_event(0, 0, &count);
+	for (int i = 0; i < count; ++i) {
+		if (!strcmp(inotifytools_filename_from_watch(watches[i]),
+			    filename))
+			return watches[i];
+	}
+	return NULL;
+}
+
+void aggregate_reset() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/p", 0700));
+	verify(0 == mkdir(TEST_DIR "/p/x", 0700));
+	verify(inotifytools_initialize());
+	inotifytools_set_aggregate_depth(1);
+	inotifytools_initialize_stats();
+	inotifytools_initialize_rates();
+	verify(inotifytools_watch_recursively(TEST_DIR, IN_CREATE));
+	touch(TEST_DIR "/p/1");
+	touch(TEST_DIR "/p/x/1");
+	while (inotifytools_next_events(0, 1))
+		;
+	struct watch* p = aggregate_watch(TEST_DIR "/p/");
+	verify(p != NULL);
+	verify(inotifytools_get_stat_by_watch64(p, IN_CREATE) == 2);
+	// Rates don't count the current second
+	sleep(1);
+	verify(inotifytools_get_rate_by_watch(p, 10) > 0);
+
+	// Rolled up statistics are reset with the others
+	inotifytools_initialize_stats();
+	inotifytools_initialize_rates();
+	verify(inotifytools_get_stat_by_watch64(p, IN_CREATE) == 0);
+	verify(inotifytools_get_rate_by_watch(p, 10) == 0);
+	EXIT
+}
+
+void aggregate_parents() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(0 == mkdir(TEST_DIR "/p", 0700));
+	verify(0 == mkdir(TEST_DIR "/p/x", 0700));
+	verify(0 == mkdir(TEST_DIR "/p/x/y", 0700));
+	verify(inotifytools_initialize());
+	inotifytools_set_aggregate_depth(1);
+	inotifytools_initialize_stats();
+	// Watches added above and between others take them over, and hand
+	// them back when removed
+	verify(inotifytools_watch_file(TEST_DIR "/p/x/y", IN_CREATE));
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE));
+	verify(inotifytools_watch_file(TEST_DIR "/p/x", IN_CREATE));
+	verify(inotifytools_remove_watch_by_filename(TEST_DIR "/p/x/"));
+	touch(TEST_DIR "/p/x/y/1");
+	while (inotifytools_next_events(0, 1))
+		;
+	struct watch* p = aggregate_watch(TEST_DIR "/p/");
+	verify(p != NULL);
+	verify(inotifytools_get_stat_by_watch64(p, IN_CREATE) == 1);
+	EXIT
+}
+
+void queue() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE | IN_CLOSE_WRITE));
+	verify(inotifytools_queue_new(0, 1) == NULL);
+	verify(inotifytools_queue_new(1, 0) == NULL);
+	struct inotifytools_queue* queue = inotifytools_queue_new(2, 2);
+	verify(queue != NULL);
+	verify(!inotifytools_queue_get_event_time(queue, 0, NULL, NULL));
+
+	touch(TEST_DIR "/a");
+	touch(TEST_DIR "/b");
+	// Only as many events as fit are read
+	compare(inotifytools_queue_fill(queue, 0), 2);
+	struct inotify_event* event = inotifytools_queue_pop(queue, 0);
+	verify(event != NULL);
+	compare(event->mask, IN_CREATE);
+	verify(event->len && !strcmp(event->name, "a"));
+	verify(inotifytools_queue_pop(queue, 1) != NULL);
+	verify(inotifytools_queue_pop(queue, 0) == NULL);
+	// Consumers get the time their events were read, not the time of the
+	// last event read
+	struct timespec read_at, taken_at;
+	verify(inotifytools_get_event_time(&read_at, NULL));
+	verify(inotifytools_queue_get_event_time(queue, 0, &taken_at, NULL));
+	verify(taken_at.tv_sec == read_at.tv_sec &&
+	       taken_at.tv_nsec == read_at.tv_nsec);
+
+	compare(inotifytools_queue_fill(queue, 0), 2);
+	int taken[2] = {0, 0};
+	std::thread consumers[2];
+	for (int i = 0; i < 2; ++i) {
+		consumers[i] = std::thread([queue, &taken, i] {
+			while (inotifytools_queue_pop(queue, i))
+				++taken[i];
+		});
+	}
+	for (int i = 0; i < 2; ++i)
+		consumers[i].join();
+	compare(taken[0] + taken[1], 2);
+
+	compare(inotifytools_queue_fill(queue, 0), 0);
+	verify(!inotifytools_queue_finished(queue));
+	inotifytools_queue_close(queue);
+	verify(inotifytools_queue_finished(queue));
+	verify(inotifytools_queue_get_stat(queue, -1, 0) == 4);
+	verify(inotifytools_queue_get_stat(queue, -1, IN_CLOSE_WRITE) == 2);
+	verify(inotifytools_queue_get_stat(queue, 0, 0) +
+		   inotifytools_queue_get_stat(queue, 1, 0) ==
+	       4);
+	verify(inotifytools_queue_get_stat(queue, 2, 0) == -1);
+	verify(inotifytools_queue_get_stat(queue, 0, IN_CREATE | IN_MODIFY) ==
+	       -1);
+	inotifytools_queue_free(queue);
+	EXIT
+}
+
+void coalescing() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(
+	    TEST_DIR, IN_CREATE | IN_CLOSE_WRITE | IN_MOVE));
+	verify(!inotifytools_set_coalescing(-1));
+	compare(inotifytools_error(), EINVAL);
+	verify(inotifytools_set_coalescing(200));
+
+	touch(TEST_DIR "/a");
+	touch(TEST_DIR "/b");
+	touch(TEST_DIR "/a");
+	// Nothing is returned before the window is over
+	verify(!inotifytools_next_event_ms(50));
+	struct inotify_event* event = inotifytools_next_event_ms(1000);
+	verify(event != NULL);
+	compare(event->mask, IN_CREATE | IN_CLOSE_WRITE);
+	verify2(event->len && !strcmp(event->name, "a"), event->name);
+	event = inotifytools_next_event_ms(0);
+	verify(event != NULL);
+	verify2(event->len && !strcmp(event->name, "b"), event->name);
+	verify(!inotifytools_next_event_ms(300));
+
+	// A move goes after the pending events on its watch
+	touch(TEST_DIR "/c");
+	verify(0 == rename(TEST_DIR "/c", TEST_DIR "/d"));
+	event = inotifytools_next_event_ms(0);
+	verify(event != NULL);
+	compare(event->mask, IN_CREATE | IN_CLOSE_WRITE);
+	verify2(event->len && !strcmp(event->name, "c"), event->name);
+	event = inotifytools_next_event_ms(0);
+	verify(event != NULL);
+	compare(event->mask, IN_MOVED_FROM);
+	event = inotifytools_next_event_ms(0);
+	verify(event != NULL);
+	compare(event->mask, IN_MOVED_TO);
+
+	// Pending events are still returned after coalescing is turned off
+	touch(TEST_DIR "/e");
+	verify(inotifytools_next_event_ms(50) == NULL);
+	verify(inotifytools_set_coalescing(0));
+	event = inotifytools_next_event_ms(1000);
+	verify(event != NULL);
+	compare(event->mask, IN_CREATE | IN_CLOSE_WRITE);
+	touch(TEST_DIR "/e");
+	event = inotifytools_next_event_ms(1000);
+	verify(event != NULL);
+	compare(event->mask, IN_CLOSE_WRITE);
+	EXIT
+}
+
+void event_times() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE | IN_CLOSE_WRITE));
+
+	struct timespec before, after, realtime, monotonic;
+	verify(!inotifytools_get_event_time(&realtime, &monotonic));
+	clock_gettime(CLOCK_REALTIME, &before);
+	touch(TEST_DIR "/a");
+	struct inotify_event* event = inotifytools_next_events(1, 2);
+	clock_gettime(CLOCK_REALTIME, &after);
+	verify(event != NULL);
+	verify(inotifytools_get_event_time(&realtime, &monotonic));
+	int64_t ns = realtime.tv_sec * 1000000000LL + realtime.tv_nsec;
+	verify(ns >= before.tv_sec * 1000000000LL + before.tv_nsec);
+	verify(ns <= after.tv_sec * 1000000000LL + after.tv_nsec);
+	verify(monotonic.tv_sec || monotonic.tv_nsec);
+
+	struct nstring out;
+	char expect[64];
+	inotifytools_snprintf(&out, MAX_STRLEN, event, "%N %U %M");
+	out.buf[out.len] = '\0';
+	snprintf(expect, sizeof(expect), "%lld %lld %lld", (long long)ns,
+		 (long long)ns / 1000, (long long)ns / 1000000);
+	verify2(!strcmp(out.buf, expect), out.buf);
+
+	// Events read together have the same time
+	event = inotifytools_next_events(1, 2);
+	verify(event != NULL);
+	compare(event->mask, IN_CLOSE_WRITE);
+	verify(inotifytools_get_event_time(&realtime, NULL));
+	verify(realtime.tv_sec * 1000000000LL + realtime.tv_nsec == ns);
+
+	// %T is the time the event was read, in the format set last
+	inotifytools_set_printf_timefmt("%s");
+	inotifytools_snprintf(&out, MAX_STRLEN, event, "%T");
+	out.buf[out.len] = '\0';
+	snprintf(expect, sizeof(expect), "%lld", (long long)realtime.tv_sec);
+	verify2(!strcmp(out.buf, expect), out.buf);
+	inotifytools_set_printf_timefmt("at %s");
+	inotifytools_snprintf(&out, MAX_STRLEN, event, "%T");
+	out.buf[out.len] = '\0';
+	snprintf(expect, sizeof(expect), "at %lld",
+		 (long long)realtime.tv_sec);
+	verify2(!strcmp(out.buf, expect), out.buf);
+
+	// %Xe still separates events with X
+	inotifytools_snprintf(&out, MAX_STRLEN, event, "%Ne");
+	out.buf[out.len] = '\0';
+	verify2(!strcmp(out.buf, "CLOSE_WRITENCLOSE"), out.buf);
+	EXIT
+}
+
+void cleanup_discards_events() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE | IN_CLOSE_WRITE));
+	touch(TEST_DIR "/a");
+	struct inotify_event* event = inotifytools_next_events(1, 2);
+	verify(event != NULL);
+	compare(event->mask, IN_CREATE);
+
+	// The events read but not returned go with the old descriptor
+	inotifytools_cleanup();
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE | IN_CLOSE_WRITE));
+	verify(inotifytools_next_event_ms(0) == NULL);
+	EXIT
+}
+
+void perf_counters() {
+	ENTER
+	verify((0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno));
+	verify(inotifytools_initialize());
+	verify(inotifytools_watch_file(TEST_DIR, IN_CREATE | IN_CLOSE_WRITE));
+	verify(inotifytools_ignore_events_by_regex("skip", 0, 0));
+
+	struct inotifytools_perf_counters perf;
+	inotifytools_get_perf_counters(&perf);
+	compare(perf.reads, 0);
+	verify(perf.since.tv_sec || perf.since.tv_nsec);
+
+	touch(TEST_DIR "/skip");
+	touch(TEST_DIR "/a");
+	struct inotify_event* event = inotifytools_next_events(1, 1);
+	verify(event != NULL);
+	verify2(event->len && !strcmp(event->name, "a"), event->name);
+	inotifytools_get_perf_counters(&perf);
+	verify(perf.reads >= 1);
+	verify(perf.bytes_read >= 3 * sizeof(struct inotify_event));
+	compare(perf.events_read, 3);
+	compare(perf.events_rejected, 2);
+	compare(perf.fid_syscalls, 0);
+	// Not timed unless asked
+	compare(perf.wait_ns, 0);
+	compare(perf.filter_ns, 0);
+	event = inotifytools_next_events(1, 1);
+	verify(event != NULL);
+	compare(event->mask, IN_CLOSE_WRITE);
+
+	inotifytools_set_perf_timers(1);
+	touch(TEST_DIR "/b");
+	event = inotifytools_next_events(1, 1);
+	verify(event != NULL);
+	FILE* devnull = fopen("/dev/null", "w");
+	verify(devnull != NULL);
+	verify(inotifytools_fprintf(devnull, event, "%f\n") != -1);
+	fclose(devnull);
+	inotifytools_get_perf_counters(&perf);
+	compare(perf.events_formatted, 1);
+	compare(perf.bytes_written, 2);
+	verify(perf.wait_ns > 0);
+	verify(perf.read_ns > 0);
+	verify(perf.format_ns > 0);
+
+	inotifytools_reset_perf_counters();
+	inotifytools_get_perf_counters(&perf);
+	compare(perf.events_read, 0);
+	compare(perf.format_ns, 0);
+	EXIT
+}
+
 void cleanup() {
 	compare(system("rm -rf " TEST_DIR), 0);
 	inotifytools_cleanup();
@@ -364,6 +1357,69 @@ int main() {
 	tst_inotifytools_snprintf();
 	cleanup();
 
+	glob_filters();
+	cleanup();
+
+	filter_cache();
+	cleanup();
+
+	watch_pruning();
+	cleanup();
+
+	snapshot();
+	cleanup();
+
+	lazy_watching();
+	cleanup();
+
+	watch_budget();
+	cleanup();
+
+	polling();
+	cleanup();
+
+	fid_watch_limit();
+	cleanup();
+
+	top_watches();
+	cleanup();
+
+	top_files_reset();
+	cleanup();
+
+	filter_stages();
+	cleanup();
+
+	user_filters();
+	cleanup();
+
+	stats();
+	cleanup();
+
+	rates();
+	cleanup();
+
+	aggregate_reset();
+	cleanup();
+
+	aggregate_parents();
+	cleanup();
+
+	queue();
+	cleanup();
+
+	coalescing();
+	cleanup();
+
+	event_times();
+	cleanup();
+
+	cleanup_discards_events();
+	cleanup();
+
+	perf_counters();
+	cleanup();
+
 	printf("Out of %d tests, %d succeeded and %d failed.\n",
 	       tests_failed + tests_succeeded, tests_succeeded, tests_failed);
 
@@ -6,10 +6,12 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 
 #include <inotifytools/inotifytools.h>
@@ -71,6 +73,73 @@ FileList::~FileList() {
 	free(exclude_files_);
 }
 
+GlobFilterList::GlobFilterList()
+    : kinds_(0), args_(0), count_(0), has_include_(false) {}
+
+GlobFilterList::~GlobFilterList() {
+	free(kinds_);
+	free(args_);
+}
+
+bool GlobFilterList::add(Kind kind, char const* arg) {
+	auto kinds = (Kind*)realloc(kinds_, sizeof(Kind) * (count_ + 1));
+	if (kinds)
+		kinds_ = kinds;
+	auto args = kinds ? (char const**)realloc(args_, sizeof(char*) *
+							     (count_ + 1))
+			  : NULL;
+	if (!args) {
+		fprintf(stderr, "Couldn't add pattern %s: %s\n", arg,
+			strerror(ENOMEM));
+		return false;
+	}
+	args_ = args;
+
+	kinds_[count_] = kind;
+	args_[count_] = arg;
+	++count_;
+	if (kind == INCLUDE)
+		has_include_ = true;
+	return true;
+}
+
+bool GlobFilterList::apply(int recursive) const {
+	for (int i = 0; i < count_; ++i) {
+		switch (kinds_[i]) {
+			case EXCLUDE:
+				if (!inotifytools_ignore_events_by_glob(
+					args_[i], 0, recursive)) {
+					fprintf(stderr,
+						"Invalid `exclude-glob' "
+						"pattern: %s\n",
+						args_[i]);
+					return false;
+				}
+				break;
+			case INCLUDE:
+				if (!inotifytools_ignore_events_by_inverted_glob(
+					args_[i], 0, recursive)) {
+					fprintf(stderr,
+						"Invalid `include-glob' "
+						"pattern: %s\n",
+						args_[i]);
+					return false;
+				}
+				break;
+			case FROM_FILE:
+				if (!inotifytools_ignore_events_from_file(
+					args_[i], recursive)) {
+					fprintf(stderr, "Couldn't read %s: %s\n",
+						args_[i],
+						strerror(inotifytools_error()));
+					return false;
+				}
+				break;
+		}
+	}
+	return true;
+}
+
 struct file {
 	FILE* file_;
 	bool is_stdin;
@@ -224,6 +293,46 @@ void warn_inotify_init_error(int fanotify) {
 	}
 }
 
+void output_error(bool syslog, const char* fmt, ...) {
+	va_list va;
+	va_start(va, fmt);
+	if (syslog) {
+		vsyslog(LOG_INFO, fmt, va);
+	} else {
+		vfprintf(stderr, fmt, va);
+	}
+	va_end(va);
+}
+
+void warn_watch_limit(bool syslog,
+		      int fanotify,
+		      char const* path,
+		      struct inotifytools_watch_plan const* plan) {
+	const char* backend = fanotify ? "fanotify" : "inotify";
+	const char* resource = fanotify ? "marks" : "watches";
+
+	if (!plan) {
+		output_error(syslog,
+			     "Failed to watch %s; upper limit on %s %s "
+			     "reached!\n",
+			     path, backend, resource);
+	} else {
+		output_error(syslog,
+			     "Watching %d of %d directories in %s; upper "
+			     "limit on %s %s reached!\n",
+			     plan->watched, plan->dirs, path, backend,
+			     resource);
+		if (plan->lazy)
+			output_error(syslog,
+				     "The others are watched once there are "
+				     "events in their parent.\n");
+	}
+	output_error(syslog,
+		     "Please increase the amount of %s %s allowed per user "
+		     "via `/proc/sys/fs/%s/max_user_%s'.\n",
+		     backend, resource, backend, resource);
+}
+
 bool is_timeout_option_valid(long* timeout, char* o) {
 	if ((o == NULL) || (*o == '\0')) {
 		fprintf(stderr,
@@ -254,3 +363,31 @@ bool is_timeout_option_valid(long* timeout, char* o) {
 
 	return true;
 }
+
+bool parse_duration(long* ms, char const* o) {
+	char* end = NULL;
+	errno = 0;
+	double value = (o && *o) ? strtod(o, &end) : -1;
+	double scale = 1000;
+	if (end && !strcmp(end, "ms"))
+		scale = 1;
+	else if (end && !strcmp(end, "m"))
+		scale = 60 * 1000;
+	else if (end && !strcmp(end, "h"))
+		scale = 60 * 60 * 1000;
+	else if (end && *end && strcmp(end, "s"))
+		end = NULL;
+
+	if (!end || errno || !(value > 0) || value * scale > LONG_MAX) {
+		fprintf(stderr,
+			"'%s' is not a valid duration.\n"
+			"Please specify a positive number, optionally followed "
+			"by ms, s, m or h.\n",
+			o ? o : "");
+		return false;
+	}
+	*ms = value * scale;
+	if (!*ms)
+		*ms = 1;
+	return true;
+}
@@ -24,6 +24,22 @@ struct FileList {
 	~FileList();
 };
 
+// Glob filters in the order they were given on the command line, since later
+// patterns take precedence over earlier ones.
+struct GlobFilterList {
+	enum Kind { EXCLUDE, INCLUDE, FROM_FILE };
+
+	Kind* kinds_;
+	char const** args_;
+	int count_;
+	bool has_include_;
+
+	GlobFilterList();
+	~GlobFilterList();
+	bool add(Kind kind, char const* arg);
+	bool apply(int recursive) const;
+};
+
 void construct_path_list(int argc,
 			 char** argv,
 			 char const* filename,
@@ -31,6 +47,23 @@ void construct_path_list(int argc,
 
 void warn_inotify_init_error(int fanotify);
 
+// Print to syslog if @a syslog is set, to stderr otherwise.
+void output_error(bool syslog, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+struct inotifytools_watch_plan;
+
+// Warn that @a path ran into the limit on watches: that it couldn't be
+// watched when @a plan is NULL, or which part of it is watched.
+void warn_watch_limit(bool syslog,
+		      int fanotify,
+		      char const* path,
+		      struct inotifytools_watch_plan const* plan);
+
 bool is_timeout_option_valid(long* timeout, char* o);
 
+// Parse a duration such as "2", "1.5s", "500ms", "5m" or "1h" into
+// milliseconds.  A number without a unit is in seconds.
+bool parse_duration(long* ms, char const* o);
+
 #endif
@@ -0,0 +1,368 @@
+#include "exec.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <inotifytools/inotifytools.h>
+
+extern char** environ;
+
+// Files waiting for their command at most; events block until there is room
+#define EXEC_QUEUE_MAX 1024
+
+// Total length of the files appended to one command with "{}+", well below
+// ARG_MAX like find(1) and xargs(1)
+#define EXEC_BATCH_BYTES (128 * 1024)
+
+// Longest wait for events while commands are running, in case SIGCHLD came
+// just before the wait began and did not interrupt it
+#define EXEC_POLL_MS 100
+
+static uint32_t hash_path(char const* path) {
+	uint32_t hash = 2166136261u;
+	for (; *path; ++path)
+		hash = (hash ^ (unsigned char)*path) * 16777619u;
+	return hash;
+}
+
+// Interrupts the wait for events so that finished commands are reaped and
+// the next ones started.
+static void child_exited(int) {}
+
+ExecPool::ExecPool()
+    : buf_(0),
+      words_(0),
+      num_words_(0),
+      batch_(false),
+      jobs_(0),
+      max_jobs_(0),
+      num_running_(0),
+      queue_(0),
+      queue_hashes_(0),
+      queue_len_(0),
+      on_signal_(0) {}
+
+ExecPool::~ExecPool() {
+	for (int i = 0; i < max_jobs_; ++i) {
+		for (int j = 0; j < jobs_[i].num_paths_; ++j)
+			free(jobs_[i].paths_[j]);
+		free(jobs_[i].paths_);
+		free(jobs_[i].hashes_);
+	}
+	free(jobs_);
+	for (int i = 0; i < queue_len_; ++i)
+		free(queue_[i]);
+	free(queue_);
+	free(queue_hashes_);
+	free(words_);
+	free(buf_);
+}
+
+// Split the command into words like a shell would, but without expansions:
+// words are separated by blanks, and quotes and backslashes protect them.
+bool ExecPool::parse(char const* command) {
+	size_t len = strlen(command);
+	buf_ = (char*)malloc(2 * len + 2);
+	words_ = (char**)calloc(len / 2 + 2, sizeof(char*));
+	if (!buf_ || !words_) {
+		fprintf(stderr, "Out of memory.\n");
+		return false;
+	}
+
+	char* out = buf_;
+	char const* p = command;
+	for (;;) {
+		while (isspace((unsigned char)*p))
+			++p;
+		if (!*p)
+			break;
+		words_[num_words_++] = out;
+		char quote = 0;
+		for (; *p && (quote || !isspace((unsigned char)*p)); ++p) {
+			if (quote && *p == quote)
+				quote = 0;
+			else if (!quote && (*p == '\'' || *p == '"'))
+				quote = *p;
+			else if (*p == '\\' && quote != '\'' && p[1])
+				*out++ = *++p;
+			else
+				*out++ = *p;
+		}
+		if (quote) {
+			fprintf(stderr,
+				"Unterminated quote in --exec command.\n");
+			return false;
+		}
+		*out++ = '\0';
+	}
+
+	if (!num_words_) {
+		fprintf(stderr, "--exec command is empty.\n");
+		return false;
+	}
+	batch_ = !strcmp(words_[num_words_ - 1], "{}+");
+	for (int i = 0; i < num_words_ - 1; ++i) {
+		if (!strcmp(words_[i], "{}+")) {
+			fprintf(stderr,
+				"{}+ must be the last word of the --exec "
+				"command.\n");
+			return false;
+		}
+	}
+	if (batch_ && num_words_ == 1) {
+		fprintf(stderr, "--exec command is empty.\n");
+		return false;
+	}
+	return true;
+}
+
+bool ExecPool::start(int max_jobs) {
+	jobs_ = (ExecJob*)calloc(max_jobs, sizeof(ExecJob));
+	queue_ = (char**)malloc(EXEC_QUEUE_MAX * sizeof(char*));
+	queue_hashes_ = (uint32_t*)malloc(EXEC_QUEUE_MAX * sizeof(uint32_t));
+	if (!jobs_ || !queue_ || !queue_hashes_) {
+		fprintf(stderr, "Out of memory.\n");
+		return false;
+	}
+	max_jobs_ = max_jobs;
+	for (int i = 0; i < max_jobs; ++i) {
+		int size = batch_ ? EXEC_QUEUE_MAX : 1;
+		jobs_[i].paths_ = (char**)malloc(size * sizeof(char*));
+		jobs_[i].hashes_ = (uint32_t*)malloc(size * sizeof(uint32_t));
+		if (!jobs_[i].paths_ || !jobs_[i].hashes_) {
+			fprintf(stderr, "Out of memory.\n");
+			return false;
+		}
+	}
+
+	// SA_RESTART so that output is not cut short; waiting for events is
+	// interrupted regardless.
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = child_exited;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL)) {
+		fprintf(stderr, "Couldn't handle SIGCHLD: %s\n",
+			strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool ExecPool::is_running(uint32_t hash, char const* path) const {
+	for (int i = 0; i < max_jobs_; ++i) {
+		ExecJob const* job = &jobs_[i];
+		if (!job->pid_)
+			continue;
+		for (int j = 0; j < job->num_paths_; ++j) {
+			if (job->hashes_[j] == hash &&
+			    !strcmp(job->paths_[j], path))
+				return true;
+		}
+	}
+	return false;
+}
+
+// Queue the command for the file the event occurred on, unless it is
+// already waiting to run, and start it if a job is free.
+void ExecPool::add(struct inotify_event* event) {
+	static struct nstring path;
+	if (inotifytools_snprintf(&path, MAX_STRLEN, event, "%w%f") < 0)
+		return;
+	path.buf[path.len] = '\0';
+	uint32_t hash = hash_path(path.buf);
+	for (int i = 0; i < queue_len_; ++i) {
+		if (queue_hashes_[i] == hash && !strcmp(queue_[i], path.buf))
+			return;
+	}
+
+	while (queue_len_ == EXEC_QUEUE_MAX) {
+		reap(true);
+		start_jobs();
+	}
+	char* copy = strdup(path.buf);
+	if (!copy) {
+		fprintf(stderr, "Out of memory.\n");
+		return;
+	}
+	queue_[queue_len_] = copy;
+	queue_hashes_[queue_len_] = hash;
+	++queue_len_;
+	start_jobs();
+}
+
+// Start commands for the queued files, oldest first, skipping files whose
+// command is still running, while jobs are free.
+void ExecPool::start_jobs() {
+	for (int j = 0; j < max_jobs_ && num_running_ < max_jobs_; ++j) {
+		ExecJob* job = &jobs_[j];
+		if (job->pid_)
+			continue;
+
+		size_t bytes = 0;
+		int kept = 0;
+		for (int i = 0; i < queue_len_; ++i) {
+			size_t len = strlen(queue_[i]) + 1;
+			if ((job->num_paths_ &&
+			     (!batch_ || bytes + len > EXEC_BATCH_BYTES)) ||
+			    is_running(queue_hashes_[i], queue_[i])) {
+				queue_[kept] = queue_[i];
+				queue_hashes_[kept] = queue_hashes_[i];
+				++kept;
+				continue;
+			}
+			bytes += len;
+			job->paths_[job->num_paths_] = queue_[i];
+			job->hashes_[job->num_paths_] = queue_hashes_[i];
+			++job->num_paths_;
+		}
+		queue_len_ = kept;
+		if (!job->num_paths_)
+			return;
+		run(job);
+	}
+}
+
+// Substitute the job's files into the command and spawn it.
+void ExecPool::run(ExecJob* job) {
+	int argc = batch_ ? num_words_ - 1 + job->num_paths_ : num_words_;
+	char** argv = (char**)calloc(argc + 1, sizeof(char*));
+	char** owned = (char**)calloc(num_words_, sizeof(char*));
+	int rc = ENOMEM;
+	if (!argv || !owned)
+		goto done;
+
+	if (batch_) {
+		memcpy(argv, words_, (num_words_ - 1) * sizeof(char*));
+		memcpy(argv + num_words_ - 1, job->paths_,
+		       job->num_paths_ * sizeof(char*));
+	} else {
+		char const* path = job->paths_[0];
+		size_t path_len = strlen(path);
+		for (int i = 0; i < num_words_; ++i) {
+			char const* word = words_[i];
+			int n = 0;
+			for (char const* p = strstr(word, "{}"); p;
+			     p = strstr(p + 2, "{}"))
+				++n;
+			if (!n) {
+				argv[i] = words_[i];
+				continue;
+			}
+			owned[i] = (char*)malloc(strlen(word) +
+						 n * (path_len - 2) + 1);
+			if (!owned[i])
+				goto done;
+			char* out = owned[i];
+			for (char const* p; (p = strstr(word, "{}"));
+			     word = p + 2) {
+				memcpy(out, word, p - word);
+				out += p - word;
+				memcpy(out, path, path_len);
+				out += path_len;
+			}
+			strcpy(out, word);
+			argv[i] = owned[i];
+		}
+	}
+	rc = posix_spawnp(&job->pid_, argv[0], NULL, NULL, argv, environ);
+
+done:
+	if (rc) {
+		fprintf(stderr, "Couldn't run %s: %s\n", words_[0],
+			strerror(rc));
+		for (int i = 0; i < job->num_paths_; ++i)
+			free(job->paths_[i]);
+		job->num_paths_ = 0;
+		job->pid_ = 0;
+	} else {
+		++num_running_;
+	}
+	for (int i = 0; owned && i < num_words_; ++i)
+		free(owned[i]);
+	free(owned);
+	free(argv);
+}
+
+// Free the jobs whose command has exited, waiting for one if @a block.
+void ExecPool::reap(bool block) {
+	pid_t pid;
+	int status;
+	while (num_running_ &&
+	       (pid = waitpid(-1, &status, block ? 0 : WNOHANG)) != 0) {
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		block = false;
+		for (int i = 0; i < max_jobs_; ++i) {
+			ExecJob* job = &jobs_[i];
+			if (job->pid_ != pid)
+				continue;
+			for (int j = 0; j < job->num_paths_; ++j)
+				free(job->paths_[j]);
+			job->num_paths_ = 0;
+			job->pid_ = 0;
+			--num_running_;
+		}
+	}
+}
+
+// Like inotifytools_next_event(), but carrying on after signals, and
+// starting queued commands as running ones exit.
+struct inotify_event* ExecPool::next_event(long timeout) {
+	struct timespec deadline, now;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout;
+
+	for (;;) {
+		reap(false);
+		start_jobs();
+
+		long wait_ms = -1;
+		if (timeout) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+				  (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			if (wait_ms < 0)
+				wait_ms = 0;
+		}
+		if (num_running_ && (wait_ms < 0 || wait_ms > EXEC_POLL_MS))
+			wait_ms = EXEC_POLL_MS;
+
+		struct inotify_event* event = inotifytools_next_event_ms(wait_ms);
+		if (event)
+			return event;
+		int error = inotifytools_error();
+		if (error && error != EINTR)
+			return NULL;
+		if (error == EINTR && on_signal_)
+			on_signal_();
+		if (!error && timeout) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > deadline.tv_sec ||
+			    (now.tv_sec == deadline.tv_sec &&
+			     now.tv_nsec >= deadline.tv_nsec))
+				return NULL;
+		}
+	}
+}
+
+// Run the commands for every queued file and wait for all of them.
+void ExecPool::wait_all() {
+	while (queue_len_ || num_running_) {
+		start_jobs();
+		reap(true);
+	}
+}
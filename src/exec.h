@@ -0,0 +1,51 @@
+#ifndef EXEC_H
+#define EXEC_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct inotify_event;
+
+// A command being run for one or more files.
+struct ExecJob {
+	pid_t pid_;
+	char** paths_;
+	uint32_t* hashes_;
+	int num_paths_;
+};
+
+// Runs the command given with --exec for the files events occur on, with at
+// most max_jobs_ commands at once and never two at once for the same file.
+// "{}" in the command is replaced by the file, or if the last word is "{}+",
+// as many queued files as fit are appended to one command.
+struct ExecPool {
+	// The words of the command, all in buf_
+	char* buf_;
+	char** words_;
+	int num_words_;
+	bool batch_;
+	ExecJob* jobs_;
+	int max_jobs_;
+	int num_running_;
+	// Files waiting for their command, in the order their events occurred
+	char** queue_;
+	uint32_t* queue_hashes_;
+	int queue_len_;
+	// Called from next_event() after a signal interrupts the wait
+	void (*on_signal_)();
+
+	ExecPool();
+	~ExecPool();
+	bool parse(char const* command);
+	bool start(int max_jobs);
+	bool active() const { return words_ != 0; }
+	void add(struct inotify_event* event);
+	struct inotify_event* next_event(long timeout);
+	void wait_all();
+	bool is_running(uint32_t hash, char const* path) const;
+	void start_jobs();
+	void run(ExecJob* job);
+	void reap(bool block);
+};
+
+#endif
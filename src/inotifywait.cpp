@@ -1,6 +1,7 @@
 #include "../config.h"
 #include "../libinotifytools/src/inotifytools_p.h"
 #include "common.h"
+#include "exec.h"
 
 #include <sys/select.h>
 #include <sys/stat.h>
@@ -11,10 +12,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <regex.h>
 #include <signal.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,7 +52,14 @@ static bool parse_opts(int* argc,
 		       char** exc_iregex,
 		       char** inc_regex,
 		       char** inc_iregex,
+		       GlobFilterList* globs,
+		       bool* prune,
 		       bool* no_newline,
+		       long* coalesce,
+		       long* poll,
+		       char** exec,
+		       long* exec_jobs,
+		       bool* perf_timers,
 		       int* fanotify,
 		       bool* filesystem);
 
@@ -152,15 +160,51 @@ void output_event_csv(struct inotify_event* event) {
 	printf("\n");
 }
 
-void output_error(bool syslog, const char* fmt, ...) {
-	va_list va;
-	va_start(va, fmt);
-	if (syslog) {
-		vsyslog(LOG_INFO, fmt, va);
-	} else {
-		vfprintf(stderr, fmt, va);
-	}
-	va_end(va);
+static bool timers_on = false;
+// Time spent writing out buffered events
+static uint64_t flush_ns = 0;
+
+static uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Set by SIGUSR2.  fprintf() isn't async-signal-safe, so the counters are
+// printed from the event loop.
+static volatile sig_atomic_t perf_requested = 0;
+
+void request_perf_counters(int signal __attribute__((unused))) {
+	perf_requested = 1;
+}
+
+static void print_perf_counters() {
+	if (!perf_requested)
+		return;
+	perf_requested = 0;
+	struct inotifytools_perf_counters perf;
+	inotifytools_get_perf_counters(&perf);
+	double secs =
+	    (now_ns() - perf.since.tv_sec * 1000000000ULL - perf.since.tv_nsec) /
+	    1e9;
+	fprintf(stderr,
+		"reads: %" PRIu64 " (%.1f/s, %.1f bytes each)\n"
+		"events: %" PRIu64 " read, %" PRIu64
+		" rejected by filters\n"
+		"fid syscalls: %" PRIu64 "\n"
+		"printed: %" PRIu64 " events, %" PRIu64 " bytes\n",
+		perf.reads, secs > 0 ? perf.reads / secs : 0,
+		perf.reads ? (double)perf.bytes_read / perf.reads : 0,
+		perf.events_read, perf.events_rejected, perf.fid_syscalls,
+		perf.events_formatted, perf.bytes_written);
+	if (timers_on)
+		fprintf(stderr,
+			"time (ms): wait %.3f, read %.3f, filter %.3f, "
+			"resolve %.3f, format %.3f, output %.3f, flush %.3f\n",
+			perf.wait_ns / 1e6, perf.read_ns / 1e6,
+			perf.filter_ns / 1e6, perf.resolve_ns / 1e6,
+			perf.format_ns / 1e6, perf.output_ns / 1e6,
+			flush_ns / 1e6);
 }
 
 int main(int argc, char** argv) {
@@ -184,7 +228,15 @@ int main(int argc, char** argv) {
 	char* exc_iregex = NULL;
 	char* inc_regex = NULL;
 	char* inc_iregex = NULL;
+	GlobFilterList globs;
+	bool prune = false;
 	bool no_newline = false;
+	long coalesce = 0;
+	long poll = 0;
+	char* exec = NULL;
+	long exec_jobs = 0;
+	bool perf_timers = false;
+	ExecPool pool;
 	int fd, rc;
 
 	if ((argc > 0) && (strncmp(basename(argv[0]), "fsnotify", 8) == 0)) {
@@ -196,8 +248,9 @@ int main(int argc, char** argv) {
 	if (!parse_opts(&argc, &argv, &events, &monitor, &quiet, &timeout,
 			&recursive, &csv, &dodaemon, &sysl, &no_dereference,
 			&format, &timefmt, &fromfile, &outfile, &exc_regex,
-			&exc_iregex, &inc_regex, &inc_iregex, &no_newline,
-			&fanotify, &filesystem)) {
+			&exc_iregex, &inc_regex, &inc_iregex, &globs, &prune,
+			&no_newline, &coalesce, &poll, &exec, &exec_jobs,
+			&perf_timers, &fanotify, &filesystem)) {
 		return EXIT_FAILURE;
 	}
 
@@ -223,6 +276,21 @@ int main(int argc, char** argv) {
 		fprintf(stderr, "Error in `include' regular expression.\n");
 		return EXIT_FAILURE;
 	}
+	if (!globs.apply(recursive))
+		return EXIT_FAILURE;
+	inotifytools_set_watch_pruning(prune);
+	inotifytools_set_coalescing(coalesce);
+	// Scanning a thousand files each time keeps large network trees
+	// from loading the server
+	if (poll && !inotifytools_set_polling(poll, 1000)) {
+		fprintf(stderr, "Couldn't poll: %s\n",
+			strerror(inotifytools_error()));
+		return EXIT_FAILURE;
+	}
+	inotifytools_set_perf_timers(perf_timers);
+	timers_on = perf_timers;
+	if (exec && (!pool.parse(exec) || !pool.start(exec_jobs)))
+		return EXIT_FAILURE;
 
 	if (format)
 		validate_format(format);
@@ -344,27 +412,20 @@ int main(int argc, char** argv) {
 			break;
 		}
 
-		if ((recursive &&
+		// When polling, directories inotify has no watches left for
+		// are polled rather than watched lazily
+		struct inotifytools_watch_plan plan = {};
+		if ((recursive && poll &&
 		     !inotifytools_watch_recursively_with_exclude(
 			 this_file, events, list.exclude_files_)) ||
+		    (recursive && !poll &&
+		     !inotifytools_watch_recursively_within_budget(
+			 this_file, events, list.exclude_files_, 0, &plan)) ||
 		    (!recursive &&
 		     !inotifytools_watch_file(this_file, events))) {
 			if (inotifytools_error() == ENOSPC) {
-				const char* backend =
-				    fanotify ? "fanotify" : "inotify";
-				const char* resource =
-				    fanotify ? "marks" : "watches";
-				output_error(
-				    sysl,
-				    "Failed to watch %s; upper limit on %s %s "
-				    "reached!\n",
-				    this_file, backend, resource);
-				output_error(
-				    sysl,
-				    "Please increase the amount of %s %s "
-				    "allowed per user via `/proc/sys/fs/%s/"
-				    "max_user_%s'.\n",
-				    backend, resource, backend, resource);
+				warn_watch_limit(sysl, fanotify, this_file,
+						 NULL);
 			} else {
 				output_error(sysl, "Couldn't watch %s: %s\n",
 					     this_file,
@@ -373,11 +434,16 @@ int main(int argc, char** argv) {
 
 			return EXIT_FAILURE;
 		}
+		if (recursive && plan.limit_reached)
+			warn_watch_limit(sysl, fanotify, this_file, &plan);
 	}
 
 	if (!quiet) {
 		output_error(sysl, "Watches established.\n");
 	}
+	inotifytools_reset_perf_counters();
+	pool.on_signal_ = print_perf_counters;
+	signal(SIGUSR2, request_perf_counters);
 	if (timeout < 0) {
 		// Used to test filesystem support for inotify/fanotify
 		fprintf(stderr, "Negative timeout specified - abort!\n");
@@ -389,9 +455,11 @@ int main(int argc, char** argv) {
 	char* moved_from = 0;
 
 	do {
-		event = inotifytools_next_event(timeout);
+		print_perf_counters();
+		event = pool.next_event(timeout);
 		if (!event) {
 			if (!inotifytools_error()) {
+				pool.wait_all();
 				return EXIT_TIMEOUT;
 			} else {
 				output_error(sysl, "%s\n",
@@ -401,36 +469,27 @@ int main(int argc, char** argv) {
 			}
 		}
 
-		if (quiet < 2 && (event->mask & orig_events)) {
-			// Only output to stdout if the event is for a file matching our filters
-			// or if we don't have any include filters
-			if (!inc_regex && !inc_iregex) {
-				// No include filter - output everything
-				if (csv) {
-					output_event_csv(event);
-				} else if (format) {
-					inotifytools_printf(event, format);
-				} else {
-					inotifytools_printf(event, "%w %,e %f\n");
-				}
+		// Only report events for files matching our filters: with an
+		// include filter, directory events are there to watch new
+		// directories, and the filter is already applied by inotifytools
+		// internally
+		bool report = (event->mask & orig_events) &&
+			      ((!inc_regex && !inc_iregex && !globs.has_include_) ||
+			       !(event->mask & IN_ISDIR));
+
+		if (quiet < 2 && report) {
+			if (csv) {
+				output_event_csv(event);
+			} else if (format) {
+				inotifytools_printf(event, format);
 			} else {
-				// We have an include filter
-				bool is_dir_event = (event->mask & IN_ISDIR);
-
-				// For non-directory events, only show if they match the filter
-				// The filter is already applied by inotifytools internally
-				if (!is_dir_event) {
-					if (csv) {
-						output_event_csv(event);
-					} else if (format) {
-						inotifytools_printf(event, format);
-					} else {
-						inotifytools_printf(event, "%w %,e %f\n");
-					}
-				}
+				inotifytools_printf(event, "%w %,e %f\n");
 			}
 		}
 
+		if (pool.active() && report)
+			pool.add(event);
+
 		// TODO: replace filename of renamed filesystem watch entries
 		if (filesystem)
 			continue;
@@ -491,10 +550,15 @@ int main(int argc, char** argv) {
 			}
 		}
 
+		uint64_t start = timers_on ? now_ns() : 0;
 		fflush(NULL);
+		if (start)
+			flush_ns += now_ns() - start;
 
 	} while (monitor);
 
+	pool.wait_all();
+
 	// If we weren't trying to listen for this event...
 	if ((events & event->mask) == 0) {
 		// ...then most likely something bad happened, like IGNORE etc.
@@ -523,7 +587,14 @@ static bool parse_opts(int* argc,
 		       char** exc_iregex,
 		       char** inc_regex,
 		       char** inc_iregex,
+		       GlobFilterList* globs,
+		       bool* prune,
 		       bool* no_newline,
+		       long* coalesce,
+		       long* poll,
+		       char** exec,
+		       long* exec_jobs,
+		       bool* perf_timers,
 		       int* fanotify,
 		       bool* filesystem) {
 	assert(argc);
@@ -547,6 +618,13 @@ static bool parse_opts(int* argc,
 	assert(exc_iregex);
 	assert(inc_regex);
 	assert(inc_iregex);
+	assert(globs);
+	assert(prune);
+	assert(coalesce);
+	assert(poll);
+	assert(exec);
+	assert(exec_jobs);
+	assert(perf_timers);
 
 	// Settings for options
 	int new_event;
@@ -588,6 +666,15 @@ static bool parse_opts(int* argc,
 	    {"excludei", required_argument, NULL, 'b'},
 	    {"include", required_argument, NULL, 'j'},
 	    {"includei", required_argument, NULL, 'k'},
+	    {"exclude-glob", required_argument, NULL, 'g'},
+	    {"include-glob", required_argument, NULL, 'G'},
+	    {"ignore-file", required_argument, NULL, 'x'},
+	    {"prune", no_argument, NULL, 'p'},
+	    {"coalesce", required_argument, NULL, 'C'},
+	    {"poll", required_argument, NULL, 'l'},
+	    {"exec", required_argument, NULL, 'X'},
+	    {"exec-jobs", required_argument, NULL, 'J'},
+	    {"perf-timers", no_argument, NULL, 'T'},
 	    {NULL, 0, 0, 0},
 	};
 
@@ -714,6 +801,74 @@ static bool parse_opts(int* argc,
 				(*inc_iregex) = optarg;
 				break;
 
+			// --exclude-glob
+			case 'g':
+				if (!globs->add(GlobFilterList::EXCLUDE, optarg))
+					return false;
+				break;
+
+			// --include-glob
+			case 'G':
+				if (!globs->add(GlobFilterList::INCLUDE, optarg))
+					return false;
+				break;
+
+			// --ignore-file
+			case 'x':
+				if (!globs->add(GlobFilterList::FROM_FILE, optarg))
+					return false;
+				break;
+
+			// --prune
+			case 'p':
+				(*prune) = true;
+				break;
+
+			// --coalesce
+			case 'C':
+				if (!parse_duration(coalesce, optarg))
+					return false;
+				break;
+
+			// --poll
+			case 'l':
+				if (!parse_duration(poll, optarg))
+					return false;
+				break;
+
+			// --exec
+			case 'X':
+				if (*exec) {
+					fprintf(stderr,
+						"Multiple --exec options "
+						"given.\n");
+					return false;
+				}
+
+				(*exec) = optarg;
+				break;
+
+			// --perf-timers
+			case 'T':
+				(*perf_timers) = true;
+				break;
+
+			// --exec-jobs
+			case 'J': {
+				char* end = NULL;
+				errno = 0;
+				*exec_jobs = strtol(optarg, &end, 10);
+				if (errno || !*optarg || *end ||
+				    *exec_jobs <= 0 || *exec_jobs > 4096) {
+					fprintf(stderr,
+						"'%s' is not a valid number of "
+						"jobs.\n",
+						optarg);
+					return false;
+				}
+				break;
+			}
+
 			// --fromfile
 			case 'z':
 				if (*fromfile) {
@@ -821,6 +976,24 @@ static bool parse_opts(int* argc,
 		return false;
 	}
 
+	if (*exec_jobs && !*exec) {
+		fprintf(stderr,
+			"--exec-jobs cannot be specified without --exec.\n");
+		return false;
+	}
+
+	if (*exec && !*exec_jobs) {
+		*exec_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (*exec_jobs < 1)
+			*exec_jobs = 1;
+	}
+
+	if (*poll && *fanotify) {
+		fprintf(stderr,
+			"--poll cannot be specified with --fanotify.\n");
+		return false;
+	}
+
 	if (*daemon && *outfile == NULL) {
 		fprintf(stderr, "-o must be specified with -d.\n");
 		return false;
@@ -868,6 +1041,19 @@ void print_help(const char *tool_name) {
 	printf(
 	    "\t--includei <pattern>\n"
 	    "\t              \tLike --include but case insensitive.\n");
+	printf(
+	    "\t--exclude-glob <pattern>\n"
+	    "\t              \tExclude all events on files matching the\n"
+	    "\t              \tgitignore-style glob <pattern>.  May be\n"
+	    "\t              \tgiven multiple times.\n");
+	printf(
+	    "\t--include-glob <pattern>\n"
+	    "\t              \tExclude all events on files except the ones\n"
+	    "\t              \tmatching any --include-glob <pattern>.\n");
+	printf(
+	    "\t--ignore-file <file>\n"
+	    "\t              \tExclude all events on files matching the\n"
+	    "\t              \tpatterns in the gitignore-style <file>.\n");
 	printf(
 	    "\t-m|--monitor  \tKeep listening for events forever or until "
 	    "--timeout expires.\n"
@@ -884,6 +1070,10 @@ void print_help(const char *tool_name) {
 	    "\t-P|--no-dereference\n"
 	    "\t              \tDo not follow symlinks.\n");
 	printf("\t-r|--recursive\tWatch directories recursively.\n");
+	printf(
+	    "\t--prune       \tWith --recursive, do not watch directories\n"
+	    "\t              \tin which --exclude, --include or glob\n"
+	    "\t              \tfilters would discard every event.\n");
 	printf("\t-I|--inotify\tWatch with inotify.\n");
 	printf("\t-F|--fanotify\tWatch with fanotify.\n");
 	printf("\t-S|--filesystem\tWatch entire filesystem with fanotify.\n");
@@ -908,6 +1098,27 @@ void print_help(const char *tool_name) {
 	    "with\n"
 	    "\t              \t%%T in --format string.\n");
 	printf("\t-c|--csv      \tPrint events in CSV format.\n");
+	printf(
+	    "\t--exec <command>\n"
+	    "\t              \tRun <command> for each event, with {} replaced\n"
+	    "\t              \tby the file (as %%w%%f), or with a final {}+\n"
+	    "\t              \treplaced by as many files as are waiting.\n");
+	printf(
+	    "\t--exec-jobs <n>\tRun at most <n> commands at once (default:\n"
+	    "\t              \tthe number of processors).\n");
+	printf(
+	    "\t--coalesce <duration>\n"
+	    "\t              \tMerge the events on each file during\n"
+	    "\t              \t<duration> (e.g. 50ms) after the first one\n"
+	    "\t              \tinto a single event.\n");
+	printf(
+	    "\t--poll <duration>\n"
+	    "\t              \tPoll directories on network and FUSE\n"
+	    "\t              \tfilesystems, and those there are no inotify\n"
+	    "\t              \twatches left for, every <duration>.\n");
+	printf(
+	    "\t--perf-timers \tTime each stage of handling events, for the\n"
+	    "\t              \tcounters printed on SIGUSR2.\n");
 	printf(
 	    "\t-t|--timeout <seconds>\n"
 	    "\t              \tWhen listening for a single event, time out "
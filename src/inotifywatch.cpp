@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <getopt.h>
 #include <limits.h>
 #include <regex.h>
@@ -18,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <libgen.h>
 
@@ -42,6 +44,18 @@ static bool parse_opts(int* argc,
 		       char** exc_iregex,
 		       char** inc_regex,
 		       char** inc_iregex,
+		       GlobFilterList* globs,
+		       int* prune,
+		       int* top_n,
+		       long* refresh,
+		       int* r,
+		       int* depth,
+		       int* top_files,
+		       int* counters,
+		       char** output_format,
+		       char** output_file,
+		       long* dump,
+		       int* paths,
 		       int* fanotify,
 		       bool* filesystem);
 
@@ -71,15 +85,68 @@ void handle_signal(int signal __attribute__((unused))) {
 }
 
 int print_info();
+static long refresh_dump(struct timespec* last);
+
+// Set by SIGUSR1.  Writing the statistics isn't async-signal-safe, so the
+// event loop does it.
+static volatile sig_atomic_t info_requested = 0;
 
 void print_info_now(int signal __attribute__((unused))) {
-	print_info();
-	printf("\n");
+	info_requested = 1;
 }
 
 int events;
 int sort;
 int zero;
+int top;
+long interval;
+int rates;
+int files;
+enum { FORMAT_TABLE, FORMAT_CSV, FORMAT_JSON, FORMAT_PROM } format;
+char* outfile;
+long dump_interval;
+
+// Print the watches with the most events in the last interval.
+static void print_top(long elapsed) {
+	static int64_t last_total;
+	int event = sort == -1 ? 0 : -sort;
+	int64_t total = inotifytools_get_stat_total64(event);
+	double secs = elapsed / 1000.0;
+	int count;
+	watch** watches = inotifytools_top_watches(&count);
+
+	if (isatty(STDOUT_FILENO))
+		printf("\033[H\033[2J");
+	printf("%" PRId64 " %s%sevents in %.1fs (%.1f/s)\n",
+	       total - last_total, event ? inotifytools_event_to_str(event) : "",
+	       event ? " " : "", secs, (total - last_total) / secs);
+	printf("delta       rate/s      total       filename\n");
+	int slot = event ? stat_index(event) : STAT_TOTAL;
+	for (int i = 0; i < count; ++i) {
+		watch* w = watches[i];
+		printf("%-10" PRIu64 "  %-10.1f  %-10" PRIu64 "  %s\n",
+		       w->interval_hits, w->interval_hits / secs, w->hit[slot],
+		       inotifytools_filename_from_watch(w));
+	}
+	printf("\n");
+	fflush(stdout);
+	last_total = total;
+}
+
+// Print the top watches if the interval has passed, and return the number of
+// milliseconds until the next refresh is due.
+static long refresh_top(struct timespec* last, bool force) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec - last->tv_sec) * 1000 +
+		       (now.tv_nsec - last->tv_nsec) / 1000000;
+	if (!force && elapsed < interval)
+		return interval - elapsed;
+	print_top(elapsed > 0 ? elapsed : 1);
+	inotifytools_next_top_interval();
+	*last = now;
+	return interval;
+}
 
 int main(int argc, char** argv) {
 	events = 0;
@@ -97,6 +164,18 @@ int main(int argc, char** argv) {
 	char* exc_iregex = NULL;
 	char* inc_regex = NULL;
 	char* inc_iregex = NULL;
+	GlobFilterList globs;
+	int prune = 0;
+	top = 0;
+	interval = 0;
+	rates = 0;
+	int aggregate_depth = -1;
+	files = 0;
+	int file_counters = 0;
+	char* output_format = 0;
+	outfile = 0;
+	dump_interval = 0;
+	int max_paths = 0;
 	int rc;
 
 	if ((argc > 0) && (strncmp(basename(argv[0]), "fsnotify", 8) == 0)) {
@@ -109,8 +188,26 @@ int main(int argc, char** argv) {
 	// Parse commandline options, aborting if something goes wrong
 	if (!parse_opts(&argc, &argv, &events, &timeout, &verbose, &zero, &sort,
 			&recursive, &no_dereference, &fromfile, &exc_regex,
-			&exc_iregex, &inc_regex, &inc_iregex, &fanotify,
-			&filesystem)) {
+			&exc_iregex, &inc_regex, &inc_iregex, &globs,
+			&prune, &top, &interval, &rates, &aggregate_depth,
+			&files, &file_counters, &output_format, &outfile,
+			&dump_interval, &max_paths, &fanotify, &filesystem)) {
+		return EXIT_FAILURE;
+	}
+
+	if (!output_format || !strcmp(output_format, "table")) {
+		format = FORMAT_TABLE;
+	} else if (!strcmp(output_format, "csv")) {
+		format = FORMAT_CSV;
+	} else if (!strcmp(output_format, "json")) {
+		format = FORMAT_JSON;
+	} else if (!strcmp(output_format, "prom")) {
+		format = FORMAT_PROM;
+	} else {
+		fprintf(stderr,
+			"'%s' is not a valid output format; please use "
+			"`table', `csv', `json' or `prom'.\n",
+			output_format);
 		return EXIT_FAILURE;
 	}
 
@@ -130,11 +227,21 @@ int main(int argc, char** argv) {
 		return EXIT_FAILURE;
 	}
 
+	if (!globs.apply(recursive))
+		return EXIT_FAILURE;
+	inotifytools_set_watch_pruning(prune);
+
 	rc = inotifytools_init(fanotify, filesystem, verbose);
 	if (!rc) {
 		warn_inotify_init_error(fanotify);
 		return EXIT_FAILURE;
 	}
+	if (aggregate_depth >= 0)
+		inotifytools_set_aggregate_depth(aggregate_depth);
+	if (max_paths && !inotifytools_set_fid_watch_limit(max_paths)) {
+		fprintf(stderr, "%s\n", strerror(inotifytools_error()));
+		return EXIT_FAILURE;
+	}
 
 	// Attempt to watch file
 	// If events is still 0, make it all events.
@@ -178,28 +285,17 @@ int main(int argc, char** argv) {
 				this_file);
 		}
 
+		struct inotifytools_watch_plan plan;
 		if (recursive) {
-			status = inotifytools_watch_recursively_with_exclude(
-			    this_file, events, list.exclude_files_);
+			status = inotifytools_watch_recursively_within_budget(
+			    this_file, events, list.exclude_files_, 0, &plan);
 		} else {
 			status = inotifytools_watch_file(this_file, events);
 		}
 		if (!status) {
 			if (inotifytools_error() == ENOSPC) {
-				const char* backend =
-				    fanotify ? "fanotify" : "inotify";
-				const char* resource =
-				    fanotify ? "marks" : "watches";
-				fprintf(
-				    stderr,
-				    "Failed to watch %s; upper limit on %s %s "
-				    "reached!\n",
-				    this_file, backend, resource);
-				fprintf(stderr,
-					"Please increase the amount of %s %s "
-					"allowed per user via `/proc/sys/fs/%s/"
-					"max_user_%s'.\n",
-					backend, resource, backend, resource);
+				warn_watch_limit(false, fanotify, this_file,
+						 NULL);
 			} else {
 				fprintf(stderr, "Failed to watch %s: %s\n",
 					this_file,
@@ -208,6 +304,8 @@ int main(int argc, char** argv) {
 
 			return EXIT_FAILURE;
 		}
+		if (recursive && plan.limit_reached)
+			warn_watch_limit(false, fanotify, this_file, &plan);
 		if (recursive && verbose) {
 			fprintf(stderr, "OK, %s is now being watched.\n",
 				this_file);
@@ -244,14 +342,45 @@ int main(int argc, char** argv) {
 	signal(SIGUSR1, print_info_now);
 
 	inotifytools_initialize_stats();
+	if (rates)
+		inotifytools_initialize_rates();
+	if (top && !inotifytools_track_top_watches(
+		       top, sort == -1 ? 0 : -sort)) {
+		fprintf(stderr, "%s\n", strerror(inotifytools_error()));
+		return EXIT_FAILURE;
+	}
+	if (files && !inotifytools_track_top_files(
+			 file_counters, sort < -1 ? -sort : 0)) {
+		fprintf(stderr, "%s\n", strerror(inotifytools_error()));
+		return EXIT_FAILURE;
+	}
+	struct timespec last_refresh;
+	clock_gettime(CLOCK_MONOTONIC, &last_refresh);
+	struct timespec last_dump = last_refresh;
+
 	// Now wait till we get event
 	struct inotify_event* event;
 	char* moved_from = 0;
 
 	do {
-		event = inotifytools_next_event(BLOCKING_TIMEOUT);
+		if (info_requested) {
+			info_requested = 0;
+			print_info();
+			printf("\n");
+		}
+		if (top) {
+			event = inotifytools_next_event_ms(
+			    refresh_top(&last_refresh, false));
+		} else if (dump_interval) {
+			event =
+			    inotifytools_next_event_ms(refresh_dump(&last_dump));
+		} else {
+			event = inotifytools_next_event(BLOCKING_TIMEOUT);
+		}
 		if (!event) {
 			if (!inotifytools_error()) {
+				if (top || dump_interval)
+					continue;
 				return EXIT_TIMEOUT;
 			} else if (inotifytools_error() != EINTR) {
 				fprintf(stderr, "%s\n",
@@ -324,115 +453,332 @@ int main(int argc, char** argv) {
 
 	} while (!done);
 
+	if (top) {
+		refresh_top(&last_refresh, true);
+		return EXIT_SUCCESS;
+	}
 	return print_info();
 }
 
-int print_info() {
-	if (!inotifytools_get_stat_total(0)) {
-		fprintf(stderr, "No events occurred.\n");
-		return EXIT_SUCCESS;
+// Print the busiest files, with how much each count may be over.
+static void print_files(FILE* out) {
+	int count;
+	struct file_hits** hits = inotifytools_top_files(&count);
+	if (count > files)
+		count = files;
+	fputs("\ntotal  error  filename\n", out);
+	for (int i = 0; i < count; ++i) {
+		struct file_hits* f = hits[i];
+		fprintf(out, "%-5" PRIu64 "  %-5" PRIu64 "  %s%s\n", f->count,
+			f->error, inotifytools_file_hits_dir(f), f->name);
 	}
+}
 
-	// OK, go through the watches and print stats.
-	printf("total  ");
-	if ((IN_ACCESS & events) &&
-	    (zero || inotifytools_get_stat_total(IN_ACCESS)))
-		printf("access  ");
-	if ((IN_MODIFY & events) &&
-	    (zero || inotifytools_get_stat_total(IN_MODIFY)))
-		printf("modify  ");
-	if ((IN_ATTRIB & events) &&
-	    (zero || inotifytools_get_stat_total(IN_ATTRIB)))
-		printf("attrib  ");
-	if ((IN_CLOSE_WRITE & events) &&
-	    (zero || inotifytools_get_stat_total(IN_CLOSE_WRITE)))
-		printf("close_write  ");
-	if ((IN_CLOSE_NOWRITE & events) &&
-	    (zero || inotifytools_get_stat_total(IN_CLOSE_NOWRITE)))
-		printf("close_nowrite  ");
-	if ((IN_OPEN & events) &&
-	    (zero || inotifytools_get_stat_total(IN_OPEN)))
-		printf("open  ");
-	if ((IN_MOVED_FROM & events) &&
-	    (zero || inotifytools_get_stat_total(IN_MOVED_FROM)))
-		printf("moved_from  ");
-	if ((IN_MOVED_TO & events) &&
-	    (zero || inotifytools_get_stat_total(IN_MOVED_TO)))
-		printf("moved_to  ");
-	if ((IN_MOVE_SELF & events) &&
-	    (zero || inotifytools_get_stat_total(IN_MOVE_SELF)))
-		printf("move_self  ");
-	if ((IN_CREATE & events) &&
-	    (zero || inotifytools_get_stat_total(IN_CREATE)))
-		printf("create  ");
-	if ((IN_DELETE & events) &&
-	    (zero || inotifytools_get_stat_total(IN_DELETE)))
-		printf("delete  ");
-	if ((IN_DELETE_SELF & events) &&
-	    (zero || inotifytools_get_stat_total(IN_DELETE_SELF)))
-		printf("delete_self  ");
-	if ((IN_UNMOUNT & events) &&
-	    (zero || inotifytools_get_stat_total(IN_UNMOUNT)))
-		printf("unmount  ");
-
-	printf("filename\n");
-
-	struct rbtree* tree = inotifytools_wd_sorted_by_event(sort);
-	RBLIST* rblist = rbopenlist(tree);
-	watch* w = (watch*)rbreadlist(rblist);
-
-	while (w) {
-		if (!zero && !w->hit_total) {
-			w = (watch*)rbreadlist(rblist);
+// Events with a column in the output, in order
+static struct {
+	int event;
+	char const* name;
+} const columns[] = {
+    {IN_ACCESS, "access"},
+    {IN_MODIFY, "modify"},
+    {IN_ATTRIB, "attrib"},
+    {IN_CLOSE_WRITE, "close_write"},
+    {IN_CLOSE_NOWRITE, "close_nowrite"},
+    {IN_OPEN, "open"},
+    {IN_MOVED_FROM, "moved_from"},
+    {IN_MOVED_TO, "moved_to"},
+    {IN_MOVE_SELF, "move_self"},
+    {IN_CREATE, "create"},
+    {IN_DELETE, "delete"},
+    {IN_DELETE_SELF, "delete_self"},
+    {IN_UNMOUNT, "unmount"},
+};
+#define NUM_COLUMNS (sizeof(columns) / sizeof(*columns))
+
+// Names of the --rates columns, and the windows or time constants they are
+// for
+static struct {
+	char const* name;
+	int window;
+	int minutes;
+} const rate_columns[] = {
+    {"rate/1m", 60, 0},	 {"rate/10m", 600, 0}, {"rate/1h", 3600, 0},
+    {"ewma/1m", 0, 1},	 {"ewma/5m", 0, 5},    {"ewma/15m", 0, 15},
+};
+#define NUM_RATE_COLUMNS (sizeof(rate_columns) / sizeof(*rate_columns))
+
+static double rate_column(watch* w, int i) {
+	return rate_columns[i].window
+		   ? inotifytools_get_rate_by_watch(w, rate_columns[i].window)
+		   : inotifytools_get_rate_ewma_by_watch(
+			 w, rate_columns[i].minutes);
+}
+
+// Get the indexes in columns of the events to output.
+static int select_columns(unsigned* selected) {
+	int n = 0;
+	for (unsigned i = 0; i < NUM_COLUMNS; ++i) {
+		if ((columns[i].event & events) &&
+		    (zero || inotifytools_get_stat_total64(columns[i].event)))
+			selected[n++] = i;
+	}
+	return n;
+}
+
+// Watches without events are listed only with --zero.
+static bool listed(watch* w) {
+	return zero || w->hit[STAT_TOTAL];
+}
+
+static void print_table(FILE* out,
+			watch** watches,
+			int count,
+			unsigned const* selected,
+			int num_selected) {
+	fputs("total  ", out);
+	for (unsigned r = 0; rates && r < NUM_RATE_COLUMNS; ++r)
+		fprintf(out, "%-8s  ", rate_columns[r].name);
+	for (int c = 0; c < num_selected; ++c)
+		fprintf(out, "%s  ", columns[selected[c]].name);
+	fputs("filename\n", out);
+
+	for (int i = 0; i < count; ++i) {
+		watch* w = watches[i];
+		if (!listed(w))
 			continue;
+		fprintf(out, "%-5" PRIu64 "  ", w->hit[STAT_TOTAL]);
+		for (unsigned r = 0; rates && r < NUM_RATE_COLUMNS; ++r)
+			fprintf(out, "%-8.2f  ", rate_column(w, r));
+		for (int c = 0; c < num_selected; ++c) {
+			fprintf(out, "%-*" PRIu64 "  ",
+				(int)strlen(columns[selected[c]].name),
+				w->hit[stat_index(columns[selected[c]].event)]);
 		}
-		printf("%-5u  ", w->hit_total);
-		if ((IN_ACCESS & events) &&
-		    (zero || inotifytools_get_stat_total(IN_ACCESS)))
-			printf("%-6u  ", w->hit_access);
-		if ((IN_MODIFY & events) &&
-		    (zero || inotifytools_get_stat_total(IN_MODIFY)))
-			printf("%-6u  ", w->hit_modify);
-		if ((IN_ATTRIB & events) &&
-		    (zero || inotifytools_get_stat_total(IN_ATTRIB)))
-			printf("%-6u  ", w->hit_attrib);
-		if ((IN_CLOSE_WRITE & events) &&
-		    (zero || inotifytools_get_stat_total(IN_CLOSE_WRITE)))
-			printf("%-11u  ", w->hit_close_write);
-		if ((IN_CLOSE_NOWRITE & events) &&
-		    (zero || inotifytools_get_stat_total(IN_CLOSE_NOWRITE)))
-			printf("%-13u  ", w->hit_close_nowrite);
-		if ((IN_OPEN & events) &&
-		    (zero || inotifytools_get_stat_total(IN_OPEN)))
-			printf("%-4u  ", w->hit_open);
-		if ((IN_MOVED_FROM & events) &&
-		    (zero || inotifytools_get_stat_total(IN_MOVED_FROM)))
-			printf("%-10u  ", w->hit_moved_from);
-		if ((IN_MOVED_TO & events) &&
-		    (zero || inotifytools_get_stat_total(IN_MOVED_TO)))
-			printf("%-8u  ", w->hit_moved_to);
-		if ((IN_MOVE_SELF & events) &&
-		    (zero || inotifytools_get_stat_total(IN_MOVE_SELF)))
-			printf("%-9u  ", w->hit_move_self);
-		if ((IN_CREATE & events) &&
-		    (zero || inotifytools_get_stat_total(IN_CREATE)))
-			printf("%-6u  ", w->hit_create);
-		if ((IN_DELETE & events) &&
-		    (zero || inotifytools_get_stat_total(IN_DELETE)))
-			printf("%-6u  ", w->hit_delete);
-		if ((IN_DELETE_SELF & events) &&
-		    (zero || inotifytools_get_stat_total(IN_DELETE_SELF)))
-			printf("%-11u  ", w->hit_delete_self);
-		if ((IN_UNMOUNT & events) &&
-		    (zero || inotifytools_get_stat_total(IN_UNMOUNT)))
-			printf("%-7u  ", w->hit_unmount);
-
-		printf("%s\n", inotifytools_filename_from_watch(w));
-		w = (watch*)rbreadlist(rblist);
-	}
-	rbcloselist(rblist);
-	rbdestroy(tree);
+		fprintf(out, "%s\n", inotifytools_filename_from_watch(w));
+	}
+}
 
+static void print_csv_field(FILE* out, char const* s) {
+	if (!s[strcspn(s, ",\"\r\n")]) {
+		fputs(s, out);
+		return;
+	}
+	putc('"', out);
+	for (; *s; ++s) {
+		if (*s == '"')
+			putc('"', out);
+		putc(*s, out);
+	}
+	putc('"', out);
+}
+
+static void print_csv(FILE* out,
+		      watch** watches,
+		      int count,
+		      unsigned const* selected,
+		      int num_selected) {
+	fputs("total", out);
+	for (unsigned r = 0; rates && r < NUM_RATE_COLUMNS; ++r)
+		fprintf(out, ",%s", rate_columns[r].name);
+	for (int c = 0; c < num_selected; ++c)
+		fprintf(out, ",%s", columns[selected[c]].name);
+	fputs(",filename\n", out);
+
+	for (int i = 0; i < count; ++i) {
+		watch* w = watches[i];
+		if (!listed(w))
+			continue;
+		fprintf(out, "%" PRIu64, w->hit[STAT_TOTAL]);
+		for (unsigned r = 0; rates && r < NUM_RATE_COLUMNS; ++r)
+			fprintf(out, ",%.2f", rate_column(w, r));
+		for (int c = 0; c < num_selected; ++c) {
+			fprintf(out, ",%" PRIu64,
+				w->hit[stat_index(columns[selected[c]].event)]);
+		}
+		putc(',', out);
+		print_csv_field(out, inotifytools_filename_from_watch(w));
+		putc('\n', out);
+	}
+}
+
+static void print_json_string(FILE* out, char const* s) {
+	putc('"', out);
+	for (; *s; ++s) {
+		unsigned char ch = *s;
+		if (ch == '"' || ch == '\\')
+			fprintf(out, "\\%c", ch);
+		else if (ch < 0x20)
+			fprintf(out, "\\u%04x", ch);
+		else
+			putc(ch, out);
+	}
+	putc('"', out);
+}
+
+static void print_json(FILE* out,
+		       watch** watches,
+		       int count,
+		       unsigned const* selected,
+		       int num_selected) {
+	fprintf(out, "{\"total\":%" PRId64 ",\"watches\":[",
+		inotifytools_get_stat_total64(0));
+	bool first = true;
+	for (int i = 0; i < count; ++i) {
+		watch* w = watches[i];
+		if (!listed(w))
+			continue;
+		fputs(first ? "\n{\"filename\":" : ",\n{\"filename\":", out);
+		first = false;
+		print_json_string(out, inotifytools_filename_from_watch(w));
+		fprintf(out, ",\"total\":%" PRIu64, w->hit[STAT_TOTAL]);
+		for (unsigned r = 0; rates && r < NUM_RATE_COLUMNS; ++r) {
+			fprintf(out, ",\"%s\":%.2f", rate_columns[r].name,
+				rate_column(w, r));
+		}
+		for (int c = 0; c < num_selected; ++c) {
+			fprintf(out, ",\"%s\":%" PRIu64,
+				columns[selected[c]].name,
+				w->hit[stat_index(columns[selected[c]].event)]);
+		}
+		putc('}', out);
+	}
+	fputs("]}\n", out);
+}
+
+static void print_prom_label(FILE* out, char const* s) {
+	putc('"', out);
+	for (; *s; ++s) {
+		if (*s == '\n')
+			fputs("\\n", out);
+		else if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else
+			putc(*s, out);
+	}
+	putc('"', out);
+}
+
+static void print_prom(FILE* out,
+		       watch** watches,
+		       int count,
+		       unsigned const* selected,
+		       int num_selected) {
+	fputs("# HELP inotifywatch_events_total Events on a watched path.\n"
+	      "# TYPE inotifywatch_events_total counter\n",
+	      out);
+	for (int i = 0; i < count; ++i) {
+		watch* w = watches[i];
+		if (!listed(w))
+			continue;
+		for (int c = 0; c < num_selected; ++c) {
+			fputs("inotifywatch_events_total{path=", out);
+			print_prom_label(out,
+					 inotifytools_filename_from_watch(w));
+			fprintf(out, ",event=\"%s\"} %" PRIu64 "\n",
+				columns[selected[c]].name,
+				w->hit[stat_index(columns[selected[c]].event)]);
+		}
+	}
+	if (!rates)
+		return;
+	fputs("# HELP inotifywatch_event_rate Average events per second on a "
+	      "watched path.\n"
+	      "# TYPE inotifywatch_event_rate gauge\n",
+	      out);
+	for (int i = 0; i < count; ++i) {
+		watch* w = watches[i];
+		if (!listed(w))
+			continue;
+		for (unsigned r = 0; r < NUM_RATE_COLUMNS; ++r) {
+			fputs("inotifywatch_event_rate{path=", out);
+			print_prom_label(out,
+					 inotifytools_filename_from_watch(w));
+			fprintf(out, ",average=\"%s\"} %.2f\n",
+				rate_columns[r].name, rate_column(w, r));
+		}
+	}
+}
+
+// Write the statistics to out in the --output-format.
+static void write_stats(FILE* out) {
+	unsigned selected[NUM_COLUMNS];
+	int num_selected = select_columns(selected);
+	int count;
+	watch** watches = inotifytools_watches_sorted_by_event(sort, 0, &count);
+
+	switch (format) {
+		case FORMAT_TABLE:
+			print_table(out, watches, count, selected, num_selected);
+			if (files)
+				print_files(out);
+			break;
+		case FORMAT_CSV:
+			print_csv(out, watches, count, selected, num_selected);
+			break;
+		case FORMAT_JSON:
+			print_json(out, watches, count, selected, num_selected);
+			break;
+		case FORMAT_PROM:
+			print_prom(out, watches, count, selected, num_selected);
+			break;
+	}
+}
+
+// Replace the contents of the --outfile with the statistics, so that readers
+// see either the old or the new statistics and never a partial file.
+static bool dump_stats() {
+	size_t len = strlen(outfile) + sizeof(".XXXXXX");
+	char* tmp = (char*)malloc(len);
+	if (!tmp)
+		return false;
+	snprintf(tmp, len, "%s.XXXXXX", outfile);
+	int fd = mkstemp(tmp);
+	bool ok = false;
+	if (fd != -1) {
+		FILE* out = fdopen(fd, "w");
+		if (out) {
+			fchmod(fd, 0644);
+			write_stats(out);
+			ok = !ferror(out);
+			ok = !fclose(out) && ok;
+		} else {
+			close(fd);
+		}
+		ok = ok && !rename(tmp, outfile);
+		if (!ok)
+			unlink(tmp);
+	}
+	if (!ok) {
+		fprintf(stderr, "Couldn't write statistics to %s: %s\n",
+			outfile, strerror(errno));
+	}
+	free(tmp);
+	return ok;
+}
+
+// Write the statistics if the --dump-interval has passed, and return the
+// number of milliseconds until the next dump is due.
+static long refresh_dump(struct timespec* last) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec - last->tv_sec) * 1000 +
+		       (now.tv_nsec - last->tv_nsec) / 1000000;
+	if (elapsed < dump_interval)
+		return dump_interval - elapsed;
+	dump_stats();
+	*last = now;
+	return dump_interval;
+}
+
+int print_info() {
+	if (format == FORMAT_TABLE && !inotifytools_get_stat_total64(0)) {
+		fprintf(stderr, "No events occurred.\n");
+		return EXIT_SUCCESS;
+	}
+	if (outfile)
+		return dump_stats() ? EXIT_SUCCESS : EXIT_FAILURE;
+	write_stats(stdout);
+	fflush(stdout);
 	return EXIT_SUCCESS;
 }
 
@@ -450,6 +796,18 @@ static bool parse_opts(int* argc,
 		       char** exc_iregex,
 		       char** inc_regex,
 		       char** inc_iregex,
+		       GlobFilterList* globs,
+		       int* prune,
+		       int* top_n,
+		       long* refresh,
+		       int* r,
+		       int* depth,
+		       int* top_files,
+		       int* counters,
+		       char** output_format,
+		       char** output_file,
+		       long* dump,
+		       int* paths,
 		       int* fanotify,
 		       bool* filesystem) {
 	assert(argc);
@@ -468,6 +826,18 @@ static bool parse_opts(int* argc,
 	assert(exc_iregex);
 	assert(inc_regex);
 	assert(inc_iregex);
+	assert(globs);
+	assert(prune);
+	assert(top_n);
+	assert(refresh);
+	assert(r);
+	assert(depth);
+	assert(top_files);
+	assert(counters);
+	assert(output_format);
+	assert(output_file);
+	assert(dump);
+	assert(paths);
 
 	// Settings for options
 	int new_event;
@@ -495,6 +865,20 @@ static bool parse_opts(int* argc,
 	    {"excludei", required_argument, NULL, 'b'},
 	    {"include", required_argument, NULL, 'j'},
 	    {"includei", required_argument, NULL, 'k'},
+	    {"exclude-glob", required_argument, NULL, 'g'},
+	    {"include-glob", required_argument, NULL, 'G'},
+	    {"ignore-file", required_argument, NULL, 'x'},
+	    {"prune", no_argument, NULL, 'p'},
+	    {"top", required_argument, NULL, 'K'},
+	    {"interval", required_argument, NULL, 'i'},
+	    {"rates", no_argument, NULL, 'R'},
+	    {"aggregate-depth", required_argument, NULL, 'D'},
+	    {"top-files", required_argument, NULL, 'f'},
+	    {"file-counters", required_argument, NULL, 'n'},
+	    {"output-format", required_argument, NULL, 'O'},
+	    {"outfile", required_argument, NULL, 'W'},
+	    {"dump-interval", required_argument, NULL, 'U'},
+	    {"max-paths", required_argument, NULL, 'M'},
 	    {NULL, 0, 0, 0},
 	};
 
@@ -567,6 +951,126 @@ static bool parse_opts(int* argc,
 				(*inc_iregex) = optarg;
 				break;
 
+			// --exclude-glob
+			case 'g':
+				if (!globs->add(GlobFilterList::EXCLUDE, optarg))
+					return false;
+				break;
+
+			// --include-glob
+			case 'G':
+				if (!globs->add(GlobFilterList::INCLUDE, optarg))
+					return false;
+				break;
+
+			// --ignore-file
+			case 'x':
+				if (!globs->add(GlobFilterList::FROM_FILE, optarg))
+					return false;
+				break;
+
+			// --prune
+			case 'p':
+				++(*prune);
+				break;
+
+			// --top
+			case 'K': {
+				char* end;
+				long k = strtol(optarg, &end, 10);
+				if (*end || k <= 0 || k > INT_MAX) {
+					fprintf(stderr,
+						"'%s' is not a valid number of "
+						"watches for --top.\n",
+						optarg);
+					return false;
+				}
+				(*top_n) = k;
+				break;
+			}
+
+			// --interval
+			case 'i':
+				if (!parse_duration(refresh, optarg))
+					return false;
+				break;
+
+			// --rates
+			case 'R':
+				++(*r);
+				break;
+
+			// --aggregate-depth
+			case 'D': {
+				char* end;
+				long d = strtol(optarg, &end, 10);
+				if (*end || d < 0 || d > INT_MAX) {
+					fprintf(stderr,
+						"'%s' is not a valid depth for "
+						"--aggregate-depth.\n",
+						optarg);
+					return false;
+				}
+				(*depth) = d;
+				break;
+			}
+
+			// --top-files or --file-counters
+			case 'f':
+			case 'n': {
+				char* end;
+				long n = strtol(optarg, &end, 10);
+				if (*end || n <= 0 || n > INT_MAX / 4) {
+					fprintf(stderr,
+						"'%s' is not a valid number of "
+						"files for --%s.\n",
+						optarg,
+						curr_opt == 'f'
+						    ? "top-files"
+						    : "file-counters");
+					return false;
+				}
+				(*(curr_opt == 'f' ? top_files : counters)) = n;
+				break;
+			}
+
+			// --output-format
+			case 'O':
+				(*output_format) = optarg;
+				break;
+
+			// --outfile
+			case 'W':
+				if (*output_file) {
+					fprintf(stderr,
+						"Multiple --outfile options "
+						"given.\n");
+					return false;
+				}
+				(*output_file) = optarg;
+				break;
+
+			// --dump-interval
+			case 'U':
+				if (!parse_duration(dump, optarg))
+					return false;
+				break;
+
+			// --max-paths
+			case 'M': {
+				char* end;
+				long n = strtol(optarg, &end, 10);
+				if (*end || n <= 0 || n > INT_MAX) {
+					fprintf(stderr,
+						"'%s' is not a valid number of "
+						"paths for --max-paths.\n",
+						optarg);
+					return false;
+				}
+				(*paths) = n;
+				break;
+			}
+
 			// --fromfile
 			case 'o':
 				if (*fromfile) {
@@ -698,6 +1202,63 @@ static bool parse_opts(int* argc,
 		return false;
 	}
 
+	if (*counters && !*top_files) {
+		fprintf(stderr,
+			"--file-counters can only be used with --top-files.\n");
+		return false;
+	}
+	if (*top_files && !*counters) {
+		// Enough that the listed counts are close for skewed loads
+		if (*top_files > INT_MAX / 40)
+			(*counters) = INT_MAX / 4;
+		else if (*top_files > 100)
+			(*counters) = *top_files * 10;
+		else
+			(*counters) = 1000;
+	}
+	if (*counters < *top_files) {
+		fprintf(stderr,
+			"--file-counters must be at least --top-files.\n");
+		return false;
+	}
+	if (*top_files && *output_format && strcmp(*output_format, "table")) {
+		fprintf(stderr,
+			"--top-files can only be used with the table output "
+			"format.\n");
+		return false;
+	}
+
+	if (*paths && !*filesystem) {
+		fprintf(stderr,
+			"--max-paths can only be used with --filesystem.\n");
+		return false;
+	}
+	if (*dump && !*output_file) {
+		fprintf(stderr,
+			"--dump-interval can only be used with --outfile.\n");
+		return false;
+	}
+	if (*top_n && (*output_format || *output_file)) {
+		fprintf(stderr,
+			"--top cannot be used with --output-format or "
+			"--outfile.\n");
+		return false;
+	}
+
+	if (*refresh && !*top_n) {
+		fprintf(stderr, "--interval can only be used with --top.\n");
+		return false;
+	}
+	if (*top_n) {
+		if ((*s) >= 0) {
+			fprintf(stderr,
+				"--top can only sort by descending counts.\n");
+			return false;
+		}
+		if (!*refresh)
+			(*refresh) = 1000;
+	}
+
 	if (*exc_regex && *exc_iregex) {
 		fprintf(stderr,
 			"--exclude and --excludei cannot both be specified.\n");
@@ -748,12 +1309,29 @@ void print_help(const char *tool_name) {
 	printf(
 	    "\t--includei <pattern>\n"
 	    "\t\tLike --include but case insensitive.\n");
+	printf(
+	    "\t--exclude-glob <pattern>\n"
+	    "\t\tExclude all events on files matching the gitignore-style\n"
+	    "\t\tglob <pattern>.  May be given multiple times.\n");
+	printf(
+	    "\t--include-glob <pattern>\n"
+	    "\t\tExclude all events on files except the ones matching any\n"
+	    "\t\t--include-glob <pattern>.\n");
+	printf(
+	    "\t--ignore-file <file>\n"
+	    "\t\tExclude all events on files matching the patterns in the\n"
+	    "\t\tgitignore-style <file>.\n");
 	printf(
 	    "\t-z|--zero\n"
 	    "\t\tIn the final table of results, output rows and columns even\n"
 	    "\t\tif they consist only of zeros (the default is to not output\n"
 	    "\t\tthese rows and columns).\n");
 	printf("\t-r|--recursive\tWatch directories recursively.\n");
+	printf(
+	    "\t--prune\n"
+	    "\t\tWith --recursive, do not watch directories in which\n"
+	    "\t\t--exclude, --include or glob filters would discard every\n"
+	    "\t\tevent.\n");
 	printf("\t-I|--inotify\tWatch with inotify.\n");
 	printf("\t-F|--fanotify\tWatch with fanotify.\n");
 	printf("\t-S|--filesystem\tWatch entire filesystem with fanotify.\n");
@@ -775,7 +1353,51 @@ void print_help(const char *tool_name) {
 	    "\t\tSort ascending by a particular event, or `total'.\n");
 	printf(
 	    "\t-d|--descending <event>\n"
-	    "\t\tSort descending by a particular event, or `total'.\n\n");
+	    "\t\tSort descending by a particular event, or `total'.\n");
+	printf(
+	    "\t--top <count>\n"
+	    "\t\tInstead of a table at exit, print the <count> watches with\n"
+	    "\t\tthe most events (or the most of the --descending event)\n"
+	    "\t\tin each interval, with their rates.\n");
+	printf(
+	    "\t--interval <duration>\n"
+	    "\t\tWith --top, refresh every <duration>, e.g. 500ms, 2s or\n"
+	    "\t\t1m (default 1s).\n");
+	printf(
+	    "\t--rates\n"
+	    "\t\tAdd columns with the average events per second over the\n"
+	    "\t\tlast minute, ten minutes and hour, and moving averages\n"
+	    "\t\twith 1, 5 and 15 minute time constants.\n");
+	printf(
+	    "\t--aggregate-depth <depth>\n"
+	    "\t\tCount events below <depth> levels of subdirectories of\n"
+	    "\t\tthe watched directories against their ancestor at that\n"
+	    "\t\tdepth, e.g. 1 for a row per top level subdirectory.\n");
+	printf(
+	    "\t--top-files <count>\n"
+	    "\t\tAfter the table, list the <count> files with the most\n"
+	    "\t\tevents (or the most of the --descending event) and how\n"
+	    "\t\tmany of those may belong to other files.\n");
+	printf(
+	    "\t--file-counters <count>\n"
+	    "\t\tWith --top-files, count up to <count> files at a time\n"
+	    "\t\t(default ten times --top-files, at least 1000).\n");
+	printf(
+	    "\t--output-format table|csv|json|prom\n"
+	    "\t\tPrint the statistics as a table (default), CSV, JSON or\n"
+	    "\t\tPrometheus text exposition format.\n");
+	printf(
+	    "\t--outfile <file>\n"
+	    "\t\tWrite the statistics to <file> instead of standard output,\n"
+	    "\t\treplacing it atomically.\n");
+	printf(
+	    "\t--dump-interval <duration>\n"
+	    "\t\tWith --outfile, also rewrite it every <duration>, e.g. 15s.\n");
+	printf(
+	    "\t--max-paths <count>\n"
+	    "\t\tWith --filesystem, keep statistics for at most <count>\n"
+	    "\t\tfiles and directories, counting those with the least\n"
+	    "\t\trecent events as `(other)' to make room for new ones.\n\n");
 	printf("Exit status:\n");
 	printf("\t%d  -  Exited normally.\n", EXIT_SUCCESS);
 	printf("\t%d  -  Some error occurred.\n\n", EXIT_FAILURE);
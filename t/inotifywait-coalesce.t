@@ -0,0 +1,71 @@
+#!/bin/sh
+
+test_description='Coalescing of inotifywait
+
+Verify that:
+1. --coalesce outputs the events on a file during the window as one event
+2. moves are output as they occur, after the pending events on the file
+3. --coalesce takes a duration
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root && mkdir root || return 1
+
+    ../../src/inotifywait \
+        --monitor \
+        --quiet \
+        --format "%e %f" \
+        --coalesce 500ms \
+        root >$logfile 2>/dev/null &
+
+    inotifywait_pid=$!
+
+    sleep 1
+
+    "$@"
+
+    sleep 1
+
+    kill $inotifywait_pid
+    # Killed by the signal, so its exit status is of no interest
+    wait $inotifywait_pid || :
+}
+
+write_files() {
+    echo 1 >root/a
+    echo 1 >root/b
+    echo 2 >>root/a
+    chmod 600 root/a
+}
+
+move_file() {
+    echo 1 >root/c
+    mv root/c root/d
+}
+
+test_expect_success 'events on a file are merged' '
+    run_ write_files &&
+    test $(grep -c " a$" $logfile) = 1 &&
+    test $(grep -c " b$" $logfile) = 1 &&
+    grep "^MODIFY,ATTRIB,CLOSE_WRITE,OPEN,CREATE,CLOSE a$" $logfile
+'
+
+test_expect_success 'moves are not merged' '
+    run_ move_file &&
+    sed -n 1p $logfile | grep "^MODIFY,CLOSE_WRITE,OPEN,CREATE,CLOSE c$" &&
+    sed -n 2p $logfile | grep "^MOVED_FROM c$" &&
+    sed -n 3p $logfile | grep "^MOVED_TO d$"
+'
+
+test_expect_success '--coalesce takes a duration' '
+    test_must_fail ../../src/inotifywait --coalesce 0 . 2>err &&
+    grep "not a valid duration" err
+'
+
+test_done
@@ -0,0 +1,91 @@
+#!/bin/sh
+
+test_description='Command execution of inotifywait
+
+Verify that:
+1. --exec runs the command with {} replaced by the file of each event
+2. a final {}+ passes the files which are waiting to one command
+3. the command is not run twice at once for the same file
+4. --exec-jobs requires --exec
+5. the command does not inherit the inotify file descriptor
+'
+
+. ./sharness.sh
+
+cat >record <<\EOF
+#!/bin/sh
+echo "start $*" >>runs
+sleep $DELAY
+echo "end $*" >>runs
+EOF
+chmod +x record
+
+cat >fds <<\EOF
+#!/bin/sh
+ls -l /proc/$$/fd >>open-fds
+EOF
+chmod +x fds
+
+# run_ <seconds each command takes> <options>
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+    DELAY=$1 && export DELAY && shift
+
+    rm -rf root runs && mkdir root || return 1
+
+    ../../src/inotifywait \
+        --monitor \
+        --quiet --quiet \
+        --timeout 2 \
+        --event CLOSE_WRITE \
+        "$@" \
+        root 2>/dev/null &
+
+    inotifywait_pid=$!
+
+    sleep 1
+
+    echo 1 >root/a
+    echo 1 >root/b
+    echo 1 >root/c
+    echo 2 >root/a
+
+    # Exits with the timeout status once the commands have finished
+    wait $inotifywait_pid
+    test $? = 2
+}
+
+test_expect_success 'command runs for each file' '
+    run_ 0 --exec "./record x{}" &&
+    grep "^end xroot/a$" runs &&
+    grep "^end xroot/b$" runs &&
+    grep "^end xroot/c$" runs
+'
+
+test_expect_success 'waiting files are passed to one command' '
+    run_ 1 --exec-jobs 1 --exec "./record {}+" &&
+    sed -n 1p runs | grep "^start root/a$" &&
+    sed -n 3p runs | grep "^start root/b root/c root/a$"
+'
+
+test_expect_success 'a file is never run twice at once' '
+    run_ 1 --exec-jobs 4 --exec "./record {}" &&
+    test $(grep -c "^end root/a$" runs) = 2 &&
+    grep "root/a" runs >a &&
+    printf "start root/a\nend root/a\nstart root/a\nend root/a\n" >expect &&
+    test_cmp expect a
+'
+
+test_expect_success '--exec-jobs requires --exec' '
+    test_must_fail ../../src/inotifywait --exec-jobs 2 . 2>err &&
+    grep "without --exec" err
+'
+
+test_expect_success 'the inotify descriptor is closed for the command' '
+    rm -f open-fds &&
+    run_ 0 --exec "./fds" &&
+    test -s open-fds &&
+    ! grep "anon_inode:inotify" open-fds
+'
+
+test_done
@@ -0,0 +1,58 @@
+#!/bin/sh
+
+test_description='Performance counters of inotifywait
+
+Verify that:
+1. SIGUSR2 prints the counters, and inotifywait carries on
+2. --perf-timers adds the time spent in each stage
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root && mkdir root || return 1
+
+    ../../src/inotifywait \
+        --monitor \
+        --quiet \
+        --format "%e %f" \
+        --event CREATE \
+        --exclude skip \
+        "$@" \
+        root >$logfile 2>err &
+
+    inotifywait_pid=$!
+
+    sleep 1
+
+    touch root/a root/skip
+    sleep 1
+    kill -USR2 $inotifywait_pid
+    sleep 1
+    touch root/b
+    sleep 1
+
+    kill $inotifywait_pid
+    # Killed by the signal, so its exit status is of no interest
+    wait $inotifywait_pid || :
+}
+
+test_expect_success 'SIGUSR2 prints the counters' '
+    run_ &&
+    grep "^events: 2 read, 1 rejected by filters$" err &&
+    grep "^printed: 1 events, 9 bytes$" err &&
+    ! grep "^time" err &&
+    grep "^CREATE a$" $logfile &&
+    grep "^CREATE b$" $logfile
+'
+
+test_expect_success '--perf-timers times each stage' '
+    run_ --perf-timers &&
+    grep "^time (ms): wait [0-9.]*, read [0-9.]*, filter" err
+'
+
+test_done
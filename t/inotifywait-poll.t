@@ -0,0 +1,70 @@
+#!/bin/sh
+
+test_description='Polling with inotifywait
+
+Verify that:
+1. with --poll, the directories there are no inotify watches left for are
+   polled, and files created, modified and moved in them are reported
+2. --poll cannot be used with --fanotify
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+# The inotify watches of a new user namespace can be limited without
+# touching the system wide max_user_watches
+user_namespace_supported() {
+    unshare -Ur sh -c 'echo 2 >/proc/sys/user/max_inotify_watches' \
+        2>/dev/null
+}
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root && mkdir -p root/a root/b root/c || return 1
+    echo 1 >root/c/old
+
+    # Two watches, for root and root/a, and the others are polled
+    unshare -Ur sh -c '
+        echo 2 >/proc/sys/user/max_inotify_watches &&
+        ../../src/inotifywait \
+            --monitor \
+            --recursive \
+            --poll 100ms \
+            --timeout 3 \
+            --event CREATE,MODIFY,MOVED_FROM,MOVED_TO \
+            root >'$logfile' 2>/dev/null &
+
+        inotifywait_pid=$!
+
+        sleep 1
+
+        echo 1 >root/c/new
+        sleep 0.5
+        echo 2 >>root/c/old
+        sleep 0.5
+        mv root/c/old root/c/renamed
+
+        wait $inotifywait_pid
+    '
+    # Exits with the timeout status
+    test $? = 2
+}
+
+if user_namespace_supported; then
+    test_expect_success 'changes in polled directories are reported' '
+        run_ &&
+        grep "^root/c/ CREATE new$" $logfile &&
+        grep "^root/c/ MODIFY old$" $logfile &&
+        grep "^root/c/ MOVED_FROM old$" $logfile &&
+        grep "^root/c/ MOVED_TO renamed$" $logfile
+    '
+fi
+
+test_expect_success '--poll cannot be used with --fanotify' '
+    test_must_fail ../../src/inotifywait --poll 1s --fanotify . 2>err &&
+    grep "cannot be specified with --fanotify" err
+'
+
+test_done
@@ -0,0 +1,73 @@
+#!/bin/sh
+
+test_description='Recursive watch with glob filters
+
+Verify that:
+1. Files matching --exclude-glob patterns produce no events
+2. A later negated pattern re-includes a file
+3. Excluded directories are not watched
+4. Patterns in an --ignore-file are relative to its directory
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+    testdir=root/A
+
+    rm -rf root && mkdir -p $testdir/build $testdir/src || return 1
+
+    ../../src/inotifywait \
+        --quiet \
+        --monitor \
+        --recursive \
+        --outfile $logfile \
+        "$@" \
+        --event CREATE \
+        --format "%w%f" \
+        root &
+
+    inotifywait_pid=$!
+
+    sleep 1
+
+    touch $testdir/main.c
+    touch $testdir/main.o
+    touch $testdir/keep.o
+    touch $testdir/build/out.c
+    touch $testdir/src/lib.c
+    touch $testdir/src/lib.o
+
+    sleep 1
+
+    kill $inotifywait_pid
+    wait $inotifywait_pid || true
+}
+
+test_expect_success 'events on excluded globs are not logged' '
+    rm -f $logfile &&
+    run_ --exclude-glob "build/" --exclude-glob "*.o" \
+        --exclude-glob "!keep.o" &&
+    test -f $logfile &&
+    grep "root/A/main.c" $logfile &&
+    grep "root/A/keep.o" $logfile &&
+    grep "root/A/src/lib.c" $logfile &&
+    ! grep "main.o" $logfile &&
+    ! grep "lib.o" $logfile &&
+    ! grep "build" $logfile
+'
+
+test_expect_success 'ignore file patterns are relative to the file' '
+    rm -f $logfile &&
+    printf "# comment\n/root/A/src/\n*.o\n" >ignore &&
+    run_ --ignore-file ignore &&
+    test -f $logfile &&
+    grep "root/A/main.c" $logfile &&
+    grep "root/A/build/out.c" $logfile &&
+    ! grep "\.o$" $logfile &&
+    ! grep "src" $logfile
+'
+
+test_done
@@ -0,0 +1,69 @@
+#!/bin/sh
+
+test_description='Subtree aggregation of inotifywatch statistics
+
+Verify that:
+1. --aggregate-depth counts events against the ancestor at that depth
+2. --rates gives the rates of the directories rolled up to
+3. an invalid depth is rejected
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root && mkdir -p root/p1/x/y root/p2/z || return 1
+
+    ../../src/inotifywatch \
+        --recursive \
+        --event MODIFY \
+        "$@" \
+        root >$logfile 2>/dev/null &
+
+    inotifywatch_pid=$!
+
+    sleep 1
+
+    for i in 1 2 3; do
+        echo $i >>root/p1/x/y/$i
+    done
+    echo 1 >>root/p1/x/1
+    echo 1 >>root/p2/z/1
+    echo 1 >>root/top
+
+    sleep 1
+
+    kill $inotifywatch_pid
+    wait $inotifywatch_pid
+}
+
+test_expect_success 'events are rolled up to depth 1' '
+    run_ --aggregate-depth 1 &&
+    grep "^4  *4  *root/p1/$" $logfile &&
+    grep "^1  *1  *root/p2/$" $logfile &&
+    grep "^1  *1  *root/$" $logfile &&
+    ! grep "root/p1/x" $logfile &&
+    ! grep "root/p2/z" $logfile
+'
+
+test_expect_success 'depth 0 rolls every event up to the watched root' '
+    run_ --aggregate-depth 0 &&
+    grep "^6  *6  *root/$" $logfile &&
+    ! grep "root/p" $logfile
+'
+
+test_expect_success '--rates gives the rates of rolled up rows' '
+    run_ --rates --aggregate-depth 0 &&
+    grep "^6 .* 6  *root/$" $logfile &&
+    ! grep -e "-1\.00" $logfile
+'
+
+test_expect_success 'invalid depth is rejected' '
+    test_must_fail ../../src/inotifywatch --aggregate-depth -1 . 2>err &&
+    grep "not a valid depth" err
+'
+
+test_done
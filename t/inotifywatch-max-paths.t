@@ -0,0 +1,60 @@
+#!/bin/sh
+
+test_description='Bounded filesystem statistics of inotifywatch
+
+Verify that:
+1. with --max-paths, statistics are kept for at most that many paths and
+   the rest are counted as (other)
+2. --max-paths requires --filesystem
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+fanotify_filesystem_supported() {
+    ../../src/inotifywatch --fanotify --filesystem -t -1 . 2>&1 |
+        grep -q 'Negative timeout'
+}
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root && mkdir -p root/1 root/2 root/3 root/4 || return 1
+
+    ../../src/inotifywatch \
+        --fanotify \
+        --filesystem \
+        --event MODIFY \
+        "$@" \
+        root >$logfile 2>/dev/null &
+
+    inotifywatch_pid=$!
+
+    sleep 1
+
+    for i in 1 2 3 4; do
+        echo $i >>root/$i/a
+    done
+
+    sleep 1
+
+    kill $inotifywatch_pid
+    wait $inotifywatch_pid
+}
+
+export LD_LIBRARY_PATH="../../libinotifytools/src/"
+if [ $(id -u) -eq 0 ] && fanotify_filesystem_supported; then
+    test_expect_success 'least recently active paths are (other)' '
+        run_ --max-paths 2 &&
+        grep "(other)$" $logfile &&
+        test $(grep -vc "^total" $logfile) -le 3
+    '
+fi
+
+test_expect_success '--max-paths requires --filesystem' '
+    test_must_fail ../../src/inotifywatch --max-paths 2 . 2>err &&
+    grep "only be used with --filesystem" err
+'
+
+test_done
@@ -0,0 +1,75 @@
+#!/bin/sh
+
+test_description='Machine readable output of inotifywatch
+
+Verify that:
+1. --output-format csv prints a header and a row per watch
+2. --output-format prom prints a counter per path and event
+3. --outfile is rewritten every --dump-interval
+4. invalid formats and --dump-interval without --outfile are rejected
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root stats stats.running && mkdir -p root/sub || return 1
+
+    ../../src/inotifywatch \
+        --recursive \
+        --event MODIFY \
+        "$@" \
+        root >$logfile 2>/dev/null &
+
+    inotifywatch_pid=$!
+
+    sleep 1
+
+    echo 1 >>root/a
+    echo 1 >>root/c
+    echo 1 >>root/sub/b
+
+    sleep 1
+
+    test -f stats && cp stats stats.running
+
+    kill $inotifywatch_pid
+    wait $inotifywatch_pid
+}
+
+test_expect_success 'csv' '
+    run_ --output-format csv &&
+    grep "^total,modify,filename$" $logfile &&
+    grep "^2,2,root/$" $logfile &&
+    grep "^1,1,root/sub/$" $logfile
+'
+
+test_expect_success 'prom' '
+    run_ --output-format prom &&
+    grep "^# TYPE inotifywatch_events_total counter$" $logfile &&
+    grep "^inotifywatch_events_total{path=\"root/\",event=\"modify\"} 2$" \
+        $logfile &&
+    grep "^inotifywatch_events_total{path=\"root/sub/\",event=\"modify\"} 1$" \
+        $logfile
+'
+
+test_expect_success 'outfile is dumped while running' '
+    run_ --output-format csv --outfile stats --dump-interval 200ms &&
+    test ! -s $logfile &&
+    grep "^2,2,root/$" stats.running &&
+    grep "^2,2,root/$" stats &&
+    test "$(ls stats*)" = "stats
+stats.running"
+'
+
+test_expect_success 'invalid options are rejected' '
+    test_must_fail ../../src/inotifywatch --output-format xml . 2>err &&
+    grep "not a valid output format" err &&
+    test_must_fail ../../src/inotifywatch --dump-interval 1s . 2>err &&
+    grep "only be used with --outfile" err
+'
+
+test_done
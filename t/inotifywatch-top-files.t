@@ -0,0 +1,75 @@
+#!/bin/sh
+
+test_description='Busiest files of inotifywatch
+
+Verify that:
+1. --top-files lists the files with the most events, busiest first
+2. with too few counters, replaced files are reported as error
+3. --file-counters must be at least --top-files
+4. --top-files is rejected for output formats other than the table
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root && mkdir -p root/sub || return 1
+
+    ../../src/inotifywatch \
+        --recursive \
+        --event MODIFY \
+        "$@" \
+        root >$logfile 2>/dev/null &
+
+    inotifywatch_pid=$!
+
+    sleep 1
+
+    # Interleaved, as inotify merges identical events that are still queued
+    echo 1 >>root/c
+    echo 1 >>root/b
+    echo 1 >>root/a
+    echo 2 >>root/b
+    echo 2 >>root/a
+    for i in 1 2 3; do
+        echo $i >>root/sub/d
+        echo $((i + 2)) >>root/a
+    done
+
+    sleep 1
+
+    kill $inotifywatch_pid
+    wait $inotifywatch_pid
+}
+
+test_expect_success 'busiest files are listed first' '
+    run_ --top-files 2 &&
+    grep -A2 "^total  error  filename$" $logfile >files &&
+    sed -n 2p files | grep "^5  *0  *root/a$" &&
+    sed -n 3p files | grep "^3  *0  *root/sub/d$" &&
+    ! grep "root/b" files
+'
+
+test_expect_success 'counts of replaced files are reported as error' '
+    run_ --top-files 2 --file-counters 2 &&
+    grep -A2 "^total  error  filename$" $logfile >files &&
+    sed -n 2p files | grep "^6  *1  *root/a$" &&
+    sed -n 3p files | grep "^5  *2  *root/sub/d$"
+'
+
+test_expect_success '--file-counters must be at least --top-files' '
+    test_must_fail ../../src/inotifywatch --top-files 5 \
+        --file-counters 2 . 2>err &&
+    grep "at least --top-files" err
+'
+
+test_expect_success '--top-files needs the table format' '
+    test_must_fail ../../src/inotifywatch --top-files 5 \
+        --output-format json . 2>err &&
+    grep "table output format" err
+'
+
+test_done
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+test_description='Live top watches mode of inotifywatch
+
+Verify that:
+1. --top prints the busiest watches of each interval, busiest first
+2. --interval without --top is rejected
+'
+
+. ./sharness.sh
+
+logfile="log"
+
+run_() {
+    export LD_LIBRARY_PATH="../../libinotifytools/src/"
+
+    rm -rf root && mkdir -p root/busy root/quiet root/idle || return 1
+
+    ../../src/inotifywatch \
+        --recursive \
+        "$@" \
+        root >$logfile 2>/dev/null &
+
+    inotifywatch_pid=$!
+
+    sleep 1
+
+    for i in 1 2 3 4 5; do
+        echo $i >>root/busy/$i
+    done
+    echo 1 >>root/quiet/1
+
+    sleep 1
+
+    kill $inotifywatch_pid
+    wait $inotifywatch_pid
+}
+
+test_expect_success 'busiest watches are listed first' '
+    run_ --top 2 --interval 1m --event MODIFY --descending MODIFY &&
+    grep "^5  *[0-9.]*  *5  *root/busy/$" $logfile &&
+    grep "^1  *[0-9.]*  *1  *root/quiet/$" $logfile &&
+    ! grep "idle" $logfile &&
+    grep -A1 "^delta" $logfile | grep busy
+'
+
+test_expect_success '--interval requires --top' '
+    test_must_fail ../../src/inotifywatch --interval 1s . 2>err &&
+    grep "only be used with --top" err
+'
+
+test_done